@@ -0,0 +1,452 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file        bench.c
+ *
+ * @brief       Throughput and latency benchmark for Pointer Queue library
+ *
+ * Runs N producers against M consumers for every combination of engine,
+ * thread counts, batch size and capacity given on the command line and
+ * prints one CSV line or JSON object per run.
+ *
+ * @copyright   Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date        Mar 2024
+ * @author      Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <linux/types.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+/* Most values in one comma separated option
+ */
+#define BENCH_LIST_MAX 16
+
+/* Largest batch of one pq_push_n() / pq_pop_n()
+ */
+#define BENCH_BATCH_MAX 1024
+
+/* Most threads on one side of a run
+ */
+#define BENCH_THREADS_MAX 256
+
+/* ENUMERATIONS ==============================================================*/
+
+/* Output formats
+ */
+enum bench_format {
+	BENCH_CSV			= 0,
+	BENCH_JSON			= 1,
+};
+
+/* STRUCTS ===================================================================*/
+
+/*
+ * One run: a queue, its threads and what they are asked to move
+ */
+struct bench_run {
+	struct ptr_queue *pq;
+	int engine;
+	int producers;
+	int consumers;
+	__u32 batch;
+	__u32 capacity;
+	__u64 ops;					//!< Entries per producer
+	int pin;					//!< Pin thread i to the i-th allowed CPU
+	pthread_barrier_t start;	//!< Releases all threads and the timer together
+};
+
+/*
+ * Arguments of one producer or consumer thread
+ */
+struct bench_thread {
+	struct bench_run *run;
+	int index;					//!< Index among all threads, for pinning
+	__u64 count;				//!< Entries to push or pop
+};
+
+/* GLOBAL VARIABLES ==========================================================*/
+
+/* Names of the engines, indexed by enum pq_engine
+ */
+static const char *engine_names[PQ_ENGINE_MAX] = { "mutex", "spsc", "mpmc", "chunked" };
+
+/* CPUs the process may run on, in the order threads are pinned to them
+ */
+static int cpus[CPU_SETSIZE];
+static int ncpus;
+
+/* PROTOTYPES ================================================================*/
+
+static void *consumer(void *arg);
+static double now(void);
+static int parse_list(const char *arg, long *vals);
+static void pin(int index);
+static void *producer(void *arg);
+static double run(struct bench_run *r, __u64 ops);
+static void usage(const char *name);
+
+/* FUNCTIONS =================================================================*/
+
+/*
+ * Pop count entries in batches, blocking while the queue is empty
+ */
+static void *consumer(void *arg)
+{
+	struct bench_thread *t;
+	void *buf[BENCH_BATCH_MAX];
+	__u64 left;
+	__s32 n;
+
+	t = (struct bench_thread *) arg;
+	left = t->count;
+
+	if (t->run->pin)
+		pin(t->index);
+
+	pthread_barrier_wait(&t->run->start);
+
+	while (left > 0)
+	{
+		n = pq_pop_n(t->run->pq, buf, left < t->run->batch ? left : t->run->batch, 1);
+		if (n > 0)
+			left -= n;
+	}
+
+	return NULL;
+}
+
+/*
+ * Return CLOCK_MONOTONIC in seconds
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Parse a comma separated list of positive numbers or engine names
+ *
+ * Returns the number of values, 0 if the list is malformed
+ */
+static int parse_list(const char *arg, long *vals)
+{
+	char *copy, *tok, *save, *end;
+	int n, e;
+
+	n = 0;
+	copy = strdup(arg);
+
+	for ( tok = strtok_r(copy, ",", &save) ; tok != NULL ; tok = strtok_r(NULL, ",", &save) )
+	{
+		if (n == BENCH_LIST_MAX)
+		{
+			n = 0;
+			break;
+		}
+
+		for ( e = 0 ; e < PQ_ENGINE_MAX && strcmp(tok, engine_names[e]) != 0 ; e++ )
+			;
+		if (e < PQ_ENGINE_MAX)
+		{
+			vals[n++] = e;
+			continue;
+		}
+
+		vals[n] = strtol(tok, &end, 0);
+		if (*end != '\0' || vals[n] <= 0)
+		{
+			n = 0;
+			break;
+		}
+		n++;
+	}
+
+	free(copy);
+
+	return n;
+}
+
+/*
+ * Pin the calling thread to the CPU for its index, round robin over the CPUs
+ * the process may use
+ */
+static void pin(int index)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpus[index % ncpus], &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/*
+ * Push count entries in batches, blocking while the queue is full
+ */
+static void *producer(void *arg)
+{
+	struct bench_thread *t;
+	void *buf[BENCH_BATCH_MAX];
+	__u64 left;
+	__u32 k;
+	__s32 n;
+
+	t = (struct bench_thread *) arg;
+	left = t->count;
+
+	for ( __u32 i = 0 ; i < t->run->batch ; i++ )
+		buf[i] = (void*) (uintptr_t) (i + 1);
+
+	if (t->run->pin)
+		pin(t->index);
+
+	pthread_barrier_wait(&t->run->start);
+
+	while (left > 0)
+	{
+		k = left < t->run->batch ? left : t->run->batch;
+		n = pq_push_n(t->run->pq, buf, k);
+		if (n > 0)
+		{
+			left -= n;
+			continue;
+		}
+
+		// Full: sleep until one entry fits instead of spinning on the batch
+		if (pq_push_wait(t->run->pq, buf[0]) == 0)
+			left--;
+	}
+
+	return NULL;
+}
+
+/*
+ * Move ops entries per producer through the queue of a run
+ *
+ * The consumers split the total between them so every thread knows when it
+ * is done without a sentinel. The clock starts once every thread is at 
+ * the start barrier. Exits if a thread cannot be started.
+ *
+ * Returns the seconds from the start barrier until the last thread is done
+ */
+static double run(struct bench_run *r, __u64 ops)
+{
+	pthread_t threads[2 * BENCH_THREADS_MAX];
+	struct bench_thread args[2 * BENCH_THREADS_MAX];
+	__u64 total;
+	double t0;
+	int n;
+
+	total = ops * r->producers;
+	n = r->producers + r->consumers;
+
+	pthread_barrier_init(&r->start, NULL, n + 1);
+
+	for ( int i = 0 ; i < n ; i++ )
+	{
+		args[i].run = r;
+		args[i].index = i;
+		if (i < r->producers)
+			args[i].count = ops;
+		else
+			args[i].count = total / r->consumers +
+				(i - r->producers < (int) (total % r->consumers));
+
+		if (pthread_create(&threads[i], NULL,
+			i < r->producers ? producer : consumer, &args[i]) != 0)
+		{
+			fprintf(stderr, "cannot start thread %d\n", i);
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&r->start);
+	t0 = now();
+
+	for ( int i = 0 ; i < n ; i++ )
+		pthread_join(threads[i], NULL);
+
+	pthread_barrier_destroy(&r->start);
+
+	return now() - t0;
+}
+
+/*
+ * Print the command line options
+ */
+static void usage(const char *name)
+{
+	printf("Usage: %s [options]\n", name);
+	printf("Options take comma separated lists, every combination is run\n");
+	printf("  -e engines    mutex,spsc,mpmc,chunked      (default all)\n");
+	printf("  -p producers  Producer threads             (default 1)\n");
+	printf("  -c consumers  Consumer threads             (default 1)\n");
+	printf("  -b batch      Entries per push_n / pop_n   (default 1, max %d)\n", BENCH_BATCH_MAX);
+	printf("  -q capacity   Queue capacity               (default 1024)\n");
+	printf("  -n ops        Entries per producer         (default 1000000)\n");
+	printf("  -w ops        Warmup entries per producer  (default ops / 10)\n");
+	printf("  -a            Pin threads to CPUs round robin\n");
+	printf("  -l            Record latency percentiles (PQ_ATTR_LATENCY)\n");
+	printf("  -j            JSON output instead of CSV\n");
+}
+
+int main(int argc, char **argv)
+{
+	long engines[BENCH_LIST_MAX], prods[BENCH_LIST_MAX], cons[BENCH_LIST_MAX];
+	long batches[BENCH_LIST_MAX], caps[BENCH_LIST_MAX];
+	int ne, np, nc, nb, nq, opt, format, lat, first;
+	struct pq_latency l;
+	struct pq_attr attr;
+	struct bench_run r;
+	__s64 warm;
+	double secs;
+	cpu_set_t set;
+
+	// Defaults
+	memset(&r, 0, sizeof(r));
+	ne = PQ_ENGINE_MAX;
+	for ( int i = 0 ; i < ne ; i++ )
+		engines[i] = i;
+	np = nc = nb = nq = 1;
+	prods[0] = cons[0] = batches[0] = 1;
+	caps[0] = 1024;
+	r.ops = 1000000;
+	warm = -1;
+	format = BENCH_CSV;
+	lat = 0;
+
+	while ((opt = getopt(argc, argv, "e:p:c:b:q:n:w:aljh")) != -1)
+	{
+		switch (opt)
+		{
+			case 'e': ne = parse_list(optarg, engines);	break;
+			case 'p': np = parse_list(optarg, prods);	break;
+			case 'c': nc = parse_list(optarg, cons);	break;
+			case 'b': nb = parse_list(optarg, batches);	break;
+			case 'q': nq = parse_list(optarg, caps);	break;
+			case 'n': r.ops = strtoull(optarg, NULL, 0);	break;
+			case 'w': warm = strtoll(optarg, NULL, 0);	break;
+			case 'a': r.pin = 1;	break;
+			case 'l': lat = 1;		break;
+			case 'j': format = BENCH_JSON;	break;
+			default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (ne == 0 || np == 0 || nc == 0 || nb == 0 || nq == 0 || r.ops == 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	if (warm < 0)
+		warm = r.ops / 10;
+
+	// CPUs to pin to
+	sched_getaffinity(0, sizeof(set), &set);
+	for ( int i = 0 ; i < CPU_SETSIZE ; i++ )
+		if (CPU_ISSET(i, &set))
+			cpus[ncpus++] = i;
+
+	if (format == BENCH_CSV)
+		printf("engine,producers,consumers,batch,capacity,ops,seconds,mops,p50_ns,p99_ns,p999_ns,max_ns\n");
+	else
+		printf("[\n");
+	first = 1;
+
+	for ( int e = 0 ; e < ne ; e++ )
+	for ( int p = 0 ; p < np ; p++ )
+	for ( int c = 0 ; c < nc ; c++ )
+	for ( int b = 0 ; b < nb ; b++ )
+	for ( int q = 0 ; q < nq ; q++ )
+	{
+		r.engine = engines[e];
+		r.producers = prods[p];
+		r.consumers = cons[c];
+		r.batch = batches[b];
+		r.capacity = caps[q];
+
+		if (r.engine < 0 || r.engine >= PQ_ENGINE_MAX ||
+			r.producers > BENCH_THREADS_MAX || r.consumers > BENCH_THREADS_MAX ||
+			r.batch > BENCH_BATCH_MAX)
+		{
+			usage(argv[0]);
+			return 1;
+		}
+
+		// The SPSC engine only has one thread on each side
+		if (r.engine == PQ_ENGINE_SPSC && (r.producers > 1 || r.consumers > 1))
+			continue;
+
+		pq_attr_init(&attr);
+		attr.engine = r.engine;
+		if (lat && r.engine != PQ_ENGINE_CHUNKED)
+			attr.flags |= PQ_ATTR_LATENCY;
+
+		r.pq = pq_init_attr(r.capacity, 0, &attr);
+		if (r.pq == NULL)
+		{
+			fprintf(stderr, "pq_init_attr(%s, %u): %s\n", engine_names[r.engine],
+				r.capacity, strerror(errno));
+			return 1;
+		}
+
+		// Warm up caches, page tables and the wait strategy, then measure
+		if (warm > 0)
+			run(&r, warm);
+		pq_latency_reset(r.pq);
+
+		secs = run(&r, r.ops);
+
+		memset(&l, 0, sizeof(l));
+		pq_latency(r.pq, &l);
+
+		if (format == BENCH_CSV)
+			printf("%s,%d,%d,%u,%u,%llu,%.6f,%.3f,%llu,%llu,%llu,%llu\n",
+				engine_names[r.engine], r.producers, r.consumers, r.batch,
+				r.capacity, (unsigned long long) r.ops * r.producers, secs,
+				r.ops * r.producers / secs / 1e6,
+				(unsigned long long) l.p50, (unsigned long long) l.p99,
+				(unsigned long long) l.p999, (unsigned long long) l.max);
+		else
+			printf("%s  {\"engine\": \"%s\", \"producers\": %d, \"consumers\": %d, "
+				"\"batch\": %u, \"capacity\": %u, \"ops\": %llu, \"seconds\": %.6f, "
+				"\"mops\": %.3f, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+				"\"p999_ns\": %llu, \"max_ns\": %llu}",
+				first ? "" : ",\n", engine_names[r.engine], r.producers,
+				r.consumers, r.batch, r.capacity,
+				(unsigned long long) r.ops * r.producers, secs,
+				r.ops * r.producers / secs / 1e6,
+				(unsigned long long) l.p50, (unsigned long long) l.p99,
+				(unsigned long long) l.p999, (unsigned long long) l.max);
+		fflush(stdout);
+		first = 0;
+
+		pq_free(r.pq);
+	}
+
+	if (format == BENCH_JSON)
+		printf("\n]\n");
+
+	return 0;
+}
@@ -13,6 +13,10 @@
 
 /* INCLUDES ==================================================================*/
 
+/* getcpu()
+ */
+#define _GNU_SOURCE
+
 /* free()
  */
 #include <stdlib.h>
@@ -38,6 +42,64 @@
  */
 #include <pthread.h>
 
+/* clock_gettime()
+ * CLOCK_MONOTONIC
+ */
+#include <time.h>
+
+/* sched_yield()
+ */
+#include <sched.h>
+
+/* INT_MAX
+ */
+#include <limits.h>
+
+/* max_align_t
+ */
+#include <stddef.h>
+
+/* syscall()
+ * SYS_futex
+ */
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/* eventfd()
+ */
+#include <sys/eventfd.h>
+
+/* mmap()
+ * munmap()
+ * madvise()
+ * mlock()
+ * shm_open()
+ * memfd_create()
+ */
+#include <sys/mman.h>
+
+/* fstat()
+ */
+#include <sys/stat.h>
+
+/* O_CREAT
+ * O_RDWR
+ */
+#include <fcntl.h>
+
+/* FUTEX_WAIT_BITSET_PRIVATE
+ * FUTEX_WAKE_PRIVATE
+ */
+#include <linux/futex.h>
+
+/* MPOL_PREFERRED
+ */
+#include <linux/mempolicy.h>
+
+/* UINT32_MAX
+ */
+#include <stdint.h>
+
 /* __u32
  * __s32
  */
@@ -47,101 +109,382 @@
 
 /* MACROS ====================================================================*/
 
+/* Spin loop hint to the CPU
+ */
+#if defined(__x86_64__) || defined(__i386__)
+ #define pq_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+ #define pq_cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+ #define pq_cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/* Lower bound of the adaptive spin budget
+ */
+#define PQ_SPIN_MIN 16
+
+/* Sub-buckets per power of two of a sojourn time histogram, as a power of 
+ * two. 4 bits bound the relative error of a bucket to 1/16
+ */
+#define PQ_HIST_SUB_BITS	4
+#define PQ_HIST_BUCKETS		((64 - PQ_HIST_SUB_BITS + 1) << PQ_HIST_SUB_BITS)
+
+/* Header identification of a shared memory queue
+ */
+#define PQ_SHM_MAGIC	0x50515348		// "PQSH"
+#define PQ_SHM_VERSION	1
+
+/* Over-aligned heap allocations at least this large are mapped instead, 
+ * the pages come zeroed and are only committed when first touched. Same as
+ * the default mmap threshold of glibc malloc
+ */
+#define PQ_MEM_MAP_MIN	(128 * 1024)
+
 /* ENUMERATIONS ==============================================================*/
 
+/* Rings of a shared memory queue
+ */
+enum pq_shm_rings {
+	PQ_SHM_FREE			= 0,	// Free objects of the pool
+	PQ_SHM_WORK			= 1,	// Objects sent with pq_shm_push()
+};
+
+/* Counters of a PQ_ATTR_STATS queue, in the order of struct pq_stats
+ */
+enum pq_stat {
+	PQ_STAT_PUSHES		= 0,
+	PQ_STAT_POPS,
+	PQ_STAT_FULL,
+	PQ_STAT_EMPTY,
+	PQ_STAT_TRYLOCK_FAILS,
+	PQ_STAT_WAITS,
+	PQ_STAT_SIGNALS,
+	PQ_STAT_LOCK_WAIT_NS,
+	PQ_STAT_WAIT_NS,
+	PQ_STAT_MAX
+};
+
 /* STRUCTS ===================================================================*/
 
+/* 
+ * Fixed size chunk of slots of a PQ_ENGINE_CHUNKED queue
+ *
+ * Chunks are linked from the head chunk to the tail chunk. A chunk holds 
+ * array_capacity slots
+ */
+struct pq_chunk {
+	struct pq_chunk *next;
+	size_t map;
+	void *slots[];
+};
+
+/* 
+ * Log-linear histogram of sojourn times of a PQ_ATTR_LATENCY queue
+ *
+ * Values below 2^PQ_HIST_SUB_BITS ns have a bucket each. Above, every power
+ * of two is split into 2^PQ_HIST_SUB_BITS equal buckets. Updated with relaxed 
+ * atomic adds by the consumers.
+ */
+struct pq_hist {
+	__u64 count[PQ_HIST_BUCKETS];
+	__u64 max;
+};
+
+/* 
+ * Per thread cache of free pool objects
+ *
+ * Only the owning thread touches count and objs. The links are protected 
+ * by pq->mtx so pq_free() can release magazines of threads still running
+ */
+struct pq_mag {
+	struct ptr_queue *pq;
+	struct pq_mag *next;
+	struct pq_mag *prev;
+	__u32 count;
+	void *objs[];
+};
+
+/*
+ * Magazines of a thread, indexed by the mag_id of their pool
+ *
+ * A freed pool's id is reused by later pools. serial tells the magazine of 
+ * the live pool from one left behind by a freed pool, which pq_free() has 
+ * already released.
+ */
+struct pq_mag_table {
+	__u32 count;
+	struct {
+		struct pq_mag *mag;
+		__u64 serial;
+	} slot[];
+};
+
+/* 
+ * Indices of a ring in a shared memory queue
+ *
+ * Consumers of every process park on ec while waiting is non zero
+ */
+struct pq_shm_ring {
+	__u32 tail PQ_ALIGNED;
+	__u32 ec;
+	int waiting;
+	__u32 head PQ_ALIGNED;
+};
+
+/* 
+ * Header at the start of a shared memory queue region
+ *
+ * Everything past the header is found through offsets so processes may map
+ * the region at different addresses. magic is stored last by the creator.
+ */
+struct pq_shm_hdr {
+	__u32 magic;
+	__u32 version;
+	__u32 capacity;
+	__u32 count;
+	__u64 size;
+	__u64 obj_size;
+	__u64 obj_stride;
+	__u64 buf_off;
+	__u64 slots_off[PQ_SHM_RINGS];
+	__u64 seq_off[PQ_SHM_RINGS];
+	struct pq_shm_ring ring[PQ_SHM_RINGS];
+};
+
+/* 
+ * One shard of the counters of a PQ_ATTR_STATS queue
+ *
+ * Each shard sits on its own cache lines. A thread always counts into the
+ * same shard, several threads may share one.
+ */
+struct pq_stats_shard {
+	__u64 count[PQ_STAT_MAX] PQ_ALIGNED;
+};
+
 /* PROTOTYPES ================================================================*/
 
+static void pq_async_unlink(struct ptr_queue *pq, struct pq_waiter *w);
+static void pq_async_wake(struct ptr_queue *pq, __u32 n, int full);
+static int pq_bcast_full(struct pq_bcast *b);
+static void pq_bcast_park(struct pq_bcast *b, int id);
+static struct pq_chunk *pq_chunk_get(struct ptr_queue *pq);
+static __s32 pq_chunk_pop_n(struct ptr_queue *pq, void **out, __u32 max, int wait, const struct timespec *deadline);
+static __s32 pq_chunk_push_n(struct ptr_queue *pq, void **ptrs, __u32 n);
+static void pq_chunk_put(struct ptr_queue *pq, struct pq_chunk *chunk);
+static void pq_cond_wake(struct ptr_queue *pq, pthread_cond_t *cond, int waiting, __u32 n);
+static int pq_cond_wait(struct ptr_queue *pq, pthread_cond_t *cond, pthread_mutex_t *mtx, const struct timespec *deadline);
+static int pq_deadline(const struct timespec *ts, int flags, struct timespec *deadline);
+static int pq_ec_wait(struct ptr_queue *pq, __u32 *ec, int *waiters, int full, const struct timespec *deadline);
+static int pq_ec_wake(__u32 *ec, int *waiters, __u32 n);
+static int pq_futex_wait(__u32 *uaddr, __u32 val, int shared, const struct timespec *deadline);
+static void pq_futex_wake(__u32 *uaddr, int n, int shared);
+static int pq_group_park(struct pq_group *g);
+static __s32 pq_group_steal(struct pq_group *g, int worker, void **out, __u32 max);
+static __u32 pq_latency_bucket(__u64 ns);
+static __u64 pq_latency_ceil(__u32 bucket);
+static void pq_latency_record(struct ptr_queue *pq, __u32 slot, __u32 n);
+static void pq_latency_stamp(struct ptr_queue *pq, __u32 slot, __u32 n);
+static int pq_lf_empty(struct ptr_queue *pq);
+static int pq_lf_full(struct ptr_queue *pq);
+static __s32 pq_lf_len(struct ptr_queue *pq);
+static int pq_lf_park(struct ptr_queue *pq, const struct timespec *deadline);
+static int pq_lf_park_full(struct ptr_queue *pq, const struct timespec *deadline);
+static int pq_lf_wait(struct ptr_queue *pq, int full, const struct timespec *deadline);
+static void pq_lf_wake(struct ptr_queue *pq, __u32 n);
+static void pq_lf_wake_full(struct ptr_queue *pq, __u32 n);
+static void pq_lock(struct ptr_queue *pq, pthread_mutex_t *mtx);
+static struct pq_mag *pq_mag_find(struct ptr_queue *pq);
+static struct pq_mag *pq_mag_get(struct ptr_queue *pq);
+static void pq_mag_key_init(void);
+static int pq_mag_register(struct ptr_queue *pq);
+static void pq_mag_release(void *arg);
+static void *pq_mem_alloc(size_t size, size_t align, __u32 flags, int node, size_t *map);
+static void pq_mem_free(void *ptr, size_t map);
+static __u32 pq_mpmc_claim_pop(struct ptr_queue *pq, __u32 max, int contig, int wait, __u32 *pos);
+static __u32 pq_mpmc_claim_push(struct ptr_queue *pq, __u32 n, int contig, __u32 *pos);
+static __s32 pq_mpmc_pop(struct ptr_queue *pq, void **ptr, int wait, const struct timespec *deadline, void *out);
+static __s32 pq_mpmc_pop_n(struct ptr_queue *pq, void **out, __u32 max, int wait);
+static int pq_mpmc_push(struct ptr_queue *pq, void *ptr);
+static __s32 pq_mpmc_push_n(struct ptr_queue *pq, void **ptrs, __u32 n);
+static void *pq_msg_slot(struct ptr_queue *pq, __u32 slot);
+static void pq_notify(struct ptr_queue *pq);
+static void pq_numa_pool_park(struct pq_numa_pool *np);
+static int pq_numa_online(__u8 *online);
+static void pq_overflow_evict(struct ptr_queue *pq, void **evicted);
+static void *pq_pop_deadline(struct ptr_queue *pq, int wait, const struct timespec *deadline, void *out);
+static void pq_prio_park(struct pq_prio *p);
+static int pq_push_deadline(struct ptr_queue *pq, void *ptr, int copy, int wait, const struct timespec *deadline, void **evicted);
+static __u32 pq_ring_advance(struct ptr_queue *pq, __u32 pos, __u32 n);
+static __u32 pq_ring_count(struct ptr_queue *pq, __u32 head, __u32 tail);
+static int pq_ring_grow(struct ptr_queue *pq, __u32 n);
+static void pq_ring_read(struct ptr_queue *pq, __u32 pos, void **out, __u32 n);
+static int pq_ring_resize(struct ptr_queue *pq, __u32 count);
+static void pq_ring_shrink(struct ptr_queue *pq);
+static __u32 pq_ring_slot(struct ptr_queue *pq, __u32 pos);
+static void pq_ring_write(struct ptr_queue *pq, __u32 pos, void **ptrs, __u32 n);
+static struct pq_shm *pq_shm_attach(int fd);
+static __u64 pq_shm_obj(struct pq_shm *sq, void *obj);
+static void *pq_shm_ring_pop(struct pq_shm *sq, int r, int wait);
+static int pq_shm_ring_push(struct pq_shm *sq, int r, __u64 off);
+static void *pq_slot_load(struct ptr_queue *pq, __u32 slot, void *out);
+static void pq_slot_store(struct ptr_queue *pq, __u32 slot, void *ptr);
+static int pq_spin(struct ptr_queue *pq, int full, const struct timespec *deadline);
+static __s32 pq_spsc_pop(struct ptr_queue *pq, void **ptr, int wait, const struct timespec *deadline, void *out);
+static __s32 pq_spsc_pop_n(struct ptr_queue *pq, void **out, __u32 max, int wait);
+static int pq_spsc_push(struct ptr_queue *pq, void *ptr);
+static __s32 pq_spsc_push_n(struct ptr_queue *pq, void **ptrs, __u32 n);
+static void pq_stats_add(struct ptr_queue *pq, int stat, __u64 n);
+static void pq_stats_level(struct ptr_queue *pq, __u32 len);
+static __u64 pq_stats_now(void);
+static void pq_stats_pop(struct ptr_queue *pq, __u32 n);
+static void pq_stats_push(struct ptr_queue *pq, __u32 n);
+static void pq_watermark(struct ptr_queue *pq);
+
 /* GLOBAL VARIABLES ==========================================================*/
 
+/* Counter shard of the calling thread, 0 until its first count. Threads are
+ * numbered in the order they first count
+ */
+static __thread __u32 pq_stats_slot;
+static __u32 pq_stats_threads;
+
+/* One key for the magazines of every pool, its value is the thread's struct
+ * pq_mag_table. pq_mag_serials holds the serial of the live pool of each 
+ * mag_id, 0 if the id is free, and is protected by pq_mag_lock
+ */
+static pthread_key_t pq_mag_key;
+static pthread_once_t pq_mag_once = PTHREAD_ONCE_INIT;
+static int pq_mag_key_err;
+static pthread_mutex_t pq_mag_lock = PTHREAD_MUTEX_INITIALIZER;
+static __u64 *pq_mag_serials;
+static __u32 pq_mag_ids;
+static __u64 pq_mag_serial;
+
 /* FUNCTIONS =================================================================*/
 
 /*
- * Return 1 if empty,
- *        0 if not empty 
- *       -1 if there was an error and set errno
- * 
- * STEPS:
- * 1: Validate inputs 
- * 2: Obtain lock 
- * 3: Check if head and tail are equal
- * 4: Unlock mutex and return 
+ * Take back a waiter registered with pq_async_wait()
+ *
+ * Return 0 if the waiter was taken back and its fn will not be called, 1 and
+ * set errno otherwise (ENOENT if fn has been or is being called)
  */
-int pq_empty(struct ptr_queue *pq)
+int pq_async_cancel(struct ptr_queue *pq, struct pq_waiter *w)
 {
 	int rv;
 
-	// Initialize variables 
-	rv = -1;
+	// Initialize variables
+	rv = 1;
 
-	// STEP 1: Validate inputs 
-	if (pq == NULL) 
+	// STEP 1: Validate inputs
+	if (pq == NULL || w == NULL)
 	{
 		errno = EINVAL;
 		goto end;
 	}
 
-	// STEP 2: Obtain lock 
-	pthread_mutex_lock(&pq->mtx); 
-
-	// STEP 3: Check if head and tail are equal
-	if (pq->head == pq->tail)
-		rv = 1;
-	else 
+	// STEP 2: Unlink the waiter if no waker has taken it yet
+	pthread_mutex_lock(&pq->mtx);
+	if (w->next != NULL)
+	{
+		pq_async_unlink(pq, w);
 		rv = 0;
-
-	// STEP 4: Unlock mutex and return 
-	pthread_mutex_unlock(&pq->mtx); 
+	}
+	else
+		errno = ENOENT;
+	pthread_mutex_unlock(&pq->mtx);
 
 end:
 
 	return rv;
 }
 
-/* 
- * Relese allocated memory for this ring buffer
+/*
+ * Unlink a waiter from its list, called with mtx held
+ */
+static void pq_async_unlink(struct ptr_queue *pq, struct pq_waiter *w)
+{
+	w->prev->next = w->next;
+	w->next->prev = w->prev;
+	w->next = NULL;
+	w->prev = NULL;
+
+	__atomic_sub_fetch(w->full ? &pq->async_waiting_full : &pq->async_waiting, 1, 
+			__ATOMIC_RELAXED);
+}
+
+/*
+ * Register a continuation to call when the queue may be ready, instead of 
+ * blocking
  *
- * Return 0 upon success, 1 otherwise and set errno
+ * fn is called once, from the thread that pushed an entry (full == 0) or 
+ * popped one (full == 1), without any queue lock held. Another consumer or 
+ * producer may get there first, so fn should try the pop or push again and 
+ * register again if it fails. Each entry or slot made available calls at 
+ * most one waiter, in the order they registered. fn runs within that push 
+ * or pop, and pushes or pops of its own call other waiters re-entrantly.
+ *
+ * Param:
+ *	w    : Waiter with fn set, owned by the caller
+ *	full : Zero to wait for an entry to pop, non zero for a free slot to push
+ *
+ * Return 0 if the waiter is registered, 1 and set errno otherwise (EALREADY
+ * if the queue is already ready, retry the call that failed)
  *
  * STEPS
- * 1: Validate inputs 
- * 2: Free mutex variables
- * 3: Free data buffer 
- * 4: Free object pointer 
+ * 1: Validate inputs
+ * 2: Append the waiter and announce it
+ * 3: Check the queue again, a push or pop may have raced the announcement
+ * 4: Take the waiter back if the queue is already ready
+ * 5: Unlock, w may be called and freed from here on
  */
-int pq_free(struct ptr_queue *pq)
+int pq_async_wait(struct ptr_queue *pq, struct pq_waiter *w, int full)
 {
-	 int rv; 
+	struct pq_waiter *list;
+	int rv, ready;
 
-	 // Initialize variables 
-	 rv = 1;
+	// Initialize variables
+	rv = 1;
 
-	 // STEP 1: Validate inputs 
-	 if (pq == NULL) 
-	 {
+	// STEP 1: Validate inputs
+	if (pq == NULL || w == NULL || w->fn == NULL)
+	{
 		errno = EINVAL;
 		goto end;
-	 }
+	}
 
-	// STEP 2: Free mutex variables
-	pthread_mutex_destroy(&pq->mtx);
-	pthread_cond_destroy(&pq->cond);
+	// STEP 2: Append the waiter and announce it
+	full = (full != 0);
+	list = full ? &pq->async_full : &pq->async;
 
-	// Free buffer for entries 
-	if (pq->buf != NULL) 
-		free(pq->buf);
-	pq->buf = NULL;
-	
-	// STEP 3: Free data buffer 
-	if ( pq->data != NULL )
-		free(pq->data);
-	pq->data = NULL;
+	pthread_mutex_lock(&pq->mtx);
+	w->full = full;
+	w->next = list;
+	w->prev = list->prev;
+	list->prev->next = w;
+	list->prev = w;
+	__atomic_add_fetch(full ? &pq->async_waiting_full : &pq->async_waiting, 1, 
+			__ATOMIC_SEQ_CST);
 
-	// STEP 4: Free object ptr 
-	free(pq);
+	/* STEP 3: Check the queue again, a push or pop may have raced the announcement
+	 * A waker that saw the announcement blocks on mtx until the check is done
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (full)
+		ready = !pq_lf_full(pq);
+	else
+		ready = !pq_lf_empty(pq);
 
+	// STEP 4: Take the waiter back if the queue is already ready
 	rv = 0;
+	if (ready)
+	{
+		pq_async_unlink(pq, w);
+		errno = EALREADY;
+		rv = 1;
+	}
+
+	// STEP 5: Unlock, w may be called and freed from here on
+	pthread_mutex_unlock(&pq->mtx);
 
 end:
 
@@ -149,297 +492,6821 @@ end:
 }
 
 /*
- * Create and initialize a pointer queue
- *
- * Param: 
- *	count   : This is the number of buffer entries 
- *  wr_mtx 	: A thread mutex that will wake up the writer thread when the queue goes not full
- *  rd_mtx 	: A thread mutex that will wake up the reader thread when the queue goes non empty
- * 
- * Returns a pointer to a struct ptr_queue upon success. Upon error, returns NULL and sets errno 
+ * Call up to n waiters registered with pq_async_wait()
  *
- * STEPS
- * 1. Validate inputs
- * 2. Allocate memory for ring_buffer struct 
- * 3. Allocate memory for data buffer 
- * 4: Initialize mutex variables
+ * Called without any queue lock held after n entries (full == 0) or slots 
+ * (full == 1) were made available. Costs a fence and a load when nobody 
+ * waits, the fence pairs with the one of pq_async_wait() as in pq_ec_wake().
  */
-struct ptr_queue *pq_init(
-	size_t count,
-	size_t obj_size)
+static void pq_async_wake(struct ptr_queue *pq, __u32 n, int full)
 {
-	struct ptr_queue *pq;
+	struct pq_waiter *list, *w;
 
-	// Initialize variables 
-	pq = NULL;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(full ? &pq->async_waiting_full : &pq->async_waiting, 
+				__ATOMIC_RELAXED) == 0)
+		return;
 
-	// STEP 1. Validate inputs
-	if (count == 0) 
-	{
-		errno = EINVAL;
-		goto end;
-	}
-	
-	// STEP 2. Allocate memory for ptr_queue struct 
-	pq = (struct ptr_queue*) calloc(1, sizeof(struct ptr_queue));
-	if (pq == 0) 
-	{
-		errno = ENOMEM;
-		goto end;
-	}
-	pq->array_capacity = count + 1;
-	pq->user_capacity = count;
+	list = full ? &pq->async_full : &pq->async;
 
-	// STEP 3. Allocate memory for ptr uffer 
-	pq->data = (void **) calloc (pq->array_capacity, sizeof(void *)); 
-	if (pq->data == 0) 
-	{
-		errno = ENOMEM;
-		free(pq);
-		pq = NULL;
-		goto end;
-	}
-	
-	// STEP 4: Allocate memory for objects and insert them into queue 
-	if (obj_size > 0)
+	// fn may register again or free the waiter, so take one at a time
+	for ( ; n > 0 ; n-- )
 	{
-		pq->buf = (__u8*) calloc (count, obj_size); 
-		if (pq->buf == 0) 
+		pthread_mutex_lock(&pq->mtx);
+		w = list->next;
+		if (w == list)
 		{
-			errno = ENOMEM;
-			goto end;
+			pthread_mutex_unlock(&pq->mtx);
+			break;
 		}
+		pq_async_unlink(pq, w);
+		pthread_mutex_unlock(&pq->mtx);
 
-		for ( size_t i = 0 ; i < count ; i++ )
-			pq_push(pq, &pq->buf[i*obj_size]);	
+		w->fn(w);
 	}
-
-	// STEP 4: Initialize mutex variables
-	pthread_mutex_init(&pq->mtx, NULL);
-	pthread_cond_init(&pq->cond, NULL);
-
-end:
-
-	return pq;
 }
 
-/* 
- * Returns the length in number of entries. Returns a negative number upon error and sets errno.
+/*
+ * Initialize a pq_attr object to the default attributes
  *
- * STEPS
- * 1: Validate inputs
- * 2: Obtain lock
- * 3: Compute length 
- * 4: Unlock 
+ * Defaults: PQ_ENGINE_MUTEX, no flags, PQ_WAIT_PARK, PQ_NUMA_ANY
+ *
+ * Return 0 upon success, 1 otherwise and set errno
  */
-__s32 pq_len(struct ptr_queue *pq)
+int pq_attr_init(struct pq_attr *attr)
 {
-	__s32 rv;
+	int rv;
 
-	// Inittialize variables
-	rv = 0;
+	// Initialize variables
+	rv = 1;
 
 	// STEP 1: Validate inputs
-	if (pq == NULL) 
-	{ 
+	if (attr == NULL)
+	{
 		errno = EINVAL;
-		rv = -EINVAL;
 		goto end;
 	}
 
-	// STEP 2: Obtain lock
-	pthread_mutex_lock(&pq->mtx);
-
-	// STEP 3: Compute length 
-
-	// Empty state 
-	if (pq->head == pq->tail) 
-		rv = 0;
-
-	// Normal state 
-	else if (pq->tail > pq->head)
-		rv = pq->tail - pq->head;
+	// STEP 2: Set defaults
+	memset(attr, 0, sizeof(*attr));
+	attr->engine = PQ_ENGINE_MUTEX;
+	attr->wait_strategy = PQ_WAIT_PARK;
+	attr->spin = PQ_SPIN_DEFAULT;
+	attr->numa_node = PQ_NUMA_ANY;
 
-	// wrap around state 
-	else if (pq->head > pq->tail) 
-		rv = (pq->array_capacity - pq->head) + pq->tail; 
+	rv = 0;
 
-	// STEP 4: Unlock 
-	pthread_mutex_unlock(&pq->mtx);
-	
 end:
 
 	return rv;
 }
 
 /*
- * Return the pointer at the current head location 
- * 
- * Return pointer  upon success, 0 otherwise and set errno
- * 
- * STEPS
- * 1: Validate input 
- * 2: Obtain lock
- * 3: Check if we are empty 
- * 4: Get the value out of the array
- * 5: Compute new head index 
- * 6: Unlock mutex and return 
+ * Return the number of entries a reader of a broadcast ring skipped
+ *
+ * Counts the entries PQ_BCAST_DROP overwrote before the reader got to them 
+ * since it joined. Another thread may read it while the reader pops.
+ *
+ * Returns 0 and sets errno if b is NULL or id is not a reader slot
  */
-void *pq_pop(struct ptr_queue *pq, int wait)
+__u32 pq_bcast_dropped(struct pq_bcast *b, int id)
 {
-	void *rv;
-
-	// Initialize variables 
-	rv = NULL;
-
-	// STEP 1: Validate input 
-	if (pq == NULL) 
+	if (b == NULL || id < 0 || id >= b->readers)
 	{
-		errno = EINVAL; 
-		goto end;
+		errno = EINVAL;
+		return 0;
 	}
 
-	// STEP 2: Obtain lock
-	// If the caller wants to wait, then pend upon the lock
-	// Caller does not want to wait so try the lock and return immediately 
-	if (wait) 
-		pthread_mutex_lock(&pq->mtx); 
-	else 
-		if ( pthread_mutex_trylock(&pq->mtx) != 0 )
-			goto end;		
+	return __atomic_load_n(&b->reader[id].dropped, __ATOMIC_RELAXED);
+}
 
-	// STEP 3: Check if we are empty 
-	/* If head == tail then the queue is empty
-	 * Set a waiting bit to tell the other threads that we are waiting and need to be signaled 
-	 * Pend upon the condition signal to wake up when the queue goes non empty
-	 */
-	if (pq->head == pq->tail) 
-	{
-		// Return immediately if caller does not want to wait
-		if (!wait)
-			goto unlock;
+/*
+ * Free a broadcast ring
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+int pq_bcast_free(struct pq_bcast *b)
+{
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (b == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Free the ring
+	pthread_mutex_destroy(&b->mtx);
+	free(b->reader);
+	free(b->data);
+	free(b);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Return 1 if a PQ_BCAST_BLOCK producer must wait for the slowest reader
+ *
+ * Readers that are not joined do not hold the producer back
+ */
+static int pq_bcast_full(struct pq_bcast *b)
+{
+	__u32 tail, lag;
+
+	tail = __atomic_load_n(&b->tail, __ATOMIC_RELAXED);
+
+	for ( int i = 0 ; i < b->readers ; i++ )
+	{
+		if (!__atomic_load_n(&b->reader[i].active, __ATOMIC_ACQUIRE))
+			continue;
+
+		lag = tail - __atomic_load_n(&b->reader[i].head, __ATOMIC_ACQUIRE);
+		if (lag >= b->capacity)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Create a broadcast ring
+ *
+ * Param:
+ *	count   : Slots, rounded up to a power of two
+ *	readers : Maximum number of readers joined at the same time
+ *	policy  : enum pq_bcast_policy
+ *
+ * Return pointer upon success, 0 otherwise and set errno
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Allocate the ring
+ * 3: Allocate the slots and reader cursors
+ */
+struct pq_bcast *pq_bcast_init(size_t count, int readers, int policy)
+{
+	struct pq_bcast *b;
+
+	// Initialize variables
+	b = NULL;
+
+	// STEP 1: Validate inputs
+	if (count == 0 || count > (1U << 31) || readers <= 0 || 
+		policy < 0 || policy >= PQ_BCAST_MAX)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Allocate the ring
+	b = (struct pq_bcast *) aligned_alloc(PQ_CACHELINE, sizeof(*b));
+	if (b == NULL)
+	{
+		errno = ENOMEM;
+		goto end;
+	}
+	memset(b, 0, sizeof(*b));
+	b->capacity = 1;
+	while (b->capacity < count)
+		b->capacity <<= 1;
+	b->mask = b->capacity - 1;
+	b->policy = policy;
+	b->readers = readers;
+	pthread_mutex_init(&b->mtx, NULL);
+
+	// STEP 3: Allocate the slots and reader cursors
+	b->data = (void **) calloc(b->capacity, sizeof(void *));
+	b->reader = (struct pq_bcast_reader *) aligned_alloc(PQ_CACHELINE, 
+		readers * sizeof(struct pq_bcast_reader));
+	if (b->data == NULL || b->reader == NULL)
+	{
+		pq_bcast_free(b);
+		b = NULL;
+		errno = ENOMEM;
+		goto end;
+	}
+	memset(b->reader, 0, readers * sizeof(struct pq_bcast_reader));
+
+end:
+
+	return b;
+}
+
+/*
+ * Register a reader of a broadcast ring
+ *
+ * The reader starts at the current tail and sees every entry published from 
+ * now on. Its cursor is set again once it is visible as active, so a 
+ * PQ_BCAST_BLOCK producer can never lap it in between. A producer that 
+ * parked on the first cursor is woken up once it moved.
+ *
+ * Returns the reader id upon success, a negative number otherwise and sets 
+ * errno (EBUSY if all reader slots are taken)
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Find a free reader slot
+ * 3: Start the cursor at the tail
+ * 4: Wake a producer blocked on the first cursor
+ */
+int pq_bcast_join(struct pq_bcast *b)
+{
+	struct pq_bcast_reader *r;
+	int rv;
+
+	// Initialize variables
+	rv = -1;
+
+	// STEP 1: Validate inputs
+	if (b == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	pthread_mutex_lock(&b->mtx);
+
+	// STEP 2: Find a free reader slot
+	for ( int i = 0 ; i < b->readers ; i++ )
+	{
+		if (!b->reader[i].active)
+		{
+			rv = i;
+			break;
+		}
+	}
+
+	if (rv < 0)
+	{
+		errno = EBUSY;
+		goto unlock;
+	}
+
+	// STEP 3: Start the cursor at the tail
+	r = &b->reader[rv];
+	__atomic_store_n(&r->dropped, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->head, __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+	__atomic_store_n(&r->active, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&r->head, __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+
+unlock:
+
+	pthread_mutex_unlock(&b->mtx);
+
+	// STEP 4: Wake a producer blocked on the first cursor
+	if (rv >= 0)
+		pq_ec_wake(&b->ec_full, &b->waiting_full, 1);
+
+end:
+
+	return rv;
+}
+
+/*
+ * Unregister a reader of a broadcast ring
+ *
+ * A producer blocked on this reader is woken up
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+int pq_bcast_leave(struct pq_bcast *b, int id)
+{
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (b == NULL || id < 0 || id >= b->readers || 
+		!__atomic_load_n(&b->reader[id].active, __ATOMIC_ACQUIRE))
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Release the reader slot
+	pthread_mutex_lock(&b->mtx);
+	__atomic_store_n(&b->reader[id].active, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&b->mtx);
+
+	pq_ec_wake(&b->ec_full, &b->waiting_full, 1);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Sleep until a reader has an entry, or the producer has room if id < 0
+ *
+ * Same eventcount protocol as pq_ec_wait(). pq_bcast_push() wakes readers, 
+ * readers and pq_bcast_leave() wake the producer.
+ */
+static void pq_bcast_park(struct pq_bcast *b, int id)
+{
+	__u32 *ec, key;
+	int *waiting;
+
+	ec = (id < 0) ? &b->ec_full : &b->ec;
+	waiting = (id < 0) ? &b->waiting_full : &b->waiting;
+
+	__atomic_add_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+
+	for (;;)
+	{
+		key = __atomic_load_n(ec, __ATOMIC_ACQUIRE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		if (id < 0 && !pq_bcast_full(b))
+			break;
+		if (id >= 0 && __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE) != b->reader[id].head)
+			break;
+
+		pq_futex_wait(ec, key, 0, NULL);
+	}
+
+	__atomic_sub_fetch(waiting, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Read the next entry of a broadcast ring for one reader
+ *
+ * With PQ_BCAST_DROP a reader that fell a whole ring behind skips to the 
+ * oldest entry still in the ring and adds the skipped entries to its 
+ * dropped counter. The slot is read before the tail is checked again, like 
+ * a seqlock, so an entry overwritten mid read is discarded.
+ *
+ * Param:
+ *	id   : Reader id from pq_bcast_join()
+ *	wait : If non zero, park until an entry is published. Otherwise return 
+ *	       NULL with errno EAGAIN if the reader is caught up
+ *
+ * Return pointer upon success, 0 otherwise and set errno
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Wait for an entry
+ * 3: Skip what was overwritten
+ * 4: Read the slot and advance the cursor
+ */
+void *pq_bcast_pop(struct pq_bcast *b, int id, int wait)
+{
+	struct pq_bcast_reader *r;
+	__u32 pos, tail, skip;
+	void *rv;
+
+	// Initialize variables
+	rv = NULL;
+
+	// STEP 1: Validate inputs
+	if (b == NULL || id < 0 || id >= b->readers || 
+		!__atomic_load_n(&b->reader[id].active, __ATOMIC_ACQUIRE))
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	r = &b->reader[id];
+
+	for (;;)
+	{
+		// STEP 2: Wait for an entry
+		pos = r->head;
+		tail = __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE);
+		if (tail == pos)
+		{
+			if (!wait)
+			{
+				errno = EAGAIN;
+				goto end;
+			}
+			pq_bcast_park(b, id);
+			continue;
+		}
+
+		/* STEP 3: Skip what was overwritten. The producer may be writing 
+		 * the slot at tail, so a reader keeps less than a ring of lag 
+		 */
+		if (b->policy == PQ_BCAST_DROP && tail - pos >= b->capacity)
+		{
+			skip = tail - pos - b->capacity + 1;
+			// Only this reader writes dropped, pq_bcast_dropped() reads it
+			__atomic_store_n(&r->dropped, r->dropped + skip, __ATOMIC_RELAXED);
+			pos += skip;
+		}
+
+		// STEP 4: Read the slot and advance the cursor
+		rv = __atomic_load_n(&b->data[pos & b->mask], __ATOMIC_RELAXED);
+
+		if (b->policy == PQ_BCAST_DROP)
+		{
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			tail = __atomic_load_n(&b->tail, __ATOMIC_RELAXED);
+			if (tail - pos >= b->capacity)
+			{
+				__atomic_store_n(&r->head, pos, __ATOMIC_RELAXED);
+				continue;
+			}
+		}
+
+		__atomic_store_n(&r->head, pos + 1, __ATOMIC_RELEASE);
+
+		if (b->policy == PQ_BCAST_BLOCK)
+			pq_ec_wake(&b->ec_full, &b->waiting_full, 1);
+
+		goto end;
+	}
+
+end:
+
+	return rv;
+}
+
+/*
+ * Publish an entry to every reader of a broadcast ring
+ *
+ * Single producer. With PQ_BCAST_BLOCK the producer waits while the slowest 
+ * joined reader is a whole ring behind, with PQ_BCAST_DROP it never waits.
+ * The slot is stored with release semantics so a reader that sees the new 
+ * pointer also sees the tail that lapped it.
+ *
+ * Param:
+ *	ptr  : Entry, must not be NULL
+ *	wait : If non zero, park while the ring is full. Otherwise return 1 with 
+ *	       errno ENOMEM
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Wait for the slowest reader
+ * 3: Publish the entry
+ * 4: Wake parked readers
+ */
+int pq_bcast_push(struct pq_bcast *b, void *ptr, int wait)
+{
+	__u32 tail;
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (b == NULL || ptr == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Wait for the slowest reader
+	while (b->policy == PQ_BCAST_BLOCK && pq_bcast_full(b))
+	{
+		if (!wait)
+		{
+			errno = ENOMEM;
+			goto end;
+		}
+		pq_bcast_park(b, -1);
+	}
+
+	// STEP 3: Publish the entry
+	tail = b->tail;
+	__atomic_store_n(&b->data[tail & b->mask], ptr, __ATOMIC_RELEASE);
+	__atomic_store_n(&b->tail, tail + 1, __ATOMIC_RELEASE);
+
+	// STEP 4: Wake parked readers
+	pq_ec_wake(&b->ec, &b->waiting, b->readers);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Take a chunk for the tail of a PQ_ENGINE_CHUNKED queue
+ *
+ * Called by producers with tail_mtx held. Retired chunks are reused before
+ * new ones are allocated. tail_mtx makes the producer the only thread that 
+ * pops chunk_free, so a chunk it loaded cannot be popped and pushed back 
+ * before its CAS (no ABA). Chunks on chunk_free are never freed while the 
+ * queue is alive, so reading next is safe.
+ *
+ * Return pointer upon success, NULL otherwise and set errno
+ */
+static struct pq_chunk *pq_chunk_get(struct ptr_queue *pq)
+{
+	struct pq_chunk *chunk;
+	size_t map;
+
+	chunk = __atomic_load_n(&pq->chunk_free, __ATOMIC_ACQUIRE);
+	while (chunk != NULL)
+	{
+		if (__atomic_compare_exchange_n(&pq->chunk_free, &chunk, chunk->next, 
+				1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+		{
+			__atomic_sub_fetch(&pq->chunk_spares, 1, __ATOMIC_RELAXED);
+			chunk->next = NULL;
+			return chunk;
+		}
+	}
+
+	chunk = (struct pq_chunk *) pq_mem_alloc(sizeof(struct pq_chunk) + 
+			pq->array_capacity * sizeof(void *), PQ_CACHELINE, pq->flags, 
+			pq->numa_node, &map);
+	if (chunk == NULL)
+		return NULL;
+
+	chunk->next = NULL;
+	chunk->map = map;
+
+	return chunk;
+}
+
+/*
+ * Remove up to max entries from the head of a PQ_ENGINE_CHUNKED queue
+ *
+ * Consumers serialize on mtx, producers on tail_mtx, so a push and a pop
+ * never wait for each other. tail is published with release semantics 
+ * after the entries and the chunk links are written. Like the mutex engine,
+ * wait == 0 does not wait for an entry but does wait for mtx, so EAGAIN 
+ * means the queue was empty and not that another consumer held the lock.
+ *
+ * Returns the number of entries popped. Returns 0 if none and sets errno 
+ * (EAGAIN if empty and wait == 0, ETIMEDOUT if the deadline passed)
+ *
+ * STEPS
+ * 1: Obtain lock, wait while the queue is empty
+ * 2: Copy the entries out, retiring chunks that have been read
+ * 3: Store the new head index
+ * 4: Unlock and return
+ */
+static __s32 pq_chunk_pop_n(
+	struct ptr_queue *pq, 
+	void **out, 
+	__u32 max, 
+	int wait, 
+	const struct timespec *deadline)
+{
+	struct pq_chunk *chunk;
+	__u32 head, len;
+
+	// STEP 1: Obtain lock, wait while the queue is empty
+	for (;;)
+	{
+		// Even a caller that does not want to wait for an entry waits for the lock
+		pq_lock(pq, &pq->mtx);
+
+		head = pq->head;
+		len = __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE) - head;
+		if (len > 0)
+			break;
+
+		pthread_mutex_unlock(&pq->mtx);
+
+		if (!wait)
+		{
+			errno = EAGAIN;
+			return 0;
+		}
+
+		if (pq_lf_wait(pq, 0, deadline) != 0)
+		{
+			errno = ETIMEDOUT;
+			return 0;
+		}
+	}
+
+	// STEP 2: Copy the entries out, retiring chunks that have been read
+	if (max > len)
+		max = len;
+
+	for ( __u32 i = 0 ; i < max ; i++ )
+	{
+		// The producer linked the next chunk before publishing its entries
+		if (pq->head_slot == pq->array_capacity)
+		{
+			chunk = pq->head_chunk;
+			pq->head_chunk = chunk->next;
+			pq->head_slot = 0;
+			pq_chunk_put(pq, chunk);
+		}
+
+		out[i] = pq->head_chunk->slots[pq->head_slot++];
+	}
+
+	// STEP 3: Store the new head index
+	__atomic_store_n(&pq->head, head + max, __ATOMIC_RELEASE);
+
+	// STEP 4: Unlock and return
+	pthread_mutex_unlock(&pq->mtx);
+
+	return max;
+}
+
+/*
+ * Insert n entries at the tail of a PQ_ENGINE_CHUNKED queue
+ *
+ * A full tail chunk is followed by a recycled or new chunk, the queue never
+ * runs out of slots.
+ *
+ * Returns the number of entries pushed, which is less than n only if a 
+ * chunk could not be allocated (errno ENOMEM)
+ *
+ * STEPS
+ * 1: Obtain lock
+ * 2: Store the entries, linking new chunks as the tail chunk fills
+ * 3: Store the new tail index
+ * 4: Unlock and wake consumers
+ */
+static __s32 pq_chunk_push_n(struct ptr_queue *pq, void **ptrs, __u32 n)
+{
+	struct pq_chunk *chunk;
+	__u32 i;
+
+	// STEP 1: Obtain lock
+	pq_lock(pq, &pq->tail_mtx);
+
+	// STEP 2: Store the entries, linking new chunks as the tail chunk fills
+	for ( i = 0 ; i < n ; i++ )
+	{
+		if (pq->tail_slot == pq->array_capacity)
+		{
+			chunk = pq_chunk_get(pq);
+			if (chunk == NULL)
+				break;
+
+			pq->tail_chunk->next = chunk;
+			pq->tail_chunk = chunk;
+			pq->tail_slot = 0;
+		}
+
+		pq->tail_chunk->slots[pq->tail_slot++] = ptrs[i];
+	}
+
+	// STEP 3: Store the new tail index
+	__atomic_store_n(&pq->tail, pq->tail + i, __ATOMIC_RELEASE);
+
+	// STEP 4: Unlock and wake consumers
+	pthread_mutex_unlock(&pq->tail_mtx);
+
+	pq_lf_wake(pq, i);
+
+	return i;
+}
+
+/*
+ * Retire a chunk consumers have read to the end of
+ *
+ * Called by consumers with mtx held. Up to PQ_CHUNK_SPARES chunks are kept
+ * for producers to reuse, the others are freed.
+ */
+static void pq_chunk_put(struct ptr_queue *pq, struct pq_chunk *chunk)
+{
+	if (__atomic_load_n(&pq->chunk_spares, __ATOMIC_RELAXED) >= PQ_CHUNK_SPARES)
+	{
+		pq_mem_free(chunk, chunk->map);
+		return;
+	}
+
+	__atomic_add_fetch(&pq->chunk_spares, 1, __ATOMIC_RELAXED);
+
+	chunk->next = __atomic_load_n(&pq->chunk_free, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&pq->chunk_free, &chunk->next, chunk, 
+			1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Publish n entries written to a span returned by pq_reserve()
+ *
+ * On the SPSC engine fewer entries than reserved may be committed, the rest
+ * of the span stays free. On the MPMC engine every reserved slot must be 
+ * committed, consumers would otherwise stall at the first uncommitted one.
+ *
+ * Param:
+ *	span : Span returned by pq_reserve()
+ *	n    : Number of entries to publish from the start of the span
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Publish the slots
+ * 3: If consumers are sleeping, wake them
+ */
+int pq_commit(struct ptr_queue *pq, void **span, __u32 n)
+{
+	int rv;
+	__u32 slot, tail, seq;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL || pq->data == NULL || span < pq->data || 
+		span - pq->data + (size_t) n > pq->array_capacity)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (pq->engine == PQ_ENGINE_MUTEX || pq->engine == PQ_ENGINE_CHUNKED)
+	{
+		errno = ENOTSUP;
+		goto end;
+	}
+	slot = span - pq->data;
+
+	// STEP 2: Publish the slots
+	if (pq->engine == PQ_ENGINE_SPSC)
+	{
+		tail = __atomic_load_n(&pq->tail, __ATOMIC_RELAXED);
+		if (slot != pq_ring_slot(pq, tail) || 
+			pq_ring_count(pq, pq->head_cache, tail) + n > pq->user_capacity)
+		{
+			errno = EINVAL;
+			goto end;
+		}
+		pq_latency_stamp(pq, slot, n);
+		__atomic_store_n(&pq->tail, pq_ring_advance(pq, tail, n), __ATOMIC_RELEASE);
+	}
+	else
+	{
+		// A claimed slot still holds its position as sequence number
+		pq_latency_stamp(pq, slot, n);
+		for ( __u32 i = 0 ; i < n ; i++ )
+		{
+			seq = __atomic_load_n(&pq->seq[slot + i], __ATOMIC_RELAXED);
+			__atomic_store_n(&pq->seq[slot + i], seq + 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	// STEP 3: If consumers are sleeping, wake them
+	if (n > 0)
+		pq_stats_push(pq, n);
+	pq_lf_wake(pq, n);
+	pq_watermark(pq);
+	pq_async_wake(pq, n, 0);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Wake up to n of the threads waiting on a condition variable
+ *
+ * One waiter is signaled per entry (or slot) made available. If there are 
+ * at least as many entries as waiters, all of them are woken with a single 
+ * broadcast. Called with the mutex held.
+ */
+static void pq_cond_wake(struct ptr_queue *pq, pthread_cond_t *cond, int waiting, __u32 n)
+{
+	if (waiting <= 0 || n == 0)
+		return;
+
+	if (n >= (__u32) waiting)
+	{
+		pthread_cond_broadcast(cond);
+		pq_stats_add(pq, PQ_STAT_SIGNALS, 1);
+		return;
+	}
+
+	pq_stats_add(pq, PQ_STAT_SIGNALS, n);
+	while (n-- > 0)
+		pthread_cond_signal(cond);
+}
+
+/*
+ * Wait on a condition variable, until an absolute CLOCK_MONOTONIC deadline if 
+ * one is given
+ *
+ * The sleep is counted and timed for PQ_ATTR_STATS queues
+ *
+ * Returns 0 when signaled, ETIMEDOUT if the deadline passed
+ */
+static int pq_cond_wait(
+	struct ptr_queue *pq, 
+	pthread_cond_t *cond, 
+	pthread_mutex_t *mtx, 
+	const struct timespec *deadline)
+{
+	__u64 start;
+	int rv;
+
+	start = (pq->stats != NULL) ? pq_stats_now() : 0;
+
+	if (deadline == NULL)
+		rv = pthread_cond_wait(cond, mtx);
+	else
+		rv = pthread_cond_timedwait(cond, mtx, deadline);
+
+	if (pq->stats != NULL)
+	{
+		pq_stats_add(pq, PQ_STAT_WAITS, 1);
+		pq_stats_add(pq, PQ_STAT_WAIT_NS, pq_stats_now() - start);
+	}
+
+	return rv;
+}
+
+/*
+ * Convert a caller timeout into an absolute CLOCK_MONOTONIC deadline
+ *
+ * ts is relative to now unless flags contains PQ_TIME_ABS
+ *
+ * Return 0 upon success, 1 and set errno to EINVAL if ts is NULL or 
+ * ts->tv_nsec is not in [0, 1000000000)
+ */
+static int pq_deadline(
+	const struct timespec *ts, 
+	int flags, 
+	struct timespec *deadline)
+{
+	if (ts == NULL || ts->tv_nsec < 0 || ts->tv_nsec >= 1000000000L)
+	{
+		errno = EINVAL;
+		return 1;
+	}
+
+	if (flags & PQ_TIME_ABS)
+	{
+		*deadline = *ts;
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += ts->tv_sec;
+	deadline->tv_nsec += ts->tv_nsec;
+	if (deadline->tv_nsec >= 1000000000L)
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+
+	return 0;
+}
+
+/*
+ * Return the number of entries the overflow policy discarded or evicted
+ *
+ * Returns 0 and sets errno if pq is NULL
+ */
+__u64 pq_dropped(struct ptr_queue *pq)
+{
+	if (pq == NULL)
+	{
+		errno = EINVAL;
+		return 0;
+	}
+
+	return __atomic_load_n(&pq->dropped, __ATOMIC_RELAXED);
+}
+
+/*
+ * Sleep on an eventcount until a lock-free queue goes non empty (full == 0) 
+ * or not full (full == 1)
+ *
+ * The waiter announces itself in waiters, then reads the eventcount key and 
+ * re-checks the queue. Wakers issue a full fence between publishing and 
+ * reading waiters in pq_ec_wake() and bump the eventcount before FUTEX_WAKE, 
+ * so either the waker sees the waiter or the waiter sees the change, and a 
+ * bump between the check and FUTEX_WAIT makes the wait return at once.
+ *
+ * Returns 0 once the condition holds, ETIMEDOUT if the deadline passed
+ */
+static int pq_ec_wait(
+	struct ptr_queue *pq, 
+	__u32 *ec, 
+	int *waiters, 
+	int full, 
+	const struct timespec *deadline)
+{
+	__u64 start;
+	__u32 key;
+	int rv, rc;
+
+	// Initialize variables
+	rv = 0;
+
+	__atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+
+	for (;;)
+	{
+		key = __atomic_load_n(ec, __ATOMIC_ACQUIRE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		if (!(full ? pq_lf_full(pq) : pq_lf_empty(pq)))
+			break;
+
+		start = (pq->stats != NULL) ? pq_stats_now() : 0;
+		rc = pq_futex_wait(ec, key, 0, deadline);
+		if (pq->stats != NULL)
+		{
+			pq_stats_add(pq, PQ_STAT_WAITS, 1);
+			pq_stats_add(pq, PQ_STAT_WAIT_NS, pq_stats_now() - start);
+		}
+
+		if (rc == ETIMEDOUT)
+		{
+			if (full ? pq_lf_full(pq) : pq_lf_empty(pq))
+				rv = ETIMEDOUT;
+			break;
+		}
+	}
+
+	__atomic_sub_fetch(waiters, 1, __ATOMIC_RELAXED);
+
+	return rv;
+}
+
+/*
+ * Wake up to n threads sleeping in pq_ec_wait() on an eventcount
+ *
+ * Steady state cost is a fence and a load: the eventcount is only bumped 
+ * and FUTEX_WAKE only issued when a waiter has announced itself.
+ *
+ * Returns 1 if FUTEX_WAKE was issued, 0 otherwise
+ */
+static int pq_ec_wake(__u32 *ec, int *waiters, __u32 n)
+{
+	int count;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	count = __atomic_load_n(waiters, __ATOMIC_RELAXED);
+	if (count == 0 || n == 0)
+		return 0;
+
+	__atomic_add_fetch(ec, 1, __ATOMIC_RELEASE);
+	pq_futex_wake(ec, n >= (__u32) count ? INT_MAX : (int) n, 0);
+
+	return 1;
+}
+
+/*
+ * Return 1 if empty,
+ *        0 if not empty 
+ *       -1 if there was an error and set errno
+ * 
+ * Like pq_len() this reads a snapshot of the indices without the lock
+ *
+ * STEPS:
+ * 1: Validate inputs 
+ * 2: Check if head and tail are equal
+ */
+int pq_empty(struct ptr_queue *pq)
+{
+	int rv;
+
+	// Initialize variables 
+	rv = -1;
+
+	// STEP 1: Validate inputs 
+	if (pq == NULL) 
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Check if head and tail are equal
+	rv = (pq_lf_len(pq) == 0);
+
+end:
+
+	return rv;
+}
+
+/*
+ * Return an eventfd that becomes readable when the queue has entries
+ *
+ * The descriptor is created on the first call and closed by pq_free(). It
+ * lets a queue be watched by epoll, poll() or io_uring next to other 
+ * descriptors. The queue signals it once and then stays quiet until the 
+ * consumer re-arms it: read the eventfd, pop until the queue is empty, then
+ * call pq_eventfd_arm().
+ *
+ * Returns the descriptor upon success, -1 otherwise and sets errno
+ */
+int pq_eventfd(struct ptr_queue *pq)
+{
+	int rv, fd;
+
+	// Initialize variables
+	rv = -1;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Create the descriptor on first use
+	if (__atomic_load_n(&pq->efd, __ATOMIC_ACQUIRE) < 0)
+	{
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fd < 0)
+			goto end;
+
+		// Another thread may have created one first
+		rv = -1;
+		if (!__atomic_compare_exchange_n(&pq->efd, &rv, fd, 0, 
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			close(fd);
+		else
+			pq_eventfd_arm(pq);
+	}
+
+	rv = pq->efd;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Re-arm the eventfd of a queue after the consumer drained it
+ *
+ * If entries arrived since the last pop, the eventfd is signaled right away
+ * so they are not missed.
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+int pq_eventfd_arm(struct ptr_queue *pq)
+{
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL || pq->efd < 0)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Arm, then re-check the queue
+	__atomic_store_n(&pq->efd_armed, 1, __ATOMIC_SEQ_CST);
+	if (pq_len(pq) > 0)
+		pq_notify(pq);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/* 
+ * Relese allocated memory for this ring buffer
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ *
+ * STEPS
+ * 1: Validate inputs 
+ * 2: Free mutex variables
+ * 3: Free data buffer 
+ * 4: Free object pointer 
+ */
+int pq_free(struct ptr_queue *pq)
+{
+	 int rv; 
+
+	 // Initialize variables 
+	 rv = 1;
+
+	 // STEP 1: Validate inputs 
+	 if (pq == NULL) 
+	 {
+		errno = EINVAL;
+		goto end;
+	 }
+
+	// Free the magazines. Releasing the id first keeps exiting threads from 
+	// flushing into a freed pool
+	if (pq->mag_size > 0)
+	{
+		pthread_mutex_lock(&pq_mag_lock);
+		pq_mag_serials[pq->mag_id] = 0;
+		pthread_mutex_unlock(&pq_mag_lock);
+
+		while (pq->mags != NULL)
+		{
+			struct pq_mag *mag = pq->mags;
+			pq->mags = mag->next;
+			free(mag);
+		}
+	}
+
+	if (pq->efd >= 0)
+		close(pq->efd);
+
+	// STEP 2: Free mutex variables
+	pthread_mutex_destroy(&pq->mtx);
+	pthread_mutex_destroy(&pq->tail_mtx);
+	pthread_cond_destroy(&pq->cond);
+	pthread_cond_destroy(&pq->cond_full);
+
+	// Free buffer for entries 
+	if (pq->buf != NULL) 
+		pq_mem_free(pq->buf, pq->buf_map);
+	pq->buf = NULL;
+	
+	// STEP 3: Free data buffer 
+	if ( pq->data != NULL )
+		pq_mem_free(pq->data, pq->data_map);
+	pq->data = NULL;
+
+	if ( pq->seq != NULL )
+		pq_mem_free(pq->seq, pq->seq_map);
+	pq->seq = NULL;
+
+	if ( pq->msgs != NULL )
+		pq_mem_free(pq->msgs, pq->msgs_map);
+	pq->msgs = NULL;
+
+	// Free the chunks of a chunked queue, queued and spare
+	while (pq->head_chunk != NULL)
+	{
+		struct pq_chunk *chunk = pq->head_chunk;
+		pq->head_chunk = chunk->next;
+		pq_mem_free(chunk, chunk->map);
+	}
+	while (pq->chunk_free != NULL)
+	{
+		struct pq_chunk *chunk = pq->chunk_free;
+		pq->chunk_free = chunk->next;
+		pq_mem_free(chunk, chunk->map);
+	}
+
+	free(pq->stats);
+	pq->stats = NULL;
+
+	if ( pq->stamp != NULL )
+		pq_mem_free(pq->stamp, pq->stamp_map);
+	pq->stamp = NULL;
+	free(pq->hist);
+	pq->hist = NULL;
+
+	// STEP 4: Free object ptr 
+	pq_mem_free(pq, pq->self_map);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Wait on a futex word while it holds val, until an absolute CLOCK_MONOTONIC
+ * deadline if one is given
+ *
+ * shared selects a futex visible to other processes mapping the same memory
+ *
+ * Returns 0 when woken (or the word changed), ETIMEDOUT if the deadline passed
+ */
+static int pq_futex_wait(__u32 *uaddr, __u32 val, int shared, const struct timespec *deadline)
+{
+	long rc;
+
+	rc = syscall(SYS_futex, uaddr, shared ? FUTEX_WAIT_BITSET : FUTEX_WAIT_BITSET_PRIVATE, 
+			val, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+	if (rc == -1 && errno == ETIMEDOUT)
+		return ETIMEDOUT;
+
+	return 0;
+}
+
+/*
+ * Wake up to n threads waiting on a futex word
+ */
+static void pq_futex_wake(__u32 *uaddr, int n, int shared)
+{
+	syscall(SYS_futex, uaddr, shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/*
+ * Free a group of queues and the queues it holds
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+int pq_group_free(struct pq_group *g)
+{
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (g == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Free the queue of each worker
+	for ( int i = 0 ; g->queues != NULL && i < g->count ; i++ )
+		if (g->queues[i] != NULL)
+			pq_free(g->queues[i]);
+
+	free(g->queues);
+	free(g);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Create a group of queues, one per worker
+ *
+ * Param:
+ *	workers : Number of workers, and of queues
+ *	count   : Capacity of each queue
+ *	dist    : enum pq_group_dist, how pq_group_push() spreads entries
+ *	attr    : Attributes of the queues, NULL for the defaults. Workers steal
+ *	          from each other, so the SPSC engine and message mode are invalid
+ *
+ * Returns a pointer to a struct pq_group upon success. Upon error, returns NULL and sets errno 
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Allocate the group
+ * 3: Create the queue of each worker
+ */
+struct pq_group *pq_group_init(
+	int workers, 
+	size_t count, 
+	int dist, 
+	const struct pq_attr *attr)
+{
+	struct pq_group *g;
+	struct pq_attr a;
+
+	// Initialize variables
+	g = NULL;
+
+	if (attr != NULL)
+		a = *attr;
+	else
+		pq_attr_init(&a);
+
+	// STEP 1: Validate inputs
+	if (workers <= 0 || dist < 0 || dist >= PQ_GROUP_MAX || 
+		a.engine == PQ_ENGINE_SPSC || a.msg_size > 0)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Allocate the group
+	g = (struct pq_group *) aligned_alloc(PQ_CACHELINE, sizeof(*g));
+	if (g == NULL)
+	{
+		errno = ENOMEM;
+		goto end;
+	}
+	memset(g, 0, sizeof(*g));
+	g->count = workers;
+	g->dist = dist;
+
+	g->queues = (struct ptr_queue **) calloc(workers, sizeof(struct ptr_queue *));
+	if (g->queues == NULL)
+	{
+		free(g);
+		g = NULL;
+		errno = ENOMEM;
+		goto end;
+	}
+
+	// STEP 3: Create the queue of each worker
+	for ( int i = 0 ; i < workers ; i++ )
+	{
+		g->queues[i] = pq_init_attr(count, 0, &a);
+		if (g->queues[i] == NULL)
+		{
+			int err = errno;
+			pq_group_free(g);
+			g = NULL;
+			errno = err;
+			goto end;
+		}
+	}
+
+end:
+
+	return g;
+}
+
+/*
+ * Return the number of entries in all queues of a group
+ *
+ * The result is a snapshot and may be stale by the time it is used
+ *
+ * Returns a negative number upon error and sets errno
+ */
+__s32 pq_group_len(struct pq_group *g)
+{
+	__s32 rv, len;
+
+	// Initialize variables
+	rv = 0;
+
+	// STEP 1: Validate inputs
+	if (g == NULL)
+	{
+		errno = EINVAL;
+		rv = -EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Sum the queues
+	for ( int i = 0 ; i < g->count ; i++ )
+	{
+		len = pq_len(g->queues[i]);
+		if (len > 0 && rv <= INT32_MAX - len)
+			rv += len;
+	}
+
+end:
+
+	return rv;
+}
+
+/*
+ * Sleep until any queue of a group has an entry
+ *
+ * Same eventcount protocol as pq_ec_wait(), with the whole group as the
+ * condition. pq_group_push() is the waker.
+ *
+ * Returns 0 once the group is non empty
+ */
+static int pq_group_park(struct pq_group *g)
+{
+	__u32 key;
+
+	__atomic_add_fetch(&g->waiting, 1, __ATOMIC_SEQ_CST);
+
+	for (;;)
+	{
+		key = __atomic_load_n(&g->ec, __ATOMIC_ACQUIRE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		if (pq_group_len(g) > 0)
+			break;
+
+		pq_futex_wait(&g->ec, key, 0, NULL);
+	}
+
+	__atomic_sub_fetch(&g->waiting, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/*
+ * Pop an entry for a worker of a group
+ *
+ * The worker's own queue is tried first, waiting out a producer that holds 
+ * its lock. When it is empty the worker steals a single entry from a 
+ * sibling. pq_group_pop_n() steals in batches.
+ *
+ * Param:
+ *	worker : Index of the calling worker
+ *	wait   : If non zero, park until an entry shows up in any queue of the 
+ *	         group. Otherwise return NULL with errno EAGAIN if all are empty
+ *
+ * Return pointer upon success, 0 otherwise and set errno
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Pop the own queue
+ * 3: Steal an entry from a sibling
+ * 4: Park until the group is non empty
+ */
+void *pq_group_pop(struct pq_group *g, int worker, int wait)
+{
+	void *rv;
+
+	// Initialize variables
+	rv = NULL;
+
+	// STEP 1: Validate inputs
+	if (g == NULL || worker < 0 || worker >= g->count)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	for (;;)
+	{
+		// STEP 2: Pop the own queue
+		if (pq_pop_n(g->queues[worker], &rv, 1, 0) == 1)
+			goto end;
+
+		// STEP 3: Steal an entry from a sibling
+		if (pq_group_steal(g, worker, &rv, 1) == 1)
+			goto end;
+
+		// STEP 4: Park until the group is non empty
+		if (!wait)
+		{
+			errno = EAGAIN;
+			goto end;
+		}
+
+		pq_group_park(g);
+	}
+
+end:
+
+	return rv;
+}
+
+/*
+ * Pop up to max entries for a worker of a group
+ *
+ * Like pq_group_pop(), but an empty own queue makes the worker steal up to
+ * half of a sibling's queue, bounded by max and PQ_GROUP_STEAL. Stolen 
+ * entries are all returned to the caller, so none has to be queued again.
+ *
+ * Returns the number of entries popped. Returns 0 if none (errno EAGAIN) 
+ * and a negative number upon error and sets errno
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Pop the own queue
+ * 3: Steal a batch from a sibling
+ * 4: Park until the group is non empty
+ */
+__s32 pq_group_pop_n(struct pq_group *g, int worker, void **out, __u32 max, int wait)
+{
+	__s32 rv;
+
+	// Initialize variables
+	rv = 0;
+
+	// STEP 1: Validate inputs
+	if (g == NULL || worker < 0 || worker >= g->count || (out == NULL && max > 0))
+	{
+		errno = EINVAL;
+		rv = -EINVAL;
+		goto end;
+	}
+
+	if (max == 0)
+		goto end;
+
+	for (;;)
+	{
+		// STEP 2: Pop the own queue
+		rv = pq_pop_n(g->queues[worker], out, max, 0);
+		if (rv > 0)
+			goto end;
+
+		// STEP 3: Steal a batch from a sibling
+		rv = pq_group_steal(g, worker, out, max);
+		if (rv > 0)
+			goto end;
+
+		// STEP 4: Park until the group is non empty
+		if (!wait)
+		{
+			errno = EAGAIN;
+			goto end;
+		}
+
+		pq_group_park(g);
+	}
+
+end:
+
+	return rv;
+}
+
+/*
+ * Push an entry to a queue of a group
+ *
+ * Param:
+ *	key : Hashed to select the queue with PQ_GROUP_HASH, ignored otherwise
+ *
+ * With PQ_GROUP_RR and PQ_GROUP_LEAST a full queue is passed over for the 
+ * next one. With PQ_GROUP_HASH the entry only goes to the queue of its key,
+ * although a sibling may steal it from there.
+ *
+ * Return 0 upon success, 1 otherwise and set errno (ENOMEM if full)
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Select the queue
+ * 3: Push, moving on to the next queue while full
+ * 4: If workers are parked, wake one
+ */
+int pq_group_push(struct pq_group *g, void *ptr, __u64 key)
+{
+	__s32 len, min;
+	int rv, i;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (g == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Select the queue
+	switch (g->dist)
+	{
+		case PQ_GROUP_HASH:
+			// Fibonacci hashing spreads keys that differ in the low bits only
+			i = (int) (((key * 0x9E3779B97F4A7C15ULL) >> 32) % (__u64) g->count);
+			rv = pq_push(g->queues[i], ptr);
+			goto wake;
+
+		case PQ_GROUP_LEAST:
+			i = 0;
+			min = INT32_MAX;
+			for ( int j = 0 ; j < g->count ; j++ )
+			{
+				len = pq_len(g->queues[j]);
+				if (len >= 0 && len < min)
+				{
+					min = len;
+					i = j;
+				}
+			}
+			break;
+
+		default:
+			i = (int) (__atomic_fetch_add(&g->next, 1, __ATOMIC_RELAXED) % (__u32) g->count);
+			break;
+	}
+
+	// STEP 3: Push, moving on to the next queue while full
+	for ( int j = 0 ; j < g->count && rv != 0 ; j++ )
+		rv = pq_push(g->queues[(i + j) % g->count], ptr);
+
+wake:
+
+	// STEP 4: If workers are parked, wake one
+	if (rv == 0)
+		pq_ec_wake(&g->ec, &g->waiting, 1);
+
+end:
+
+	return rv;
+}
+
+/*
+ * Steal up to max entries from the siblings of a worker
+ *
+ * Siblings are visited starting with the next worker so thieves spread 
+ * over the victims. Half of a victim's queue is taken, leaving the rest to
+ * its owner. A victim whose lock is held is waited for, not skipped, or an 
+ * idle worker would spin between here and pq_group_park() while siblings
+ * have work.
+ *
+ * Returns the number of entries stolen
+ */
+static __s32 pq_group_steal(struct pq_group *g, int worker, void **out, __u32 max)
+{
+	struct ptr_queue *victim;
+	__s32 len, rv;
+
+	if (max > PQ_GROUP_STEAL)
+		max = PQ_GROUP_STEAL;
+
+	for ( int j = 1 ; j < g->count ; j++ )
+	{
+		victim = g->queues[(worker + j) % g->count];
+
+		len = pq_len(victim);
+		if (len <= 0)
+			continue;
+
+		len = (len + 1) / 2;
+		rv = pq_pop_n(victim, out, (__u32) len < max ? (__u32) len : max, 0);
+		if (rv > 0)
+			return rv;
+	}
+
+	return 0;
+}
+
+/*
+ * Create and initialize a pointer queue
+ *
+ * Param: 
+ *	count   : This is the number of buffer entries 
+ *  obj_size: If non zero, allocate count objects of this size and push them into the queue
+ * 
+ * Returns a pointer to a struct ptr_queue upon success. Upon error, returns NULL and sets errno 
+ */
+struct ptr_queue *pq_init(
+	size_t count,
+	size_t obj_size)
+{
+	return pq_init_attr(count, obj_size, NULL);
+}
+
+/*
+ * Create and initialize a pointer queue with creation attributes
+ *
+ * Param: 
+ *	count   : This is the number of buffer entries 
+ *  obj_size: If non zero, allocate count objects of this size and push them into the queue
+ *  attr    : Creation attributes. NULL selects the defaults of pq_attr_init()
+ * 
+ * Returns a pointer to a struct ptr_queue upon success. Upon error, returns NULL and sets errno 
+ *
+ * STEPS
+ * 1. Validate inputs
+ * 2. Allocate memory for ring_buffer struct 
+ * 3. Allocate memory for data buffer 
+ * 4: Initialize mutex variables
+ * 5: Allocate memory for objects and insert them into queue 
+ *
+ * Objects are placed attr->obj_align bytes apart, rounded up to whole cache 
+ * lines with PQ_ATTR_OBJ_PAD. PQ_ATTR_HUGEPAGE maps the ring and the objects
+ * from huge pages, falling back to transparent huge pages if none are 
+ * reserved. PQ_ATTR_PREFAULT and PQ_ATTR_MLOCK fault in and lock all of the
+ * queue memory so the first pushes take no page faults.
+ * attr->mag_size > 0 gives each thread a cache of that many objects.
+ * attr->numa_node binds the struct, the ring and the objects to a node.
+ * attr->msg_size > 0 stores messages of that size in the slots instead of
+ * pointers, see pq_push_copy()
+ * attr->overflow selects what a full queue does with pushes that do not 
+ * wait, see pq_set_overflow()
+ * attr->wm_fn is called when the length reaches attr->wm_high and again when
+ * it falls back to attr->wm_low, see pq_watermark()
+ */
+struct ptr_queue *pq_init_attr(
+	size_t count,
+	size_t obj_size,
+	const struct pq_attr *attr)
+{
+	struct ptr_queue *pq;
+	struct pq_attr defaults;
+	pthread_condattr_t cattr;
+	size_t align, stride, map;
+	unsigned int cpu, local;
+	int node;
+
+	// Initialize variables 
+	pq = NULL;
+
+	if (attr == NULL)
+	{
+		pq_attr_init(&defaults);
+		attr = &defaults;
+	}
+
+	// STEP 1. Validate inputs
+	if (count == 0 || count >= UINT32_MAX) 
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (attr->engine < 0 || attr->engine >= PQ_ENGINE_MAX || 
+		attr->wait_strategy < 0 || attr->wait_strategy >= PQ_WAIT_MAX ||
+		attr->overflow < 0 || attr->overflow >= PQ_OVERFLOW_MAX)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if ((attr->obj_align & (attr->obj_align - 1)) != 0 || 
+		attr->obj_align > PQ_HUGEPAGE_SIZE)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (attr->numa_node < PQ_NUMA_LOCAL || attr->numa_node >= PQ_NUMA_NODES)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (attr->msg_size > 0 && (obj_size > 0 || attr->engine == PQ_ENGINE_CHUNKED || 
+		((size_t) attr->msg_size + 7) / 8 > SIZE_MAX / 16 / (count + 1)))
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if ((attr->flags & PQ_ATTR_POW2 || attr->engine == PQ_ENGINE_MPMC) && 
+		count > (1U << 31))
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (attr->wm_fn != NULL && (attr->wm_low >= attr->wm_high || 
+		(attr->engine != PQ_ENGINE_CHUNKED && attr->wm_high > count && 
+		 attr->wm_high > attr->max_count)))
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (attr->overflow == PQ_OVERFLOW_OVERWRITE && attr->engine != PQ_ENGINE_MUTEX)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if ((attr->flags & PQ_ATTR_LATENCY) && 
+		(attr->engine == PQ_ENGINE_CHUNKED || attr->max_count > 0))
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (attr->max_count > 0 && (attr->engine != PQ_ENGINE_MUTEX || 
+		attr->max_count < count || attr->max_count >= UINT32_MAX || 
+		(attr->flags & PQ_ATTR_POW2 && attr->max_count > (1U << 31))))
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// Bind to the node of the calling thread
+	node = attr->numa_node;
+	if (attr->numa_node == PQ_NUMA_LOCAL)
+	{
+		node = PQ_NUMA_ANY;
+		if (getcpu(&cpu, &local) == 0)
+			node = local;
+	}
+
+	/* Round the object size up to the alignment so every object in the 
+	 * pool starts on an aligned address. Padded objects never share a 
+	 * cache line with their neighbours
+	 */
+	align = attr->obj_align;
+	if ((attr->flags & PQ_ATTR_OBJ_PAD) && align < PQ_CACHELINE)
+		align = PQ_CACHELINE;
+	stride = obj_size;
+	if (align > 1)
+		stride = (obj_size + align - 1) & ~(align - 1);
+	if (obj_size > 0 && (stride < obj_size || stride > SIZE_MAX / count))
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	
+	// STEP 2. Allocate memory for ptr_queue struct 
+	pq = (struct ptr_queue*) pq_mem_alloc(sizeof(struct ptr_queue), PQ_CACHELINE, 
+			attr->flags & (PQ_ATTR_PREFAULT | PQ_ATTR_MLOCK), node, &map);
+	if (pq == 0) 
+		goto end;
+	pq->self_map = map;
+	pq->numa_node = node;
+	pq->efd = -1;
+	pq->engine = attr->engine;
+	pq->flags = attr->flags;
+	pq->wait_strategy = attr->wait_strategy;
+	pq->overflow = attr->overflow;
+	pq->wm_low = attr->wm_low;
+	pq->wm_high = attr->wm_high;
+	pq->spin_max = attr->spin ? attr->spin : PQ_SPIN_DEFAULT;
+	pq->spin_budget = pq->spin_max;
+	pq->spin_budget_full = pq->spin_max;
+	pq->array_capacity = count + 1;
+	pq->user_capacity = count;
+	pq->msg_size = attr->msg_size;
+	pq->msg_stride = ((size_t) attr->msg_size + 7) & ~(size_t) 7;
+
+	/* The MPMC engine always indexes slots with free running counters 
+	 * masked by the capacity
+	 */
+	if (pq->engine == PQ_ENGINE_MPMC)
+		pq->flags |= PQ_ATTR_POW2;
+
+	/* Round the capacity up to a power of two. No slot is sacrificed to 
+	 * tell full from empty: the length is simply tail - head 
+	 */
+	if (pq->flags & PQ_ATTR_POW2)
+	{
+		pq->array_capacity = 1;
+		while (pq->array_capacity < count)
+			pq->array_capacity <<= 1;
+		
+		/* A single MPMC slot would read as free to the next producer as 
+		 * soon as it is published, since pos + 1 is also its next lap 
+		 */
+		if (pq->engine == PQ_ENGINE_MPMC && pq->array_capacity < 2)
+			pq->array_capacity = 2;
+		pq->user_capacity = pq->array_capacity;
+		pq->mask = pq->array_capacity - 1;
+	}
+
+	/* A chunked queue counts entries with free running indices and holds 
+	 * count slots per chunk. Its capacity is only bounded by the length
+	 */
+	if (pq->engine == PQ_ENGINE_CHUNKED)
+	{
+		pq->flags |= PQ_ATTR_POW2;
+		pq->array_capacity = count;
+		pq->user_capacity = INT32_MAX;
+		pq->mask = 0;
+	}
+
+	/* Growable queues double up to max_count, rounded up like the 
+	 * capacity, and shrink no lower than the capacity at creation
+	 */
+	pq->min_capacity = pq->user_capacity;
+	pq->max_capacity = pq->user_capacity;
+	if (attr->max_count > pq->user_capacity)
+	{
+		pq->max_capacity = attr->max_count;
+		if (pq->flags & PQ_ATTR_POW2)
+		{
+			pq->max_capacity = pq->user_capacity;
+			while (pq->max_capacity < attr->max_count)
+				pq->max_capacity <<= 1;
+		}
+	}
+
+	// STEP 3. Allocate memory for ptr uffer 
+	// In message mode the slots hold the messages themselves
+	if (pq->engine == PQ_ENGINE_CHUNKED)
+	{
+		pq->head_chunk = pq_chunk_get(pq);
+		pq->tail_chunk = pq->head_chunk;
+	}
+	else if (pq->msg_size > 0)
+		pq->msgs = (__u8 *) pq_mem_alloc(pq->array_capacity * pq->msg_stride, 
+				PQ_CACHELINE, pq->flags, pq->numa_node, &pq->msgs_map); 
+	else
+		pq->data = (void **) pq_mem_alloc(pq->array_capacity * sizeof(void *), 
+				PQ_CACHELINE, pq->flags, pq->numa_node, &pq->data_map); 
+	if (pq->data == 0 && pq->msgs == 0 && pq->head_chunk == 0) 
+	{
+		pq_mem_free(pq, pq->self_map);
+		pq = NULL;
+		goto end;
+	}
+
+	// Allocate per slot sequence numbers for the MPMC engine
+	if (pq->engine == PQ_ENGINE_MPMC)
+	{
+		pq->seq = (__u32 *) pq_mem_alloc(pq->array_capacity * sizeof(__u32), 
+				PQ_CACHELINE, pq->flags, pq->numa_node, &pq->seq_map);
+		if (pq->seq == 0) 
+		{
+			pq_mem_free(pq->data, pq->data_map);
+			pq_mem_free(pq->msgs, pq->msgs_map);
+			pq_mem_free(pq, pq->self_map);
+			pq = NULL;
+			goto end;
+		}
+
+		for ( __u32 i = 0 ; i < pq->array_capacity ; i++ )
+			pq->seq[i] = i;
+	}
+
+	// STEP 4: Initialize mutex variables
+	// Timed waits use CLOCK_MONOTONIC deadlines
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&pq->mtx, NULL);
+	pthread_mutex_init(&pq->tail_mtx, NULL);
+	pthread_cond_init(&pq->cond, &cattr);
+	pthread_cond_init(&pq->cond_full, &cattr);
+	pthread_condattr_destroy(&cattr);
+	pq->async.next = pq->async.prev = &pq->async;
+	pq->async_full.next = pq->async_full.prev = &pq->async_full;
+	
+	// STEP 5: Allocate memory for objects and insert them into queue 
+	if (obj_size > 0)
+	{
+		pq->obj_size = obj_size;
+		pq->obj_stride = stride;
+		pq->buf_size = count * stride;
+		pq->buf = (__u8*) pq_mem_alloc(pq->buf_size, align, pq->flags, 
+				pq->numa_node, &pq->buf_map); 
+		if (pq->buf == 0) 
+		{
+			pq_free(pq);
+			pq = NULL;
+			errno = ENOMEM;
+			goto end;
+		}
+
+		for ( size_t i = 0 ; i < count ; i++ )
+			pq_push(pq, &pq->buf[i*stride]);	
+
+		if (attr->mag_size > 0)
+		{
+			if (pq_mag_register(pq) != 0)
+			{
+				pq_free(pq);
+				pq = NULL;
+				errno = ENOMEM;
+				goto end;
+			}
+			pq->mag_size = attr->mag_size;
+		}
+	}
+
+	// STEP 6: Allocate the counter shards last so filling the pool is not counted
+	if (pq->flags & PQ_ATTR_STATS)
+	{
+		pq->stats = (struct pq_stats_shard *) aligned_alloc(PQ_CACHELINE, 
+			PQ_STATS_SHARDS * sizeof(struct pq_stats_shard));
+		if (pq->stats == NULL)
+		{
+			pq_free(pq);
+			pq = NULL;
+			errno = ENOMEM;
+			goto end;
+		}
+		memset(pq->stats, 0, PQ_STATS_SHARDS * sizeof(struct pq_stats_shard));
+	}
+
+	// Pool objects already queued count as pushed now
+	if (pq->flags & PQ_ATTR_LATENCY)
+	{
+		pq->stamp = (__u64 *) pq_mem_alloc(pq->array_capacity * sizeof(__u64), 
+				PQ_CACHELINE, pq->flags, pq->numa_node, &pq->stamp_map);
+		pq->hist = (struct pq_hist *) aligned_alloc(PQ_CACHELINE, sizeof(struct pq_hist));
+		if (pq->stamp == NULL || pq->hist == NULL)
+		{
+			pq_free(pq);
+			pq = NULL;
+			errno = ENOMEM;
+			goto end;
+		}
+		memset(pq->hist, 0, sizeof(struct pq_hist));
+		pq_latency_stamp(pq, 0, pq->array_capacity);
+	}
+
+	/* Install the watermark callback last so filling the pool does not call 
+	 * it on a half built queue. A pool that starts at or above the high 
+	 * watermark is above without a callback
+	 */
+	pq->wm_above = attr->wm_fn != NULL && (__u32) pq_lf_len(pq) >= pq->wm_high;
+	pq->wm_fn = attr->wm_fn;
+	pq->wm_arg = attr->wm_arg;
+
+	/* The inline fast path covers plain pointer lock-free rings that keep no
+	 * statistics or watermarks. An SPSC ring needs a mask to wrap without 
+	 * pq_ring_advance()
+	 */
+	pq->fast_path = (pq->engine == PQ_ENGINE_MPMC || 
+		(pq->engine == PQ_ENGINE_SPSC && (pq->flags & PQ_ATTR_POW2))) && 
+		pq->msgs == NULL && pq->stats == NULL && pq->stamp == NULL && 
+		pq->wm_fn == NULL;
+
+end:
+
+	return pq;
+}
+
+/*
+ * Create and initialize an unbounded multi-producer multi-consumer queue
+ *
+ * Entries are stored in a linked list of chunks of count slots. Producers
+ * serialize on one lock and consumers on another (M. Michael, M. Scott), 
+ * so pushes and pops do not contend with each other. Retired chunks are 
+ * recycled, pushes only allocate when the queue grows past its chunks.
+ *
+ * Returns a pointer to a struct ptr_queue upon success. Upon error, returns NULL and sets errno 
+ */
+struct ptr_queue *pq_init_chunked(
+	size_t count,
+	size_t obj_size)
+{
+	struct pq_attr attr;
+
+	pq_attr_init(&attr);
+	attr.engine = PQ_ENGINE_CHUNKED;
+
+	return pq_init_attr(count, obj_size, &attr);
+}
+
+/*
+ * Create and initialize a lock-free multi-producer multi-consumer queue
+ *
+ * This is a bounded queue with a sequence number per slot (D. Vyukov).
+ * Producers only contend on a CAS of tail and consumers on a CAS of head.
+ * The capacity is rounded up to the next power of two, and to at least 2.
+ *
+ * Returns a pointer to a struct ptr_queue upon success. Upon error, returns NULL and sets errno 
+ */
+struct ptr_queue *pq_init_mpmc(
+	size_t count,
+	size_t obj_size)
+{
+	struct pq_attr attr;
+
+	pq_attr_init(&attr);
+	attr.engine = PQ_ENGINE_MPMC;
+
+	return pq_init_attr(count, obj_size, &attr);
+}
+
+/*
+ * Create and initialize a pointer queue bound to a NUMA node
+ *
+ * The struct, the ring and the objects are allocated on node, or on the 
+ * node of the calling thread with PQ_NUMA_LOCAL
+ *
+ * Returns a pointer to a struct ptr_queue upon success. Upon error, returns NULL and sets errno 
+ */
+struct ptr_queue *pq_init_node(
+	size_t count,
+	size_t obj_size,
+	int node)
+{
+	struct pq_attr attr;
+
+	pq_attr_init(&attr);
+	attr.numa_node = node;
+
+	return pq_init_attr(count, obj_size, &attr);
+}
+
+/*
+ * Create and initialize a lock-free single-producer single-consumer queue
+ *
+ * Only one thread may call pq_push() and only one thread may call pq_pop()
+ * at any time. Neither call takes the mutex, a thread that has to sleep parks
+ * on a futex eventcount.
+ *
+ * Returns a pointer to a struct ptr_queue upon success. Upon error, returns NULL and sets errno 
+ */
+struct ptr_queue *pq_init_spsc(
+	size_t count,
+	size_t obj_size)
+{
+	struct pq_attr attr;
+
+	pq_attr_init(&attr);
+	attr.engine = PQ_ENGINE_SPSC;
+
+	return pq_init_attr(count, obj_size, &attr);
+}
+
+/*
+ * Take a snapshot of the sojourn times of a queue created with PQ_ATTR_LATENCY
+ *
+ * Return 0 upon success, 1 otherwise and set errno (ENOTSUP if the queue 
+ * keeps no histogram)
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Count the entries recorded
+ * 3: Read the quantiles
+ */
+int pq_latency(struct ptr_queue *pq, struct pq_latency *out)
+{
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL || out == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (pq->hist == NULL)
+	{
+		errno = ENOTSUP;
+		goto end;
+	}
+
+	// STEP 2: Count the entries recorded
+	out->count = 0;
+	for ( __u32 i = 0 ; i < PQ_HIST_BUCKETS ; i++ )
+		out->count += __atomic_load_n(&pq->hist->count[i], __ATOMIC_RELAXED);
+	out->max = __atomic_load_n(&pq->hist->max, __ATOMIC_RELAXED);
+
+	// STEP 3: Read the quantiles
+	pq_latency_quantile(pq, 0.5, &out->p50);
+	pq_latency_quantile(pq, 0.9, &out->p90);
+	pq_latency_quantile(pq, 0.99, &out->p99);
+	pq_latency_quantile(pq, 0.999, &out->p999);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Return the histogram bucket of a sojourn time
+ *
+ * The bucket is the position of the highest set bit followed by the next 
+ * PQ_HIST_SUB_BITS bits, so the values of a bucket are within 1/16 of each
+ * other
+ */
+static __u32 pq_latency_bucket(__u64 ns)
+{
+	__u32 shift;
+
+	if (ns < (1U << PQ_HIST_SUB_BITS))
+		return ns;
+
+	shift = 63 - __builtin_clzll(ns) - PQ_HIST_SUB_BITS;
+
+	return ((shift + 1) << PQ_HIST_SUB_BITS) + (__u32) (ns >> shift) - (1U << PQ_HIST_SUB_BITS);
+}
+
+/*
+ * Return the largest sojourn time that falls into a histogram bucket
+ */
+static __u64 pq_latency_ceil(__u32 bucket)
+{
+	__u32 exp, sub;
+
+	exp = bucket >> PQ_HIST_SUB_BITS;
+	sub = bucket & ((1U << PQ_HIST_SUB_BITS) - 1);
+
+	if (exp == 0)
+		return sub;
+
+	return ((__u64) ((1U << PQ_HIST_SUB_BITS) + sub + 1) << (exp - 1)) - 1;
+}
+
+/*
+ * Return the sojourn time below which a fraction q of the recorded entries 
+ * fall
+ *
+ * Param:
+ *	q  : Quantile, 0.99 for p99
+ *	ns : Receives the time in nanoseconds, capped at the largest recorded. 
+ *	     0 if nothing was recorded yet
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Count the entries recorded
+ * 3: Walk the buckets up to the rank of q
+ */
+int pq_latency_quantile(struct ptr_queue *pq, double q, __u64 *ns)
+{
+	__u64 total, rank, sum, max;
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL || ns == NULL || !(q >= 0.0 && q <= 1.0))
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (pq->hist == NULL)
+	{
+		errno = ENOTSUP;
+		goto end;
+	}
+
+	// STEP 2: Count the entries recorded
+	total = 0;
+	for ( __u32 i = 0 ; i < PQ_HIST_BUCKETS ; i++ )
+		total += __atomic_load_n(&pq->hist->count[i], __ATOMIC_RELAXED);
+
+	*ns = 0;
+	rv = 0;
+	if (total == 0)
+		goto end;
+
+	// STEP 3: Walk the buckets up to the rank of q
+	rank = (__u64) (q * total);
+	if ((double) rank < q * total || rank == 0)
+		rank++;
+
+	max = __atomic_load_n(&pq->hist->max, __ATOMIC_RELAXED);
+	*ns = max;
+
+	// Entries recorded meanwhile may leave the rank unreached, then max stays
+	sum = 0;
+	for ( __u32 i = 0 ; i < PQ_HIST_BUCKETS ; i++ )
+	{
+		sum += __atomic_load_n(&pq->hist->count[i], __ATOMIC_RELAXED);
+		if (sum >= rank)
+		{
+			if (pq_latency_ceil(i) < max)
+				*ns = pq_latency_ceil(i);
+			break;
+		}
+	}
+
+end:
+
+	return rv;
+}
+
+/*
+ * Record the sojourn time of n entries about to be popped from consecutive 
+ * slots, wrapping at the end of the ring
+ *
+ * Does nothing unless the queue was created with PQ_ATTR_LATENCY. Called 
+ * before the slots are handed back to the producers.
+ */
+static void pq_latency_record(struct ptr_queue *pq, __u32 slot, __u32 n)
+{
+	__u64 now, ns, max;
+
+	if (pq->stamp == NULL || n == 0)
+		return;
+
+	now = pq_stats_now();
+
+	for ( __u32 i = 0 ; i < n ; i++ )
+	{
+		ns = pq->stamp[slot];
+		ns = (now > ns) ? now - ns : 0;
+
+		__atomic_add_fetch(&pq->hist->count[pq_latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+
+		max = __atomic_load_n(&pq->hist->max, __ATOMIC_RELAXED);
+		while (ns > max && 
+			!__atomic_compare_exchange_n(&pq->hist->max, &max, ns, 1, 
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+
+		if (++slot == pq->array_capacity)
+			slot = 0;
+	}
+}
+
+/*
+ * Zero the sojourn time histogram of a PQ_ATTR_LATENCY queue
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+int pq_latency_reset(struct ptr_queue *pq)
+{
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (pq->hist == NULL)
+	{
+		errno = ENOTSUP;
+		goto end;
+	}
+
+	// STEP 2: Zero every bucket
+	for ( __u32 i = 0 ; i < PQ_HIST_BUCKETS ; i++ )
+		__atomic_store_n(&pq->hist->count[i], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&pq->hist->max, 0, __ATOMIC_RELAXED);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Stamp n consecutive slots, wrapping at the end of the ring, with the time
+ * of the push
+ *
+ * Does nothing unless the queue was created with PQ_ATTR_LATENCY. Called 
+ * before the slots are published to the consumers, whose acquire of the 
+ * slots makes the stamps visible.
+ */
+static void pq_latency_stamp(struct ptr_queue *pq, __u32 slot, __u32 n)
+{
+	__u64 now;
+
+	if (pq->stamp == NULL || n == 0)
+		return;
+
+	now = pq_stats_now();
+
+	for ( __u32 i = 0 ; i < n ; i++ )
+	{
+		pq->stamp[slot] = now;
+		if (++slot == pq->array_capacity)
+			slot = 0;
+	}
+}
+
+/* 
+ * Returns the length in number of entries. Returns a negative number upon error and sets errno.
+ *
+ * The length is read from a snapshot of the indices without taking the 
+ * lock, so it may be stale by the time it is used, but it is always 
+ * between 0 and the capacity.
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Compute length from a snapshot of the indices
+ */
+__s32 pq_len(struct ptr_queue *pq)
+{
+	__s32 rv;
+
+	// Inittialize variables
+	rv = 0;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL) 
+	{ 
+		errno = EINVAL;
+		rv = -EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Compute length from a snapshot of the indices
+	rv = pq_lf_len(pq);
+	
+end:
+
+	return rv;
+}
+
+/*
+ * Return 1 if a lock-free queue has no entry ready to be popped, 0 otherwise
+ *
+ * This is a lock-free snapshot, also used by the mutex engine to spin
+ */
+static int pq_lf_empty(struct ptr_queue *pq)
+{
+	__u32 head;
+
+	head = __atomic_load_n(&pq->head, __ATOMIC_RELAXED);
+
+	if (pq->engine == PQ_ENGINE_MPMC)
+		return __atomic_load_n(&pq->seq[head & pq->mask], __ATOMIC_ACQUIRE) != head + 1;
+
+	return __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE) == head;
+}
+
+/*
+ * Return 1 if a lock-free queue has no free slot to push into, 0 otherwise
+ *
+ * This is a lock-free snapshot, also used by the mutex engine to spin
+ */
+static int pq_lf_full(struct ptr_queue *pq)
+{
+	__u32 head, tail;
+
+	tail = __atomic_load_n(&pq->tail, __ATOMIC_RELAXED);
+
+	if (pq->engine == PQ_ENGINE_MPMC)
+		return (__s32) (__atomic_load_n(&pq->seq[tail & pq->mask], __ATOMIC_ACQUIRE) - tail) < 0;
+
+	head = __atomic_load_n(&pq->head, __ATOMIC_ACQUIRE);
+
+	return pq_ring_count(pq, head, tail) == pq->user_capacity;
+}
+
+/*
+ * Return the number of entries in a queue without taking its lock
+ *
+ * The result is a snapshot and may be stale by the time it is used. A mutex 
+ * queue that is being resized can give a mixed snapshot, which the clamp 
+ * keeps within the capacity.
+ */
+static __s32 pq_lf_len(struct ptr_queue *pq)
+{
+	__u32 head, tail, len;
+
+	head = __atomic_load_n(&pq->head, __ATOMIC_ACQUIRE);
+	tail = __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE);
+
+	len = pq_ring_count(pq, head, tail);
+
+	// Free running indices: producers may have lapped the head we loaded
+	if (len > pq->user_capacity)
+		len = pq->user_capacity;
+
+	return len;
+}
+
+/*
+ * Sleep until a lock-free queue has an entry ready to be popped
+ *
+ * Consumers park on the ec_empty eventcount next to tail
+ *
+ * Returns 0 once the queue is non empty, ETIMEDOUT if the deadline passed
+ */
+static int pq_lf_park(struct ptr_queue *pq, const struct timespec *deadline)
+{
+	return pq_ec_wait(pq, &pq->ec_empty, &pq->waiting, 0, deadline);
+}
+
+/*
+ * Sleep until a lock-free queue has a free slot to push into
+ *
+ * Producers park on the ec_full eventcount next to head
+ *
+ * Returns 0 once the queue is not full, ETIMEDOUT if the deadline passed
+ */
+static int pq_lf_park_full(struct ptr_queue *pq, const struct timespec *deadline)
+{
+	return pq_ec_wait(pq, &pq->ec_full, &pq->waiting_full, 1, deadline);
+}
+
+/*
+ * Wait for a lock-free queue to go non empty (full == 0) or not full (full == 1)
+ *
+ * Spins first as allowed by the wait strategy, then parks
+ *
+ * Returns 0 once the condition holds, ETIMEDOUT if the deadline passed
+ */
+static int pq_lf_wait(struct ptr_queue *pq, int full, const struct timespec *deadline)
+{
+	int rv;
+
+	rv = pq_spin(pq, full, deadline);
+	if (rv != EAGAIN)
+		return rv;
+
+	if (full)
+		return pq_lf_park_full(pq, deadline);
+
+	return pq_lf_park(pq, deadline);
+}
+
+/*
+ * Wake consumers sleeping in pq_lf_park(), if there are any, and notify the
+ * poll set and eventfd of the queue
+ *
+ * Called by producers after n entries have been published
+ */
+static void pq_lf_wake(struct ptr_queue *pq, __u32 n)
+{
+	if (pq_ec_wake(&pq->ec_empty, &pq->waiting, n))
+		pq_stats_add(pq, PQ_STAT_SIGNALS, 1);
+	pq_notify(pq);
+}
+
+/*
+ * Wake producers sleeping in pq_lf_park_full(), if there are any
+ *
+ * Called by consumers after n slots have been released
+ */
+static void pq_lf_wake_full(struct ptr_queue *pq, __u32 n)
+{
+	if (pq_ec_wake(&pq->ec_full, &pq->waiting_full, n))
+		pq_stats_add(pq, PQ_STAT_SIGNALS, 1);
+}
+
+/*
+ * Acquire a queue mutex
+ *
+ * The mutex is tried first so the uncontended case costs what a plain lock 
+ * does. Only a contended acquisition is counted and timed, and only for 
+ * PQ_ATTR_STATS queues. Non blocking calls take the mutex too: it is only 
+ * held for a few loads and stores, and a queue whose mutex is taken may well
+ * have entries.
+ */
+static void pq_lock(struct ptr_queue *pq, pthread_mutex_t *mtx)
+{
+	__u64 start;
+
+	if (pthread_mutex_trylock(mtx) == 0)
+		return;
+
+	pq_stats_add(pq, PQ_STAT_TRYLOCK_FAILS, 1);
+
+	start = (pq->stats != NULL) ? pq_stats_now() : 0;
+	pthread_mutex_lock(mtx);
+	if (pq->stats != NULL)
+		pq_stats_add(pq, PQ_STAT_LOCK_WAIT_NS, pq_stats_now() - start);
+}
+
+/*
+ * Return the magazine of the calling thread, NULL if it has none yet
+ */
+static struct pq_mag *pq_mag_find(struct ptr_queue *pq)
+{
+	struct pq_mag_table *t;
+
+	t = (struct pq_mag_table *) pthread_getspecific(pq_mag_key);
+	if (t == NULL || pq->mag_id >= t->count || t->slot[pq->mag_id].serial != pq->mag_serial)
+		return NULL;
+
+	return t->slot[pq->mag_id].mag;
+}
+
+/*
+ * Return the magazine of the calling thread, creating it on first use
+ *
+ * Return pointer upon success, NULL otherwise and set errno
+ *
+ * STEPS
+ * 1: Look up the magazine
+ * 2: Grow the table of the thread to cover the pool
+ * 3: Allocate the magazine and link it to the pool
+ */
+static struct pq_mag *pq_mag_get(struct ptr_queue *pq)
+{
+	struct pq_mag_table *t, *grown;
+	struct pq_mag *mag;
+	__u32 count;
+
+	// STEP 1: Look up the magazine
+	mag = pq_mag_find(pq);
+	if (mag != NULL)
+		goto end;
+
+	// STEP 2: Grow the table of the thread to cover the pool
+	t = (struct pq_mag_table *) pthread_getspecific(pq_mag_key);
+	if (t == NULL || pq->mag_id >= t->count)
+	{
+		count = (t != NULL) ? t->count : 0;
+		grown = (struct pq_mag_table *) realloc(t, sizeof(*t) + 
+				(pq->mag_id + 1) * sizeof(t->slot[0]));
+		if (grown == NULL)
+		{
+			errno = ENOMEM;
+			goto end;
+		}
+		t = grown;
+		memset(&t->slot[count], 0, (pq->mag_id + 1 - count) * sizeof(t->slot[0]));
+		t->count = pq->mag_id + 1;
+		pthread_setspecific(pq_mag_key, t);
+	}
+
+	// STEP 3: Allocate the magazine and link it to the pool
+	mag = (struct pq_mag *) malloc(sizeof(*mag) + pq->mag_size * sizeof(void *));
+	if (mag == NULL)
+	{
+		errno = ENOMEM;
+		goto end;
+	}
+	mag->pq = pq;
+	mag->prev = NULL;
+	mag->count = 0;
+
+	pthread_mutex_lock(&pq->mtx);
+	mag->next = pq->mags;
+	if (pq->mags != NULL)
+		pq->mags->prev = mag;
+	pq->mags = mag;
+	pthread_mutex_unlock(&pq->mtx);
+
+	t->slot[pq->mag_id].mag = mag;
+	t->slot[pq->mag_id].serial = pq->mag_serial;
+
+end:
+
+	return mag;
+}
+
+/*
+ * Create the magazine key shared by all pools, once per process
+ */
+static void pq_mag_key_init(void)
+{
+	pq_mag_key_err = pthread_key_create(&pq_mag_key, pq_mag_release);
+}
+
+/*
+ * Give a pool with magazines a mag_id, the lowest free one
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+static int pq_mag_register(struct ptr_queue *pq)
+{
+	__u64 *grown;
+	__u32 id;
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	pthread_once(&pq_mag_once, pq_mag_key_init);
+	if (pq_mag_key_err != 0)
+	{
+		errno = ENOMEM;
+		goto end;
+	}
+
+	pthread_mutex_lock(&pq_mag_lock);
+
+	for ( id = 0 ; id < pq_mag_ids && pq_mag_serials[id] != 0 ; id++ );
+	if (id == pq_mag_ids)
+	{
+		grown = (__u64 *) realloc(pq_mag_serials, (id + 1) * sizeof(__u64));
+		if (grown == NULL)
+		{
+			errno = ENOMEM;
+			goto unlock;
+		}
+		pq_mag_serials = grown;
+		pq_mag_ids = id + 1;
+	}
+
+	pq->mag_id = id;
+	pq->mag_serial = ++pq_mag_serial;
+	pq_mag_serials[id] = pq->mag_serial;
+	rv = 0;
+
+unlock:
+
+	pthread_mutex_unlock(&pq_mag_lock);
+
+end:
+
+	return rv;
+}
+
+/*
+ * Thread exit destructor of a magazine table
+ *
+ * Returns the objects cached for pools still alive and frees the magazines.
+ * pq_mag_lock keeps the pools from being freed meanwhile
+ */
+static void pq_mag_release(void *arg)
+{
+	struct pq_mag_table *t;
+	struct pq_mag *mag;
+	struct ptr_queue *pq;
+
+	t = (struct pq_mag_table *) arg;
+
+	pthread_mutex_lock(&pq_mag_lock);
+	for ( __u32 i = 0 ; i < t->count ; i++ )
+	{
+		mag = t->slot[i].mag;
+		if (mag == NULL || i >= pq_mag_ids || t->slot[i].serial != pq_mag_serials[i])
+			continue;
+		pq = mag->pq;
+
+		if (mag->count > 0)
+			pq_push_n(pq, mag->objs, mag->count);
+
+		pthread_mutex_lock(&pq->mtx);
+		if (mag->prev != NULL)
+			mag->prev->next = mag->next;
+		else
+			pq->mags = mag->next;
+		if (mag->next != NULL)
+			mag->next->prev = mag->prev;
+		pthread_mutex_unlock(&pq->mtx);
+
+		free(mag);
+	}
+	pthread_mutex_unlock(&pq_mag_lock);
+
+	free(t);
+}
+
+/*
+ * Allocate zeroed memory aligned to align bytes 
+ *
+ * Memory for any NUMA node with no flags comes from the heap, from calloc()
+ * unless it must be aligned beyond max_align_t. Large over-aligned memory and
+ * memory with flags or for a given node is mapped. Fresh pages are zero and 
+ * are not written, so none is committed before it is used. Memory for a 
+ * given node is bound to it with mbind() before it is first touched. With 
+ * PQ_ATTR_HUGEPAGE in flags, map the memory from the reserved huge pages. If
+ * none are reserved, map it on a huge page boundary and ask for transparent
+ * huge pages instead. PQ_ATTR_PREFAULT writes every page so no fault is left
+ * for the fast path and PQ_ATTR_MLOCK keeps the pages resident.
+ *
+ * Param:
+ *	flags : enum pq_attr_flags, PQ_ATTR_HUGEPAGE, PQ_ATTR_PREFAULT and PQ_ATTR_MLOCK are used
+ *	node  : NUMA node to bind the memory to, PQ_NUMA_ANY for no binding
+ *	map   : Set to the length of the mapping for pq_mem_free(), 0 for heap memory
+ *
+ * Return pointer upon success, NULL otherwise and set errno
+ *
+ * STEPS
+ * 1: Allocate from the heap
+ * 2: Map reserved huge pages 
+ * 3: Map pages, over mapping by the alignment to align the start
+ * 4: Bind the pages to the node 
+ * 5: Fault in and lock the pages
+ */
+static void *pq_mem_alloc(size_t size, size_t align, __u32 flags, int node, size_t *map)
+{
+	unsigned long nodemask[PQ_NUMA_NODES / (8 * sizeof(unsigned long))];
+	__u8 *rv;
+	size_t len, lead, page;
+
+	// Initialize variables
+	rv = NULL;
+	*map = 0;
+
+	// STEP 1: Allocate from the heap
+	if (!(flags & (PQ_ATTR_HUGEPAGE | PQ_ATTR_PREFAULT | PQ_ATTR_MLOCK)) && node < 0 &&
+		(align <= _Alignof(max_align_t) || size < PQ_MEM_MAP_MIN))
+	{
+		if (align <= _Alignof(max_align_t))
+			rv = (__u8 *) calloc(1, size ? size : 1);
+		else
+		{
+			len = (size + align - 1) & ~(align - 1);
+			rv = (__u8 *) aligned_alloc(align, len);
+			if (rv != NULL)
+				memset(rv, 0, len);
+		}
+
+		if (rv == NULL)
+			errno = ENOMEM;
+		goto end;
+	}
+
+	page = (flags & PQ_ATTR_HUGEPAGE) ? PQ_HUGEPAGE_SIZE : (size_t) sysconf(_SC_PAGESIZE);
+	if (align < page)
+		align = page;
+	len = (size + page - 1) & ~(page - 1);
+
+	// STEP 2: Map reserved huge pages 
+	if (flags & PQ_ATTR_HUGEPAGE)
+	{
+		rv = mmap(NULL, len, PROT_READ | PROT_WRITE, 
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (rv == MAP_FAILED)
+			rv = NULL;
+	}
+
+	// STEP 3: Map pages, over mapping by the alignment to align the start
+	if (rv == NULL)
+	{
+		rv = mmap(NULL, len + align - page, PROT_READ | PROT_WRITE, 
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (rv == MAP_FAILED)
+		{
+			rv = NULL;
+			errno = ENOMEM;
+			goto end;
+		}
+
+		lead = -(uintptr_t) rv & (align - 1);
+		if (lead > 0)
+			munmap(rv, lead);
+		if (align - page - lead > 0)
+			munmap(rv + lead + len, align - page - lead);
+		rv += lead;
+
+		if (flags & PQ_ATTR_HUGEPAGE)
+			madvise(rv, len, MADV_HUGEPAGE);
+	}
+
+	// STEP 4: Bind the pages to the node 
+	if (node >= 0)
+	{
+		memset(nodemask, 0, sizeof(nodemask));
+		nodemask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+
+		/* The kernel reads maxnode - 1 bits. Kernels without NUMA 
+		 * support have a single node and nothing to bind
+		 */
+		if (syscall(SYS_mbind, rv, len, MPOL_PREFERRED, nodemask, 
+				PQ_NUMA_NODES + 1, 0) != 0 && errno != ENOSYS)
+		{
+			munmap(rv, len);
+			rv = NULL;
+			goto end;
+		}
+	}
+
+	// STEP 5: Fault in and lock the pages
+	if (flags & PQ_ATTR_PREFAULT)
+	{
+		for ( size_t off = 0 ; off < len ; off += page )
+			((volatile __u8 *) rv)[off] = 0;
+	}
+	if ((flags & PQ_ATTR_MLOCK) && mlock(rv, len) != 0)
+	{
+		munmap(rv, len);
+		rv = NULL;
+		goto end;
+	}
+
+	*map = len;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Release memory from pq_mem_alloc()
+ */
+static void pq_mem_free(void *ptr, size_t map)
+{
+	if (map > 0)
+		munmap(ptr, map);
+	else
+		free(ptr);
+}
+
+/*
+ * Claim a run of up to max ready slots at the head of a lock-free MPMC queue
+ *
+ * The run of ready slots starting at head is counted first and then the
+ * whole run is claimed with a single CAS of head.
+ *
+ * Param:
+ *	contig : If non zero, stop the run at the end of the array
+ *	pos    : Set to the position of the first claimed slot
+ *
+ * Returns the number of slots claimed, 0 if empty and wait == 0
+ *
+ * STEPS
+ * 1: Find the run of ready slots and claim it with a CAS of head
+ * 2: If empty, return or sleep until a producer publishes an entry
+ */
+static __u32 pq_mpmc_claim_pop(struct ptr_queue *pq, __u32 max, int contig, int wait, __u32 *pos)
+{
+	__u32 seq, n;
+	__s32 dif;
+
+	// Initialize variables
+	n = 0;
+
+	// STEP 1: Find the run of ready slots and claim it with a CAS of head
+	*pos = __atomic_load_n(&pq->head, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		seq = __atomic_load_n(&pq->seq[*pos & pq->mask], __ATOMIC_ACQUIRE);
+		dif = (__s32) (seq - (*pos + 1));
+
+		if (dif < 0)
+		{
+			// A failed CAS may have left a run length behind
+			n = 0;
+
+			// STEP 2: If empty, return or sleep until a producer publishes an entry
+			if (!wait)
+			{
+				errno = EAGAIN;
+				goto end;
+			}
+
+			pq_lf_wait(pq, 0, NULL);
+			*pos = __atomic_load_n(&pq->head, __ATOMIC_RELAXED);
+			continue;
+		}
+		else if (dif > 0)
+		{
+			*pos = __atomic_load_n(&pq->head, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		n = 1;
+		while (n < max && (!contig || ((*pos + n) & pq->mask) != 0) && 
+			__atomic_load_n(&pq->seq[(*pos + n) & pq->mask], __ATOMIC_ACQUIRE) == *pos + n + 1)
+			n++;
+
+		if (__atomic_compare_exchange_n(&pq->head, pos, *pos + n, 1, 
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+end:
+
+	return n;
+}
+
+/*
+ * Claim a run of up to n free slots at the tail of a lock-free MPMC queue
+ *
+ * The run of free slots starting at tail is counted first and then the whole
+ * run is claimed with a single CAS of tail.
+ *
+ * Param:
+ *	contig : If non zero, stop the run at the end of the array
+ *	pos    : Set to the position of the first claimed slot
+ *
+ * Returns the number of slots claimed, 0 if full
+ */
+static __u32 pq_mpmc_claim_push(struct ptr_queue *pq, __u32 n, int contig, __u32 *pos)
+{
+	__u32 seq, k;
+	__s32 dif;
+
+	// Initialize variables
+	k = 0;
+
+	*pos = __atomic_load_n(&pq->tail, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		seq = __atomic_load_n(&pq->seq[*pos & pq->mask], __ATOMIC_ACQUIRE);
+		dif = (__s32) (seq - *pos);
+
+		if (dif < 0)
+		{
+			// A failed CAS may have left a run length behind
+			k = 0;
+			goto end;
+		}
+		else if (dif > 0)
+		{
+			*pos = __atomic_load_n(&pq->tail, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		k = 1;
+		while (k < n && (!contig || ((*pos + k) & pq->mask) != 0) && 
+			__atomic_load_n(&pq->seq[(*pos + k) & pq->mask], __ATOMIC_ACQUIRE) == *pos + k)
+			k++;
+
+		if (__atomic_compare_exchange_n(&pq->tail, pos, *pos + k, 1, 
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+end:
+
+	return k;
+}
+
+/*
+ * Remove the entry at the head of a lock-free MPMC queue
+ *
+ * A slot at position pos holds an entry once its sequence number is pos + 1.
+ * Consumers claim pos with a CAS of head, read the entry and then release the
+ * slot to the producers of the next lap by storing pos + array_capacity.
+ *
+ * Returns 1 and stores the entry (out in message mode) in *ptr upon success,
+ * 0 otherwise and sets errno. A NULL entry is popped like any other
+ *
+ * STEPS
+ * 1: Find a ready slot and claim it with a CAS of head
+ * 2: If empty, return or sleep until a producer publishes an entry
+ * 3: Get the value out of the array
+ * 4: Release the slot to the producers
+ */
+static __s32 pq_mpmc_pop(
+	struct ptr_queue *pq, 
+	void **ptr,
+	int wait, 
+	const struct timespec *deadline,
+	void *out)
+{
+	__s32 rv;
+	__u32 pos, seq;
+	__s32 dif;
+
+	// Initialize variables
+	rv = 0;
+
+	// STEP 1: Find a ready slot and claim it with a CAS of head
+	pos = __atomic_load_n(&pq->head, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		seq = __atomic_load_n(&pq->seq[pos & pq->mask], __ATOMIC_ACQUIRE);
+		dif = (__s32) (seq - (pos + 1));
+
+		if (dif == 0)
+		{
+			if (__atomic_compare_exchange_n(&pq->head, &pos, pos + 1, 1, 
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (dif < 0)
+		{
+			// STEP 2: If empty, return or sleep until a producer publishes an entry
+			if (!wait)
+			{
+				errno = EAGAIN;
+				goto end;
+			}
+
+			if (pq_lf_wait(pq, 0, deadline) != 0)
+			{
+				errno = ETIMEDOUT;
+				goto end;
+			}
+			pos = __atomic_load_n(&pq->head, __ATOMIC_RELAXED);
+		}
+		else 
+			pos = __atomic_load_n(&pq->head, __ATOMIC_RELAXED);
+	}
+
+	// STEP 3: Get the value out of the array
+	*ptr = pq_slot_load(pq, pos & pq->mask, out);
+	rv = 1;
+
+	// STEP 4: Release the slot to the producers
+	__atomic_store_n(&pq->seq[pos & pq->mask], pos + pq->array_capacity, __ATOMIC_RELEASE);
+	pq_lf_wake_full(pq, 1);
+
+end:
+
+	return rv;
+}
+
+/*
+ * Remove up to max entries from the head of a lock-free MPMC queue
+ *
+ * Returns the number of entries popped
+ *
+ * STEPS
+ * 1: Claim a run of ready slots
+ * 2: Get the values out of the array and release the slots to the producers
+ */
+static __s32 pq_mpmc_pop_n(struct ptr_queue *pq, void **out, __u32 max, int wait)
+{
+	__u32 pos, n;
+
+	// STEP 1: Claim a run of ready slots
+	n = pq_mpmc_claim_pop(pq, max, 0, wait, &pos);
+	if (n == 0)
+		return 0;
+
+	// STEP 2: Get the values out of the array and release the slots to the producers
+	pq_latency_record(pq, pos & pq->mask, n);
+	for ( __u32 i = 0 ; i < n ; i++ )
+	{
+		out[i] = pq->data[(pos + i) & pq->mask];
+		__atomic_store_n(&pq->seq[(pos + i) & pq->mask], pos + i + pq->array_capacity, __ATOMIC_RELEASE);
+	}
+	pq_lf_wake_full(pq, n);
+
+	return n;
+}
+
+/*
+ * Insert a new entry at the tail of a lock-free MPMC queue
+ *
+ * A slot at position pos is free once its sequence number is pos. Producers
+ * claim pos with a CAS of tail, store the entry and then publish the slot to
+ * the consumers by storing pos + 1.
+ *
+ * Return 0 upon success, 1 if full and set errno
+ *
+ * STEPS
+ * 1: Find a free slot and claim it with a CAS of tail
+ * 2: Store the new ptr and publish the slot
+ * 3: If a consumer is sleeping, signal it
+ */
+static int pq_mpmc_push(struct ptr_queue *pq, void *ptr)
+{
+	int rv;
+	__u32 pos, seq;
+	__s32 dif;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Find a free slot and claim it with a CAS of tail
+	pos = __atomic_load_n(&pq->tail, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		seq = __atomic_load_n(&pq->seq[pos & pq->mask], __ATOMIC_ACQUIRE);
+		dif = (__s32) (seq - pos);
+
+		if (dif == 0)
+		{
+			if (__atomic_compare_exchange_n(&pq->tail, &pos, pos + 1, 1, 
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (dif < 0)
+		{
+			errno = ENOMEM;
+			goto end;
+		}
+		else 
+			pos = __atomic_load_n(&pq->tail, __ATOMIC_RELAXED);
+	}
+
+	// STEP 2: Store the new ptr and publish the slot
+	pq_slot_store(pq, pos & pq->mask, ptr);
+	__atomic_store_n(&pq->seq[pos & pq->mask], pos + 1, __ATOMIC_RELEASE);
+
+	// STEP 3: If a consumer is sleeping, signal it
+	pq_lf_wake(pq, 1);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Insert up to n entries at the tail of a lock-free MPMC queue
+ *
+ * Returns the number of entries pushed
+ *
+ * STEPS
+ * 1: Claim a run of free slots
+ * 2: Store the new ptrs and publish the slots
+ * 3: If consumers are sleeping, wake them
+ */
+static __s32 pq_mpmc_push_n(struct ptr_queue *pq, void **ptrs, __u32 n)
+{
+	__u32 pos, k;
+
+	// STEP 1: Claim a run of free slots
+	k = pq_mpmc_claim_push(pq, n, 0, &pos);
+	if (k == 0)
+		return 0;
+
+	// STEP 2: Store the new ptrs and publish the slots
+	pq_latency_stamp(pq, pos & pq->mask, k);
+	for ( __u32 i = 0 ; i < k ; i++ )
+	{
+		pq->data[(pos + i) & pq->mask] = ptrs[i];
+		__atomic_store_n(&pq->seq[(pos + i) & pq->mask], pos + i + 1, __ATOMIC_RELEASE);
+	}
+
+	// STEP 3: If consumers are sleeping, wake them
+	pq_lf_wake(pq, k);
+
+	return k;
+}
+
+/*
+ * Publish the message written to the slot returned by pq_msg_reserve()
+ *
+ * SPSC engine in message mode only, called by the producer
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+int pq_msg_commit(struct ptr_queue *pq)
+{
+	int rv;
+	__u32 tail;
+
+	// Initialize variables
+	rv = 1;
+
+	if (pq == NULL || pq->msgs == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (pq->engine != PQ_ENGINE_SPSC)
+	{
+		errno = ENOTSUP;
+		goto end;
+	}
+
+	tail = __atomic_load_n(&pq->tail, __ATOMIC_RELAXED);
+	if (pq_ring_count(pq, pq->head_cache, tail) == pq->user_capacity)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	pq_latency_stamp(pq, pq_ring_slot(pq, tail), 1);
+	__atomic_store_n(&pq->tail, pq_ring_advance(pq, tail, 1), __ATOMIC_RELEASE);
+	pq_stats_push(pq, 1);
+	pq_lf_wake(pq, 1);
+	pq_watermark(pq);
+	pq_async_wake(pq, 1, 0);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Return the message at the head of the queue without copying it
+ *
+ * The message stays in the ring, and may be read in place, until 
+ * pq_msg_release() hands the slot back to the producer. SPSC engine in 
+ * message mode only, called by the consumer
+ *
+ * Param:
+ *	wait : If non zero, block until a message is available
+ *
+ * Return pointer to the message upon success, NULL otherwise and set errno
+ * (EAGAIN if empty and wait == 0, ENOTSUP for the other engines)
+ */
+const void *pq_msg_peek(struct ptr_queue *pq, int wait)
+{
+	void *rv;
+	__u32 head;
+
+	// Initialize variables
+	rv = NULL;
+
+	if (pq == NULL || pq->msgs == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (pq->engine != PQ_ENGINE_SPSC)
+	{
+		errno = ENOTSUP;
+		goto end;
+	}
+
+	head = __atomic_load_n(&pq->head, __ATOMIC_RELAXED);
+	if (head == pq->tail_cache)
+		pq->tail_cache = __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE);
+
+	if (head == pq->tail_cache)
+	{
+		if (!wait)
+		{
+			errno = EAGAIN;
+			goto end;
+		}
+
+		pq_lf_wait(pq, 0, NULL);
+		pq->tail_cache = __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE);
+	}
+
+	rv = pq_msg_slot(pq, pq_ring_slot(pq, head));
+
+end:
+
+	return rv;
+}
+
+/*
+ * Hand the slot returned by pq_msg_peek() back to the producer
+ *
+ * SPSC engine in message mode only, called by the consumer
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+int pq_msg_release(struct ptr_queue *pq)
+{
+	int rv;
+	__u32 head;
+
+	// Initialize variables
+	rv = 1;
+
+	if (pq == NULL || pq->msgs == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (pq->engine != PQ_ENGINE_SPSC)
+	{
+		errno = ENOTSUP;
+		goto end;
+	}
+
+	head = __atomic_load_n(&pq->head, __ATOMIC_RELAXED);
+	if (head == pq->tail_cache)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	pq_latency_record(pq, pq_ring_slot(pq, head), 1);
+	__atomic_store_n(&pq->head, pq_ring_advance(pq, head, 1), __ATOMIC_RELEASE);
+	pq_stats_pop(pq, 1);
+	pq_lf_wake_full(pq, 1);
+	pq_watermark(pq);
+	pq_async_wake(pq, 1, 1);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Return the free slot at the tail of the queue to build a message in place
+ *
+ * The message is invisible to the consumer until pq_msg_commit(). SPSC 
+ * engine in message mode only, called by the producer
+ *
+ * Return pointer to the slot upon success, NULL otherwise and set errno 
+ * (ENOMEM if full, ENOTSUP for the other engines)
+ */
+void *pq_msg_reserve(struct ptr_queue *pq)
+{
+	void *rv;
+	__u32 tail;
+
+	// Initialize variables
+	rv = NULL;
+
+	if (pq == NULL || pq->msgs == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (pq->engine != PQ_ENGINE_SPSC)
+	{
+		errno = ENOTSUP;
+		goto end;
+	}
+
+	tail = __atomic_load_n(&pq->tail, __ATOMIC_RELAXED);
+	if (pq_ring_count(pq, pq->head_cache, tail) == pq->user_capacity)
+	{
+		pq->head_cache = __atomic_load_n(&pq->head, __ATOMIC_ACQUIRE);
+		if (pq_ring_count(pq, pq->head_cache, tail) == pq->user_capacity)
+		{
+			errno = ENOMEM;
+			goto end;
+		}
+	}
+
+	rv = pq_msg_slot(pq, pq_ring_slot(pq, tail));
+
+end:
+
+	return rv;
+}
+
+/*
+ * Return the address of the message stored in a slot
+ */
+static void *pq_msg_slot(struct ptr_queue *pq, __u32 slot)
+{
+	return &pq->msgs[(size_t) slot * pq->msg_stride];
+}
+
+/*
+ * Tell the poll set and the eventfd of a queue that entries were published
+ *
+ * Called by producers after waking the queue's own consumers. Costs a load
+ * of poll and efd when neither is in use. The full fences pair with the 
+ * ones of pq_poll_wait() and pq_eventfd_arm() as in pq_ec_wake(). A set in
+ * use is counted in notifying, so pq_poll_free() waits until it is done.
+ */
+static void pq_notify(struct ptr_queue *pq)
+{
+	struct pq_poll *p;
+	__u64 one;
+
+	if (__atomic_load_n(&pq->poll, __ATOMIC_RELAXED) != NULL)
+	{
+		// Pairs with the store and load of pq_poll_free()
+		__atomic_add_fetch(&pq->notifying, 1, __ATOMIC_SEQ_CST);
+		p = __atomic_load_n(&pq->poll, __ATOMIC_SEQ_CST);
+		if (p != NULL)
+			pq_ec_wake(&p->ec, &p->waiting, 1);
+		__atomic_sub_fetch(&pq->notifying, 1, __ATOMIC_RELEASE);
+	}
+
+	if (__atomic_load_n(&pq->efd, __ATOMIC_RELAXED) < 0)
+		return;
+
+	// Signal once per arming, not once per entry
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pq->efd_armed, __ATOMIC_RELAXED) && 
+		__atomic_exchange_n(&pq->efd_armed, 0, __ATOMIC_ACQ_REL))
+	{
+		one = 1;
+		if (write(pq->efd, &one, sizeof(one)) < 0)
+			__atomic_store_n(&pq->efd_armed, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Read the NUMA nodes that are online
+ *
+ * Param:
+ *	online : Set to one byte per node, non zero if the node is online
+ *
+ * Return the highest online node + 1. Without sysfs only node 0 is online
+ */
+static int pq_numa_online(__u8 *online)
+{
+	FILE *fp;
+	unsigned long lo, hi;
+	char sep;
+	int rv;
+
+	// Initialize variables
+	rv = 0;
+	memset(online, 0, PQ_NUMA_NODES);
+
+	fp = fopen("/sys/devices/system/node/online", "r");
+	if (fp != NULL)
+	{
+		// The list looks like 0-3,8,10-11
+		while (fscanf(fp, "%lu", &lo) == 1)
+		{
+			hi = lo;
+			sep = (char) fgetc(fp);
+			if (sep == '-')
+			{
+				if (fscanf(fp, "%lu", &hi) != 1)
+					break;
+				sep = (char) fgetc(fp);
+			}
+
+			for ( ; lo <= hi && lo < PQ_NUMA_NODES ; lo++ )
+			{
+				online[lo] = 1;
+				if ((int) lo >= rv)
+					rv = lo + 1;
+			}
+
+			if (sep != ',')
+				break;
+		}
+		fclose(fp);
+	}
+
+	if (rv == 0)
+	{
+		online[0] = 1;
+		rv = 1;
+	}
+
+	return rv;
+}
+
+/*
+ * Release a NUMA sharded pool and the pools of all its nodes
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+int pq_numa_pool_free(struct pq_numa_pool *np)
+{
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	if (np == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	for ( int i = 0 ; i < np->nodes ; i++ )
+	{
+		if (np->pools[i] != NULL)
+			pq_free(np->pools[i]);
+	}
+	free(np->pools);
+	free(np);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Take an object from a NUMA sharded pool
+ *
+ * Objects of the calling thread's node are preferred. Remote nodes are only
+ * tried once the local pool is empty.
+ *
+ * Param:
+ *	wait : If non zero and every node is empty, park until an object is put
+ *	       back to any node, then look again starting with the local one
+ *
+ * Return pointer upon success, 0 otherwise and set errno. errno is EAGAIN
+ * if all pools are exhausted and wait == 0
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Find the pool of the local node
+ * 3: Take a local object
+ * 4: Fall back to the remote nodes
+ * 5: Park until any node has an object
+ */
+void *pq_numa_pool_get(struct pq_numa_pool *np, int wait)
+{
+	struct ptr_queue *pq;
+	unsigned int cpu, node;
+	void *rv;
+
+	// Initialize variables
+	rv = NULL;
+
+	// STEP 1: Validate inputs
+	if (np == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Find the pool of the local node
+	node = 0;
+	if (getcpu(&cpu, &node) != 0 || node >= (unsigned int) np->nodes || 
+		np->pools[node] == NULL)
+	{
+		for ( node = 0 ; np->pools[node] == NULL ; node++ );
+	}
+	pq = np->pools[node];
+
+	for (;;)
+	{
+		// STEP 3: Take a local object
+		rv = pq_pool_get(pq, 0);
+		if (rv != NULL)
+			goto end;
+
+		// STEP 4: Fall back to the remote nodes
+		for ( int i = 1 ; i < np->nodes ; i++ )
+		{
+			struct ptr_queue *remote = np->pools[(node + i) % np->nodes];
+
+			if (remote == NULL)
+				continue;
+
+			rv = pq_pool_get(remote, 0);
+			if (rv != NULL)
+				goto end;
+		}
+
+		// STEP 5: Park until any node has an object
+		if (!wait)
+		{
+			errno = EAGAIN;
+			goto end;
+		}
+
+		pq_numa_pool_park(np);
+	}
+
+end:
+
+	return rv;
+}
+
+/*
+ * Sleep until the pool of any node of a NUMA sharded pool has an object
+ *
+ * Same eventcount protocol as pq_ec_wait(), with every node as the 
+ * condition. pq_numa_pool_put() is the waker.
+ */
+static void pq_numa_pool_park(struct pq_numa_pool *np)
+{
+	__u32 key;
+	int ready;
+
+	__atomic_add_fetch(&np->waiting, 1, __ATOMIC_SEQ_CST);
+
+	for (;;)
+	{
+		key = __atomic_load_n(&np->ec, __ATOMIC_ACQUIRE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		ready = 0;
+		for ( int i = 0 ; i < np->nodes && !ready ; i++ )
+			ready = np->pools[i] != NULL && pq_len(np->pools[i]) > 0;
+		if (ready)
+			break;
+
+		pq_futex_wait(&np->ec, key, 0, NULL);
+	}
+
+	__atomic_sub_fetch(&np->waiting, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Create an object pool sharded by NUMA node
+ *
+ * Every online node gets a pool of count objects bound to it, created from
+ * attr with numa_node set to the node.
+ *
+ * Param: 
+ *	count   : Number of objects per node
+ *  obj_size: Size of each object, must not be zero
+ *	attr    : Creation attributes of each pool. NULL selects the defaults
+ * 
+ * Returns a pointer to a struct pq_numa_pool upon success. Upon error, returns NULL and sets errno 
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Find the online nodes
+ * 3: Create the pool of each node
+ */
+struct pq_numa_pool *pq_numa_pool_init(
+	size_t count, 
+	size_t obj_size, 
+	const struct pq_attr *attr)
+{
+	struct pq_numa_pool *np;
+	struct pq_attr a;
+	__u8 online[PQ_NUMA_NODES];
+
+	// Initialize variables
+	np = NULL;
+
+	// STEP 1: Validate inputs
+	if (obj_size == 0)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	if (attr != NULL)
+		a = *attr;
+	else
+		pq_attr_init(&a);
+
+	// STEP 2: Find the online nodes
+	np = (struct pq_numa_pool *) calloc(1, sizeof(*np));
+	if (np == NULL)
+	{
+		errno = ENOMEM;
+		goto end;
+	}
+
+	np->nodes = pq_numa_online(online);
+	np->pools = (struct ptr_queue **) calloc(np->nodes, sizeof(struct ptr_queue *));
+	if (np->pools == NULL)
+	{
+		free(np);
+		np = NULL;
+		errno = ENOMEM;
+		goto end;
+	}
+
+	// STEP 3: Create the pool of each node
+	for ( int i = 0 ; i < np->nodes ; i++ )
+	{
+		if (!online[i])
+			continue;
+
+		a.numa_node = i;
+		np->pools[i] = pq_init_attr(count, obj_size, &a);
+		if (np->pools[i] == NULL)
+		{
+			int err = errno;
+			pq_numa_pool_free(np);
+			np = NULL;
+			errno = err;
+			goto end;
+		}
+	}
+
+end:
+
+	return np;
+}
+
+/*
+ * Return an object to the pool of the node it was allocated on
+ *
+ * Getters parked on any node are woken, see pq_numa_pool_get()
+ *
+ * Return 0 upon success, 1 otherwise and set errno. errno is EINVAL if obj
+ * belongs to none of the pools
+ */
+int pq_numa_pool_put(struct pq_numa_pool *np, void *obj)
+{
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	if (np == NULL || obj == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	for ( int i = 0 ; i < np->nodes ; i++ )
+	{
+		if (pq_pool_owns(np->pools[i], obj))
+		{
+			rv = pq_pool_put(np->pools[i], obj);
+			if (rv == 0)
+				pq_ec_wake(&np->ec, &np->waiting, 1);
+			goto end;
+		}
+	}
+
+	errno = EINVAL;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Make room in a full mutex queue by taking out the oldest entry
+ *
+ * Called with the lock held. In message mode the message is discarded, 
+ * otherwise the entry is returned in evicted, if not NULL.
+ */
+static void pq_overflow_evict(struct ptr_queue *pq, void **evicted)
+{
+	void *old;
+	__u32 slot;
+
+	old = NULL;
+	slot = pq_ring_slot(pq, pq->head);
+
+	if (pq->msgs == NULL)
+	{
+		old = pq->data[slot];
+		pq->data[slot] = NULL;
+	}
+
+	__atomic_store_n(&pq->head, pq_ring_advance(pq, pq->head, 1), __ATOMIC_RELAXED);
+	__atomic_fetch_add(&pq->dropped, 1, __ATOMIC_RELAXED);
+
+	if (evicted != NULL)
+		*evicted = old;
+}
+
+/*
+ * Return a span of entries at the head of the queue to process in place
+ *
+ * The entries stay in the ring until pq_release(). The span never wraps 
+ * around the end of the array, so fewer than max entries may be returned 
+ * even if more are queued. Lock-free engines only.
+ *
+ * Param:
+ *	span : Set to the first entry of the span
+ *	max  : Maximum number of entries
+ *	wait : If non zero, block until at least one entry is available
+ *
+ * Returns the number of entries in the span, 0 if empty and wait == 0 
+ * (errno EAGAIN), -EINVAL or -ENOTSUP on error
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Find the queued entries, waiting for one if asked to
+ * 3: Limit the span to the end of the array
+ */
+__s32 pq_peek_n(struct ptr_queue *pq, void ***span, __u32 max, int wait)
+{
+	__s32 rv;
+	__u32 head, pos, len, slot;
+
+	// Initialize variables
+	rv = 0;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL || pq->msgs != NULL || span == NULL)
+	{
+		errno = EINVAL;
+		rv = -EINVAL;
+		goto end;
+	}
+	if (pq->engine == PQ_ENGINE_MUTEX || pq->engine == PQ_ENGINE_CHUNKED)
+	{
+		errno = ENOTSUP;
+		rv = -ENOTSUP;
+		goto end;
+	}
+	if (max == 0)
+		goto end;
+
+	// STEP 2: Find the queued entries, waiting for one if asked to
+	if (pq->engine == PQ_ENGINE_MPMC)
+	{
+		rv = pq_mpmc_claim_pop(pq, max, 1, wait, &pos);
+		*span = &pq->data[pos & pq->mask];
+		goto end;
+	}
+
+	head = __atomic_load_n(&pq->head, __ATOMIC_RELAXED);
+	len = pq_ring_count(pq, head, pq->tail_cache);
+	if (len < max)
+	{
+		pq->tail_cache = __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE);
+		len = pq_ring_count(pq, head, pq->tail_cache);
+	}
+
+	if (len == 0)
+	{
+		if (!wait)
+		{
+			errno = EAGAIN;
+			goto end;
+		}
+
+		pq_lf_wait(pq, 0, NULL);
+		pq->tail_cache = __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE);
+		len = pq_ring_count(pq, head, pq->tail_cache);
+	}
+
+	// STEP 3: Limit the span to the end of the array
+	slot = pq_ring_slot(pq, head);
+	if (len > pq->array_capacity - slot)
+		len = pq->array_capacity - slot;
+	if (max > len)
+		max = len;
+
+	*span = &pq->data[slot];
+	rv = max;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Unregister the queues of a poll set and free it
+ *
+ * Producers read the set of a queue without a reference, see pq_notify(). 
+ * Once a queue is unregistered, the set is freed after the producers that
+ * already read it are done with it. Consumers must not be waiting on it.
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Unregister the queues
+ * 3: Wait for producers still waking the set
+ */
+int pq_poll_free(struct pq_poll *p)
+{
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (p == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Unregister the queues
+	for ( int i = 0 ; i < p->count ; i++ )
+		__atomic_store_n(&p->queues[i]->poll, NULL, __ATOMIC_SEQ_CST);
+
+	// STEP 3: Wait for producers still waking the set
+	for ( int i = 0 ; i < p->count ; i++ )
+		while (__atomic_load_n(&p->queues[i]->notifying, __ATOMIC_SEQ_CST) != 0)
+			sched_yield();
+
+	free(p->queues);
+	free(p);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Register a set of queues a consumer waits on at once
+ *
+ * A queue belongs to at most one poll set. The queues must outlive the set,
+ * see pq_poll_free().
+ *
+ * Param:
+ *	queues : Queues to register, copied into the set
+ *	count  : Entries in queues
+ *
+ * Returns a pointer to a struct pq_poll upon success. Upon error, returns NULL and sets errno 
+ * (EBUSY if a queue is already registered)
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Allocate the set
+ * 3: Register the queues
+ */
+struct pq_poll *pq_poll_init(struct ptr_queue **queues, int count)
+{
+	struct pq_poll *p;
+	struct pq_poll *none;
+
+	// Initialize variables
+	p = NULL;
+
+	// STEP 1: Validate inputs
+	if (queues == NULL || count <= 0)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	for ( int i = 0 ; i < count ; i++ )
+		if (queues[i] == NULL)
+		{
+			errno = EINVAL;
+			goto end;
+		}
+
+	// STEP 2: Allocate the set
+	p = (struct pq_poll *) aligned_alloc(PQ_CACHELINE, sizeof(*p));
+	if (p == NULL)
+	{
+		errno = ENOMEM;
+		goto end;
+	}
+	memset(p, 0, sizeof(*p));
+
+	p->queues = (struct ptr_queue **) calloc(count, sizeof(struct ptr_queue *));
+	if (p->queues == NULL)
+	{
+		free(p);
+		p = NULL;
+		errno = ENOMEM;
+		goto end;
+	}
+
+	// STEP 3: Register the queues
+	for ( int i = 0 ; i < count ; i++ )
+	{
+		none = NULL;
+		if (!__atomic_compare_exchange_n(&queues[i]->poll, &none, p, 0, 
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		{
+			pq_poll_free(p);
+			p = NULL;
+			errno = EBUSY;
+			goto end;
+		}
+
+		p->queues[i] = queues[i];
+		p->count = i + 1;
+	}
+
+end:
+
+	return p;
+}
+
+/*
+ * Wait until a queue of a poll set has entries
+ *
+ * The queues are checked starting after the one returned last time, so a 
+ * busy queue does not hide the others. The caller then pops the queue, 
+ * which another consumer of the set may have emptied in the meantime.
+ *
+ * Param:
+ *	ts    : Timeout, NULL to wait forever. Relative to now, or an absolute 
+ *	        CLOCK_MONOTONIC time if flags contains PQ_TIME_ABS
+ *	flags : enum pq_time_flags
+ *
+ * Returns the index of a non empty queue, -1 otherwise and sets errno 
+ * (ETIMEDOUT if all queues stayed empty, EINVAL if ts->tv_nsec is not in 
+ * [0, 1000000000))
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Look for a non empty queue
+ * 3: Sleep on the eventcount until a producer publishes
+ */
+int pq_poll_wait(struct pq_poll *p, const struct timespec *ts, int flags)
+{
+	struct timespec deadline;
+	__u32 key;
+	int rv, start, i;
+
+	// Initialize variables
+	rv = -1;
+
+	// STEP 1: Validate inputs
+	if (p == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	if (ts != NULL && pq_deadline(ts, flags, &deadline))
+		goto end;
+
+	__atomic_add_fetch(&p->waiting, 1, __ATOMIC_SEQ_CST);
+
+	for (;;)
+	{
+		key = __atomic_load_n(&p->ec, __ATOMIC_ACQUIRE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		// STEP 2: Look for a non empty queue
+		start = __atomic_load_n(&p->next, __ATOMIC_RELAXED);
+		for ( int j = 0 ; j < p->count ; j++ )
+		{
+			i = (start + j) % p->count;
+			if (pq_len(p->queues[i]) > 0)
+			{
+				__atomic_store_n(&p->next, (i + 1) % p->count, __ATOMIC_RELAXED);
+				rv = i;
+				goto done;
+			}
+		}
+
+		// STEP 3: Sleep on the eventcount until a producer publishes
+		if (pq_futex_wait(&p->ec, key, 0, ts != NULL ? &deadline : NULL) == ETIMEDOUT)
+		{
+			errno = ETIMEDOUT;
+			goto done;
+		}
+	}
+
+done:
+
+	__atomic_sub_fetch(&p->waiting, 1, __ATOMIC_RELAXED);
+
+end:
+
+	return rv;
+}
+
+/*
+ * Return the objects cached by the calling thread to the pool
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+int pq_pool_flush(struct ptr_queue *pq)
+{
+	struct pq_mag *mag;
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	if (pq == NULL || pq->buf == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	if (pq->mag_size > 0)
+	{
+		mag = pq_mag_find(pq);
+		if (mag != NULL && mag->count > 0)
+		{
+			if (pq_push_n(pq, mag->objs, mag->count) != (__s32) mag->count)
+				goto end;
+			mag->count = 0;
+		}
+	}
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Take an object from a pool created with a non zero obj_size
+ *
+ * With magazines the object comes from the calling thread's cache, which is
+ * refilled with half a magazine from the shared queue when it runs dry. 
+ * Objects cached by other threads are not visible to this one.
+ *
+ * Param:
+ *	wait : If non zero, block until another thread returns an object
+ *
+ * Return pointer upon success, 0 otherwise and set errno. errno is EAGAIN
+ * if the pool is exhausted and wait == 0
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Without magazines, pop from the shared queue
+ * 3: Refill an empty magazine in one batch
+ * 4: Take the most recently cached object
+ */
+void *pq_pool_get(struct ptr_queue *pq, int wait)
+{
+	struct pq_mag *mag;
+	void *rv;
+	__s32 n;
+
+	// Initialize variables
+	rv = NULL;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL || pq->buf == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Without magazines, pop from the shared queue
+	mag = NULL;
+	if (pq->mag_size > 0)
+		mag = pq_mag_get(pq);
+	if (mag == NULL)
+	{
+		rv = pq_pop(pq, wait);
+		goto end;
+	}
+
+	// STEP 3: Refill an empty magazine in one batch
+	if (mag->count == 0)
+	{
+		n = pq_pop_n(pq, mag->objs, (pq->mag_size + 1) / 2, 0);
+		if (n <= 0)
+		{
+			rv = pq_pop(pq, wait);
+			goto end;
+		}
+		mag->count = n;
+	}
+
+	// STEP 4: Take the most recently cached object
+	rv = mag->objs[--mag->count];
+
+end:
+
+	return rv;
+}
+
+/*
+ * Check that obj is an object of this pool
+ *
+ * The pointer must lie inside buf and start on an object boundary
+ *
+ * Return 1 if obj belongs to the pool, 0 otherwise
+ */
+int pq_pool_owns(struct ptr_queue *pq, void *obj)
+{
+	uintptr_t off;
+
+	if (pq == NULL || pq->buf == NULL || obj == NULL)
+		return 0;
+
+	off = (uintptr_t) obj - (uintptr_t) pq->buf;
+	if (off >= pq->buf_size)
+		return 0;
+
+	return (off % pq->obj_stride) == 0;
+}
+
+/*
+ * Return an object to the pool
+ *
+ * With PQ_ATTR_POOL_CHECK the object is first checked with pq_pool_owns()
+ * so a stray pointer cannot be handed out by a later pq_pool_get()
+ *
+ * With magazines the object is cached by the calling thread. A full 
+ * magazine first flushes its older half to the shared queue in one batch.
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Check the object belongs to the pool
+ * 3: Without magazines, push the object back into the queue
+ * 4: Flush the older half of a full magazine
+ * 5: Cache the object
+ */
+int pq_pool_put(struct ptr_queue *pq, void *obj)
+{
+	struct pq_mag *mag;
+	__s32 n;
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL || pq->buf == NULL || obj == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Check the object belongs to the pool
+	if ((pq->flags & PQ_ATTR_POOL_CHECK) && !pq_pool_owns(pq, obj))
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 3: Without magazines, push the object back into the queue
+	mag = NULL;
+	if (pq->mag_size > 0)
+		mag = pq_mag_get(pq);
+	if (mag == NULL)
+	{
+		rv = pq_push(pq, obj);
+		goto end;
+	}
+
+	// STEP 4: Flush the older half of a full magazine
+	if (mag->count == pq->mag_size)
+	{
+		n = pq_push_n(pq, mag->objs, (pq->mag_size + 1) / 2);
+		if (n <= 0)
+		{
+			rv = pq_push(pq, obj);
+			goto end;
+		}
+		mag->count -= n;
+		memmove(mag->objs, &mag->objs[n], mag->count * sizeof(void *));
+	}
+
+	// STEP 5: Cache the object
+	mag->objs[mag->count++] = obj;
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Return the pointer at the current head location 
+ * 
+ * Param:
+ *	wait : If non zero, block until an entry is available. Otherwise return
+ *	       NULL with errno EAGAIN if the queue is empty. Another thread 
+ *	       holding the lock is waited for, it does not make the call fail
+ *
+ * Return pointer  upon success, 0 otherwise and set errno
+ */
+void *pq_pop(struct ptr_queue *pq, int wait)
+{
+	return pq_pop_deadline(pq, wait, NULL, NULL);
+}
+
+/*
+ * Copy the message at the current head location out of a queue in message mode
+ * 
+ * Param:
+ *	out  : Buffer of at least msg_size bytes
+ *	wait : If non zero, block until a message is available. errno is as for pq_pop()
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+int pq_pop_copy(struct ptr_queue *pq, void *out, int wait)
+{
+	return pq_pop_deadline(pq, wait, NULL, out) == NULL;
+}
+
+/*
+ * Return the pointer at the current head location, waiting until a deadline
+ * 
+ * Param:
+ *	wait     : If non zero, block while the queue is empty
+ *	deadline : Absolute CLOCK_MONOTONIC deadline for the wait, NULL to wait forever
+ *	out      : Buffer the message is copied to in message mode, NULL otherwise
+ *
+ * Return pointer (out in message mode) upon success, 0 otherwise and set errno
+ * 
+ * STEPS
+ * 1: Validate input 
+ * 2: Obtain lock
+ * 3: Check if we are empty 
+ * 4: Get the value out of the array
+ * 5: Compute new head index 
+ * 6: Unlock mutex and return 
+ */
+static void *pq_pop_deadline(
+	struct ptr_queue *pq, 
+	int wait, 
+	const struct timespec *deadline,
+	void *out)
+{
+	void *rv;
+	__s32 n;
+	int rc;
+
+	// Initialize variables 
+	rv = NULL;
+	n = 0;
+
+	// STEP 1: Validate input 
+	if (pq == NULL || (pq->msgs != NULL) != (out != NULL)) 
+	{
+		errno = EINVAL; 
+		goto end;
+	}
+
+	// Lock-free engines do not use the mutex on the hot path
+	switch (pq->engine)
+	{
+		case PQ_ENGINE_SPSC:
+			n = pq_spsc_pop(pq, &rv, wait, deadline, out);
+			goto end;
+
+		case PQ_ENGINE_MPMC:
+			n = pq_mpmc_pop(pq, &rv, wait, deadline, out);
+			goto end;
+
+		case PQ_ENGINE_CHUNKED:
+			n = pq_chunk_pop_n(pq, &rv, 1, wait, deadline);
+			if (n <= 0)
+			{
+				n = 0;
+				rv = NULL;
+			}
+			goto end;
+	}
+
+	// STEP 2: Obtain lock
+	// Even a caller that does not want to wait for an entry waits for the lock
+	pq_lock(pq, &pq->mtx);
+
+	// STEP 3: Check if we are empty 
+	/* If head == tail then the queue is empty
+	 * Count ourselves in waiting to tell the other threads that we need to be signaled 
+	 * Pend upon the condition signal until the queue goes non empty. Another 
+	 * consumer may take the entry first, so re-check after every wakeup
+	 */
+	while (pq->head == pq->tail) 
+	{
+		// Return immediately if caller does not want to wait
+		if (!wait)
+		{
+			errno = EAGAIN;
+			goto unlock;
+		}
+
+		// Spin without the lock first if the wait strategy allows it
+		rc = EAGAIN;
+		if (pq->wait_strategy != PQ_WAIT_PARK)
+		{
+			pthread_mutex_unlock(&pq->mtx);
+			rc = pq_spin(pq, 0, deadline);
+			pthread_mutex_lock(&pq->mtx);
+		}
+
+		if (rc == EAGAIN)
+		{
+			pq->waiting++;
+			rc = pq_cond_wait(pq, &pq->cond, &pq->mtx, deadline);
+			pq->waiting--;
+		}
+
+		// The deadline passed before an entry arrived
+		if (rc == ETIMEDOUT && pq->head == pq->tail)
+		{
+			errno = ETIMEDOUT;
+			goto unlock;
+		}
+	}
+
+	// STEP 4: Get the value out of the array
+	rv = pq_slot_load(pq, pq_ring_slot(pq, pq->head), out);
+
+	// STEP 5: Compute new head
+	__atomic_store_n(&pq->head, pq_ring_advance(pq, pq->head, 1), __ATOMIC_RELAXED);
+	pq_ring_shrink(pq);
+	n = 1;
+
+	// If a producer is waiting for the queue to go not full, signal it
+	pq_cond_wake(pq, &pq->cond_full, pq->waiting_full, 1);
+
+unlock:
+
+	// STEP 6: Unlock mutex and return 
+	pthread_mutex_unlock(&pq->mtx); 
+
+end:
+
+	if (pq != NULL)
+		pq_stats_pop(pq, n);
+
+	if (n > 0)
+	{
+		pq_watermark(pq);
+		pq_async_wake(pq, 1, 1);
+	}
+
+	return rv;
+}
+
+/*
+ * Remove up to max entries from the head of the queue
+ *
+ * All entries are moved under a single lock acquisition (or a single CAS for
+ * the lock-free engines) with at most two memcpy's across the wrap point.
+ *
+ * Param:
+ *	out  : Array of at least max entries that receives the popped pointers
+ *	max  : Maximum number of entries to pop
+ *	wait : If non zero, block until at least one entry is available
+ *
+ * Returns the number of entries popped. Returns a negative number upon error and sets errno.
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Obtain lock
+ * 3: Check if we are empty
+ * 4: Copy the entries out of the array
+ * 5: Compute new head
+ * 6: Unlock mutex and return
+ */
+__s32 pq_pop_n(struct ptr_queue *pq, void **out, __u32 max, int wait)
+{
+	__s32 rv;
+	__u32 len;
+	int rc;
+
+	// Initialize variables
+	rv = 0;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL || pq->msgs != NULL || (out == NULL && max > 0))
+	{
+		errno = EINVAL;
+		rv = -EINVAL;
+		goto end;
+	}
+
+	if (max == 0)
+		goto end;
+
+	// Lock-free engines do not use the mutex on the hot path
+	switch (pq->engine)
+	{
+		case PQ_ENGINE_SPSC:
+			rv = pq_spsc_pop_n(pq, out, max, wait);
+			goto end;
+
+		case PQ_ENGINE_MPMC:
+			rv = pq_mpmc_pop_n(pq, out, max, wait);
+			goto end;
+
+		case PQ_ENGINE_CHUNKED:
+			rv = pq_chunk_pop_n(pq, out, max, wait, NULL);
+			goto end;
+	}
+
+	// STEP 2: Obtain lock
+	pq_lock(pq, &pq->mtx);
+
+	// STEP 3: Check if we are empty
+	while (pq->head == pq->tail) 
+	{
+		if (!wait)
+		{
+			errno = EAGAIN;
+			goto unlock;
+		}
+
+		if (pq->wait_strategy != PQ_WAIT_PARK)
+		{
+			pthread_mutex_unlock(&pq->mtx);
+			rc = pq_spin(pq, 0, NULL);
+			pthread_mutex_lock(&pq->mtx);
+			if (rc == 0)
+				continue;
+		}
+
+		pq->waiting++;
+		pq_cond_wait(pq, &pq->cond, &pq->mtx, NULL);
+		pq->waiting--;
+	}
+
+	// STEP 4: Copy the entries out of the array
+	len = pq_ring_count(pq, pq->head, pq->tail);
+	if (max > len)
+		max = len;
+
+	pq_ring_read(pq, pq->head, out, max);
+
+	// STEP 5: Compute new head
+	__atomic_store_n(&pq->head, pq_ring_advance(pq, pq->head, max), __ATOMIC_RELAXED);
+	pq_ring_shrink(pq);
+
+	// If producers are waiting for the queue to go not full, wake one per slot
+	pq_cond_wake(pq, &pq->cond_full, pq->waiting_full, max);
+
+	rv = max;
+
+unlock:
+
+	// STEP 6: Unlock mutex and return
+	pthread_mutex_unlock(&pq->mtx); 
+
+end:
+
+	if (rv >= 0 && max > 0)
+		pq_stats_pop(pq, rv);
+
+	if (rv > 0)
+	{
+		pq_watermark(pq);
+		pq_async_wake(pq, rv, 1);
+	}
+
+	return rv;
+}
+
+/*
+ * Return the pointer at the current head location, waiting up to a timeout
+ *
+ * Param:
+ *	ts    : Timeout. Relative to now, or an absolute CLOCK_MONOTONIC time if
+ *	        flags contains PQ_TIME_ABS
+ *	flags : enum pq_time_flags
+ *
+ * Return pointer  upon success, 0 otherwise and set errno (ETIMEDOUT if still empty,
+ * EINVAL if ts->tv_nsec is not in [0, 1000000000))
+ */
+void *pq_pop_timed(
+	struct ptr_queue *pq, 
+	const struct timespec *ts, 
+	int flags)
+{
+	struct timespec deadline;
+
+	if (pq_deadline(ts, flags, &deadline))
+		return NULL;
+
+	return pq_pop_deadline(pq, 1, &deadline, NULL);
+}
+
+void pq_print(struct ptr_queue *pq)
+{
+	struct pq_stats stats;
+
+	if (pq == NULL) {
+		return;
+	}
+
+	printf("Printing ptr_queue ------------------------------\n");
+	printf("pq address:            %p\n", pq);
+	printf("pq->data:              %p\n", pq->data);
+	printf("pq->array_capacity:    %u\n", pq->array_capacity);
+	printf("pq->user_capacity:     %u\n", pq->user_capacity);
+	printf("pq->len:               %u\n", pq_len(pq));
+	printf("pq->head:              %u\n", pq->head);
+	printf("pq->tail:              %u\n", pq->tail);
+	printf("pq->waiting:           %d\n", pq->waiting);
+	printf("pq->buf:               %p\n", pq->buf);
+	printf("pq->obj_size:          %zu\n", pq->obj_size);
+	printf("pq->obj_stride:        %zu\n", pq->obj_stride);
+
+	printf("pq->msg_size:          %zu\n", pq->msg_size);
+	printf("pq->overflow:          %d\n", pq->overflow);
+	printf("pq->dropped:           %llu\n", (unsigned long long) pq_dropped(pq));
+
+	if (pq_stats(pq, &stats) == 0)
+	{
+		printf("pq->stats.pushes:      %llu\n", (unsigned long long) stats.pushes);
+		printf("pq->stats.pops:        %llu\n", (unsigned long long) stats.pops);
+		printf("pq->stats.full:        %llu\n", (unsigned long long) stats.full);
+		printf("pq->stats.empty:       %llu\n", (unsigned long long) stats.empty);
+		printf("pq->stats.trylock:     %llu\n", (unsigned long long) stats.trylock_fails);
+		printf("pq->stats.waits:       %llu\n", (unsigned long long) stats.waits);
+		printf("pq->stats.signals:     %llu\n", (unsigned long long) stats.signals);
+		printf("pq->stats.lock_ns:     %llu\n", (unsigned long long) stats.lock_wait_ns);
+		printf("pq->stats.wait_ns:     %llu\n", (unsigned long long) stats.wait_ns);
+		printf("pq->stats.high_water:  %u\n", stats.high_water);
+	}
+
+	for ( __u32 i = 0 ; pq->data != NULL && i < pq->array_capacity ; i++ ) 
+	{
+		printf("data[%02d]:       %p\n", i, pq->data[i]);
+	}
+}
+
+/*
+ * Free a priority queue and the queues of its levels
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+int pq_prio_free(struct pq_prio *p)
+{
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (p == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Free the queue of each level
+	for ( int i = 0 ; p->queues != NULL && i < p->levels ; i++ )
+		if (p->queues[i] != NULL)
+			pq_free(p->queues[i]);
+
+	free(p->queues);
+	free(p);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Create a priority queue of several FIFO levels
+ *
+ * Param:
+ *	levels : Number of levels, at most PQ_PRIO_LEVELS. Level 0 is the most urgent
+ *	count  : Capacity of each level
+ *	starve : If non zero, every starve-th pop serves the least urgent non 
+ *	         empty level, so bulk levels keep moving under a flood of urgent
+ *	         entries
+ *	attr   : Attributes of the level queues, NULL for the defaults. Message
+ *	         mode is invalid
+ *
+ * Returns a pointer to a struct pq_prio upon success. Upon error, returns NULL and sets errno 
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Allocate the priority queue
+ * 3: Create the queue of each level
+ */
+struct pq_prio *pq_prio_init(
+	int levels, 
+	size_t count, 
+	__u32 starve, 
+	const struct pq_attr *attr)
+{
+	struct pq_prio *p;
+
+	// Initialize variables
+	p = NULL;
+
+	// STEP 1: Validate inputs
+	if (levels <= 0 || levels > PQ_PRIO_LEVELS || (attr != NULL && attr->msg_size > 0))
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Allocate the priority queue
+	p = (struct pq_prio *) aligned_alloc(PQ_CACHELINE, sizeof(*p));
+	if (p == NULL)
+	{
+		errno = ENOMEM;
+		goto end;
+	}
+	memset(p, 0, sizeof(*p));
+	p->levels = levels;
+	p->starve = starve;
+
+	p->queues = (struct ptr_queue **) calloc(levels, sizeof(struct ptr_queue *));
+	if (p->queues == NULL)
+	{
+		free(p);
+		p = NULL;
+		errno = ENOMEM;
+		goto end;
+	}
+
+	// STEP 3: Create the queue of each level
+	for ( int i = 0 ; i < levels ; i++ )
+	{
+		p->queues[i] = pq_init_attr(count, 0, attr);
+		if (p->queues[i] == NULL)
+		{
+			int err = errno;
+			pq_prio_free(p);
+			p = NULL;
+			errno = err;
+			goto end;
+		}
+	}
+
+end:
+
+	return p;
+}
+
+/*
+ * Return the number of entries in all levels of a priority queue
+ *
+ * The result is a snapshot and may be stale by the time it is used
+ *
+ * Returns a negative number upon error and sets errno
+ */
+__s32 pq_prio_len(struct pq_prio *p)
+{
+	__s32 rv, len;
+
+	// Initialize variables
+	rv = 0;
+
+	// STEP 1: Validate inputs
+	if (p == NULL)
+	{
+		errno = EINVAL;
+		rv = -EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Sum the levels
+	for ( int i = 0 ; i < p->levels ; i++ )
+	{
+		len = pq_len(p->queues[i]);
+		if (len > 0 && rv <= INT32_MAX - len)
+			rv += len;
+	}
+
+end:
+
+	return rv;
+}
+
+/*
+ * Sleep until any level of a priority queue may have an entry
+ *
+ * Same eventcount protocol as pq_ec_wait(), with a non zero bitmap as the
+ * condition. pq_prio_push() is the waker.
+ */
+static void pq_prio_park(struct pq_prio *p)
+{
+	__u32 key;
+
+	__atomic_add_fetch(&p->waiting, 1, __ATOMIC_SEQ_CST);
+
+	for (;;)
+	{
+		key = __atomic_load_n(&p->ec, __ATOMIC_ACQUIRE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&p->bitmap, __ATOMIC_ACQUIRE) != 0)
+			break;
+
+		pq_futex_wait(&p->ec, key, 0, NULL);
+	}
+
+	__atomic_sub_fetch(&p->waiting, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Remove the entry at the head of the most urgent non empty level
+ *
+ * The level is found as the lowest set bit of the occupancy bitmap. A level
+ * found empty has its bit cleared, and set again if a producer pushed in the
+ * meantime, so a bit is never lost for a level that holds entries. A level
+ * whose lock is held by a producer is waited for rather than passed over, 
+ * see pq_pop(), so a contended urgent level is never served after a less 
+ * urgent one.
+ *
+ * Param:
+ *	wait : If non zero, park until any level has an entry. Otherwise return
+ *	       NULL with errno EAGAIN if all levels are empty
+ *
+ * Return pointer upon success, 0 otherwise and set errno
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Select the most urgent level, or the least urgent one on a starvation turn
+ * 3: Pop the level, clear its bit if it is empty
+ * 4: Park until a level has an entry
+ */
+void *pq_prio_pop(struct pq_prio *p, int wait)
+{
+	__u64 bits, bit;
+	void *rv;
+	int level, starve;
+
+	// Initialize variables
+	rv = NULL;
+
+	// STEP 1: Validate inputs
+	if (p == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	starve = p->starve > 0 && 
+		__atomic_add_fetch(&p->pops, 1, __ATOMIC_RELAXED) % p->starve == 0;
+
+	for (;;)
+	{
+		bits = __atomic_load_n(&p->bitmap, __ATOMIC_ACQUIRE);
+		while (bits != 0)
+		{
+			// STEP 2: Select the most urgent level, or the least urgent one on a starvation turn
+			level = starve ? 63 - __builtin_clzll(bits) : __builtin_ctzll(bits);
+			bit = 1ULL << level;
+
+			// STEP 3: Pop the level, clear its bit if it is empty
+			if (pq_pop_n(p->queues[level], &rv, 1, 0) == 1)
+				goto end;
+
+			__atomic_fetch_and(&p->bitmap, ~bit, __ATOMIC_SEQ_CST);
+			if (pq_len(p->queues[level]) > 0)
+				__atomic_fetch_or(&p->bitmap, bit, __ATOMIC_SEQ_CST);
+
+			bits &= ~bit;
+		}
+
+		// STEP 4: Park until a level has an entry
+		if (!wait)
+		{
+			errno = EAGAIN;
+			goto end;
+		}
+
+		pq_prio_park(p);
+	}
+
+end:
+
+	return rv;
+}
+
+/*
+ * Insert an entry at the tail of a level of a priority queue
+ *
+ * Param:
+ *	level : 0 for the most urgent level up to levels - 1
+ *
+ * Return 0 upon success, 1 otherwise and set errno (ENOMEM if the level is full)
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Push to the queue of the level
+ * 3: Mark the level non empty
+ * 4: If consumers are parked, wake one
+ */
+int pq_prio_push(struct pq_prio *p, void *ptr, int level)
+{
+	__u64 bit;
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (p == NULL || level < 0 || level >= p->levels)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Push to the queue of the level
+	rv = pq_push(p->queues[level], ptr);
+	if (rv != 0)
+		goto end;
+
+	// STEP 3: Mark the level non empty
+	// The entry is queued before the bit is set, see pq_prio_pop()
+	bit = 1ULL << level;
+	__atomic_fetch_or(&p->bitmap, bit, __ATOMIC_SEQ_CST);
+
+	// STEP 4: If consumers are parked, wake one
+	pq_ec_wake(&p->ec, &p->waiting, 1);
+
+end:
+
+	return rv;
+}
+
+/*
+ * Insert a new entry at the current tail location
+ *
+ * Return 0 upon success, 1 if error and set errno
+ */
+int pq_push(struct ptr_queue *pq, void *ptr)
+{
+	return pq_push_deadline(pq, ptr, 0, 0, NULL, NULL);
+}
+
+/*
+ * Copy a message into the current tail location of a queue in message mode
+ *
+ * Param:
+ *	msg  : Message of msg_size bytes
+ *	wait : If non zero, block while the queue is full
+ *
+ * Return 0 upon success, 1 if error and set errno (ENOMEM if full)
+ */
+int pq_push_copy(struct ptr_queue *pq, const void *msg, int wait)
+{
+	if (msg == NULL)
+	{
+		errno = EINVAL;
+		return 1;
+	}
+
+	return pq_push_deadline(pq, (void *) msg, 1, wait, NULL, NULL);
+}
+
+/*
+ * Insert a new entry at the current tail location, waiting while the queue is full
+ *
+ * A push that does not wait applies the overflow policy of the queue when it
+ * is full. The policy is applied under the same lock (or after the same 
+ * failed claim) that found the queue full.
+ *
+ * Param:
+ *	copy     : Non zero in message mode, ptr is then the message to copy in
+ *	wait     : If non zero, block while the queue is full
+ *	deadline : Absolute CLOCK_MONOTONIC deadline for the wait, NULL to wait forever
+ *	evicted  : If not NULL, set to the entry the overflow policy pushed out
+ *
+ * Return 0 upon success, 1 if error and set errno (ENOMEM if full, ETIMEDOUT)
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Obtain lock 
+ * 3: Check if we are full, grow, apply the overflow policy or wait for a consumer to make room
+ * 4: Compute new tail
+ * 5: Store the new ptr at the current tail 
+ * 6: Store the new tail index
+ * 7: If consumer thread is waiting for queue to go nonempty, signal it
+ * 8: Unlock and exit 
+ */
+static int pq_push_deadline(
+	struct ptr_queue *pq, 
+	void *ptr, 
+	int copy, 
+	int wait, 
+	const struct timespec *deadline,
+	void **evicted)
+{
+	int rv; 
+	int rc;
+	int policy, drop;
+	__u32 new_tail; 
+
+	// Initialize variables 
+	rv = 1;
+	drop = 0;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL || (pq->msgs != NULL) != (copy != 0)) 
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	policy = __atomic_load_n(&pq->overflow, __ATOMIC_RELAXED);
+	if (policy == PQ_OVERFLOW_BLOCK)
+		wait = 1;
+
+	// A chunked queue is never full
+	if (pq->engine == PQ_ENGINE_CHUNKED)
+	{
+		if (pq_chunk_push_n(pq, &ptr, 1) == 1)
+			rv = 0;
+		goto end;
+	}
+
+	// Lock-free engines do not use the mutex on the hot path
+	if (pq->engine != PQ_ENGINE_MUTEX)
+	{
+		for (;;)
+		{
+			if (pq->engine == PQ_ENGINE_SPSC)
+				rv = pq_spsc_push(pq, ptr);
+			else
+				rv = pq_mpmc_push(pq, ptr);
+
+			if (rv == 0)
+				goto end;
+
+			if (!wait)
+			{
+				// Lock-free engines cannot evict, see pq_set_overflow()
+				if (policy == PQ_OVERFLOW_DROP)
+				{
+					__atomic_fetch_add(&pq->dropped, 1, __ATOMIC_RELAXED);
+					if (evicted != NULL)
+						*evicted = ptr;
+					drop = 1;
+					rv = 0;
+				}
+				goto end;
+			}
+
+			if (pq_lf_wait(pq, 1, deadline) != 0)
+			{
+				errno = ETIMEDOUT;
+				goto end;
+			}
+		}
+	}
+
+	// STEP 2: Obtain lock 
+	pq_lock(pq, &pq->mtx);
+
+	// STEP 3: Check if we are full, grow, apply the overflow policy or wait for a consumer to make room
+	while (pq_ring_count(pq, pq->head, pq->tail) == pq->user_capacity) 
+	{
+		if (pq_ring_grow(pq, 1) == 0)
+			continue;
+
+		if (!wait)
+		{
+			if (policy == PQ_OVERFLOW_OVERWRITE)
+			{
+				pq_overflow_evict(pq, evicted);
+				break;
+			}
+			if (policy == PQ_OVERFLOW_DROP)
+			{
+				__atomic_fetch_add(&pq->dropped, 1, __ATOMIC_RELAXED);
+				if (evicted != NULL)
+					*evicted = ptr;
+				drop = 1;
+				rv = 0;
+				goto unlock;
+			}
+
+			errno = ENOMEM;
+			goto unlock;
+		}
+
+		// Spin without the lock first if the wait strategy allows it
+		rc = EAGAIN;
+		if (pq->wait_strategy != PQ_WAIT_PARK)
+		{
+			pthread_mutex_unlock(&pq->mtx);
+			rc = pq_spin(pq, 1, deadline);
+			pthread_mutex_lock(&pq->mtx);
+		}
+
+		if (rc == EAGAIN)
+		{
+			pq->waiting_full++;
+			rc = pq_cond_wait(pq, &pq->cond_full, &pq->mtx, deadline);
+			pq->waiting_full--;
+		}
+
+		if (rc == ETIMEDOUT && pq_ring_count(pq, pq->head, pq->tail) == pq->user_capacity)
+		{
+			errno = ETIMEDOUT;
+			goto unlock;
+		}
+	}
+
+	// STEP 4: Compute new tail
+	new_tail = pq_ring_advance(pq, pq->tail, 1);
+
+	// STEP 5: Store the new ptr at the current tail 
+	pq_slot_store(pq, pq_ring_slot(pq, pq->tail), ptr);
+
+	// STEP 6: Store the new tail index
+	__atomic_store_n(&pq->tail, new_tail, __ATOMIC_RELAXED);
+
+	// STEP 7: If consumer thread is waiting for queue to go nonempty, signal it
+	pq_cond_wake(pq, &pq->cond, pq->waiting, 1);
+	pq_notify(pq);
+	pq_stats_level(pq, pq_ring_count(pq, pq->head, pq->tail));
+
+	rv = 0;
+
+unlock:
+
+	// STEP 8: Unlock and exit 
+	pthread_mutex_unlock(&pq->mtx); 
+
+end:
+
+	if (pq != NULL)
+		pq_stats_push(pq, rv == 0 && !drop);
+
+	if (rv == 0 && !drop)
+	{
+		pq_watermark(pq);
+		pq_async_wake(pq, 1, 0);
+	}
+
+	return rv;
+}
+
+/*
+ * Insert a new entry and hand back the entry the overflow policy pushed out
+ *
+ * Same as pq_push(), but with PQ_OVERFLOW_OVERWRITE evicted is set to the 
+ * oldest entry, which made room for ptr, and with PQ_OVERFLOW_DROP it is set
+ * to ptr itself. Either way the caller owns the entry again, so it can be 
+ * returned to the pool. evicted is set to NULL if nothing was pushed out.
+ *
+ * Return 0 upon success, 1 if error and set errno (ENOMEM if full)
+ */
+int pq_push_evict(struct ptr_queue *pq, void *ptr, void **evicted)
+{
+	if (evicted == NULL)
+	{
+		errno = EINVAL;
+		return 1;
+	}
+
+	*evicted = NULL;
+
+	return pq_push_deadline(pq, ptr, 0, 0, NULL, evicted);
+}
+
+/*
+ * Insert up to n entries at the tail of the queue
+ *
+ * All entries are moved under a single lock acquisition (or a single CAS for
+ * the lock-free engines) with at most two memcpy's across the wrap point and
+ * at most one wakeup of the consumers.
+ *
+ * Returns the number of entries pushed, which is less than n if the queue
+ * filled up. Returns a negative number upon error and sets errno.
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Obtain lock 
+ * 3: Compute free space, growing the ring if it is too small
+ * 4: Store the new ptrs at the current tail 
+ * 5: Store the new tail index
+ * 6: If consumer thread is waiting for queue to go nonempty, signal it
+ * 7: Unlock and exit 
+ */
+__s32 pq_push_n(struct ptr_queue *pq, void **ptrs, __u32 n)
+{
+	__s32 rv; 
+	__u32 space, want;
+
+	// Initialize variables 
+	rv = 0;
+	want = n;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL || pq->msgs != NULL || (ptrs == NULL && n > 0)) 
+	{
+		errno = EINVAL;
+		rv = -EINVAL;
+		goto end;
+	}
+
+	if (n == 0)
+		goto end;
+
+	// Lock-free engines do not use the mutex on the hot path
+	switch (pq->engine)
+	{
+		case PQ_ENGINE_SPSC:
+			rv = pq_spsc_push_n(pq, ptrs, n);
+			goto end;
+
+		case PQ_ENGINE_MPMC:
+			rv = pq_mpmc_push_n(pq, ptrs, n);
+			goto end;
+
+		case PQ_ENGINE_CHUNKED:
+			rv = pq_chunk_push_n(pq, ptrs, n);
+			goto end;
+	}
+
+	// STEP 2: Obtain lock 
+	pq_lock(pq, &pq->mtx);
+
+	// STEP 3: Compute free space, growing the ring if it is too small
+	space = pq->user_capacity - pq_ring_count(pq, pq->head, pq->tail);
+	if (n > space && pq_ring_grow(pq, n - space) == 0)
+		space = pq->user_capacity - pq_ring_count(pq, pq->head, pq->tail);
+	if (n > space)
+		n = space;
+	if (n == 0)
+	{
+		errno = ENOMEM;
+		goto unlock;
+	}
+
+	// STEP 4: Store the new ptrs at the current tail 
+	pq_ring_write(pq, pq->tail, ptrs, n);
+
+	// STEP 5: Store the new tail index
+	__atomic_store_n(&pq->tail, pq_ring_advance(pq, pq->tail, n), __ATOMIC_RELAXED);
+
+	// STEP 6: If consumer threads are waiting for queue to go nonempty, wake one per entry
+	pq_cond_wake(pq, &pq->cond, pq->waiting, n);
+	pq_notify(pq);
+	pq_stats_level(pq, pq_ring_count(pq, pq->head, pq->tail));
+
+	rv = n;
+
+unlock:
+
+	// STEP 7: Unlock and exit 
+	pthread_mutex_unlock(&pq->mtx); 
+
+end:
+
+	if (rv == 0 && n > 0)
+		errno = ENOMEM;
+
+	if (rv >= 0 && want > 0)
+		pq_stats_push(pq, rv);
+
+	if (rv > 0)
+	{
+		pq_watermark(pq);
+		pq_async_wake(pq, rv, 0);
+	}
+
+	return rv;
+}
+
+/*
+ * Insert a new entry, waiting up to a timeout while the queue is full
+ *
+ * Param:
+ *	ts    : Timeout. Relative to now, or an absolute CLOCK_MONOTONIC time if
+ *	        flags contains PQ_TIME_ABS
+ *	flags : enum pq_time_flags
+ *
+ * Return 0 upon success, 1 if error and set errno (ETIMEDOUT if still full,
+ * EINVAL if ts->tv_nsec is not in [0, 1000000000))
+ */
+int pq_push_timed(
+	struct ptr_queue *pq, 
+	void *ptr, 
+	const struct timespec *ts, 
+	int flags)
+{
+	struct timespec deadline;
+
+	if (pq_deadline(ts, flags, &deadline))
+		return 1;
+
+	return pq_push_deadline(pq, ptr, 0, 1, &deadline, NULL);
+}
+
+/*
+ * Insert a new entry, blocking while the queue is full
+ *
+ * Return 0 upon success, 1 if error and set errno
+ */
+int pq_push_wait(struct ptr_queue *pq, void *ptr)
+{
+	return pq_push_deadline(pq, ptr, 0, 1, NULL, NULL);
+}
+
+/*
+ * Hand n entries of a span returned by pq_peek_n() back to the producers
+ *
+ * On the SPSC engine fewer entries than peeked may be released, the rest 
+ * stay at the head of the queue. On the MPMC engine every peeked entry must
+ * be released.
+ *
+ * Param:
+ *	span : Span returned by pq_peek_n()
+ *	n    : Number of entries to release from the start of the span
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Release the slots
+ * 3: If producers are sleeping, wake them
+ */
+int pq_release(struct ptr_queue *pq, void **span, __u32 n)
+{
+	int rv;
+	__u32 slot, head, seq;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL || pq->data == NULL || span < pq->data || 
+		span - pq->data + (size_t) n > pq->array_capacity)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (pq->engine == PQ_ENGINE_MUTEX || pq->engine == PQ_ENGINE_CHUNKED)
+	{
+		errno = ENOTSUP;
+		goto end;
+	}
+	slot = span - pq->data;
+
+	// STEP 2: Release the slots
+	if (pq->engine == PQ_ENGINE_SPSC)
+	{
+		head = __atomic_load_n(&pq->head, __ATOMIC_RELAXED);
+		if (slot != pq_ring_slot(pq, head) || 
+			n > pq_ring_count(pq, head, pq->tail_cache))
+		{
+			errno = EINVAL;
+			goto end;
+		}
+		pq_latency_record(pq, slot, n);
+		__atomic_store_n(&pq->head, pq_ring_advance(pq, head, n), __ATOMIC_RELEASE);
+	}
+	else
+	{
+		// A claimed entry holds its position + 1 as sequence number
+		pq_latency_record(pq, slot, n);
+		for ( __u32 i = 0 ; i < n ; i++ )
+		{
+			seq = __atomic_load_n(&pq->seq[slot + i], __ATOMIC_RELAXED);
+			__atomic_store_n(&pq->seq[slot + i], seq - 1 + pq->array_capacity, __ATOMIC_RELEASE);
+		}
+	}
+
+	// STEP 3: If producers are sleeping, wake them
+	if (n > 0)
+		pq_stats_pop(pq, n);
+	pq_lf_wake_full(pq, n);
+	pq_watermark(pq);
+	pq_async_wake(pq, n, 1);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Claim a span of free slots at the tail of the queue to fill in place
+ *
+ * Entries written to the span are invisible to consumers until pq_commit().
+ * The span never wraps around the end of the array, so fewer than n slots
+ * may be returned even if more are free. Lock-free engines only.
+ *
+ * Param:
+ *	span : Set to the first slot of the span
+ *	n    : Maximum number of slots
+ *
+ * Returns the number of slots in the span, 0 if full (errno ENOMEM), 
+ * -EINVAL or -ENOTSUP on error
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Compute free space
+ * 3: Limit the span to the end of the array
+ */
+__s32 pq_reserve(struct ptr_queue *pq, void ***span, __u32 n)
+{
+	__s32 rv;
+	__u32 tail, pos, space, slot;
+
+	// Initialize variables
+	rv = 0;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL || pq->msgs != NULL || span == NULL)
+	{
+		errno = EINVAL;
+		rv = -EINVAL;
+		goto end;
+	}
+	if (pq->engine == PQ_ENGINE_MUTEX || pq->engine == PQ_ENGINE_CHUNKED)
+	{
+		errno = ENOTSUP;
+		rv = -ENOTSUP;
+		goto end;
+	}
+	if (n == 0)
+		goto end;
+
+	// STEP 2: Compute free space
+	if (pq->engine == PQ_ENGINE_MPMC)
+	{
+		rv = pq_mpmc_claim_push(pq, n, 1, &pos);
+		*span = &pq->data[pos & pq->mask];
+		if (rv == 0)
+			errno = ENOMEM;
+		goto end;
+	}
+
+	tail = __atomic_load_n(&pq->tail, __ATOMIC_RELAXED);
+	space = pq->user_capacity - pq_ring_count(pq, pq->head_cache, tail);
+	if (space < n)
+	{
+		pq->head_cache = __atomic_load_n(&pq->head, __ATOMIC_ACQUIRE);
+		space = pq->user_capacity - pq_ring_count(pq, pq->head_cache, tail);
+	}
+	if (space == 0)
+	{
+		errno = ENOMEM;
+		goto end;
+	}
+
+	// STEP 3: Limit the span to the end of the array
+	slot = pq_ring_slot(pq, tail);
+	if (space > pq->array_capacity - slot)
+		space = pq->array_capacity - slot;
+	if (n > space)
+		n = space;
+
+	*span = &pq->data[slot];
+	rv = n;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Return index pos advanced by n slots
+ *
+ * Power of two queues use free running indices, the others wrap at 
+ * array_capacity and sacrifice a slot to tell full from empty
+ */
+static __u32 pq_ring_advance(struct ptr_queue *pq, __u32 pos, __u32 n)
+{
+	pos += n;
+	if (!(pq->flags & PQ_ATTR_POW2) && pos >= pq->array_capacity)
+		pos -= pq->array_capacity;
+
+	return pos;
+}
+
+/*
+ * Return the number of entries between head and tail
+ */
+static __u32 pq_ring_count(struct ptr_queue *pq, __u32 head, __u32 tail)
+{
+	if ((pq->flags & PQ_ATTR_POW2) || tail >= head)
+		return tail - head;
+
+	return (pq->array_capacity - head) + tail;
+}
+
+/*
+ * Grow a growable queue so at least n more entries fit, called with mtx held
+ *
+ * The capacity doubles until the entries fit or max_capacity is reached. 
+ * Doubling keeps the cost of the copies amortized constant per push.
+ *
+ * Return 0 if the capacity grew, 1 otherwise and set errno
+ */
+static int pq_ring_grow(struct ptr_queue *pq, __u32 n)
+{
+	__u64 count, need;
+
+	if (pq->user_capacity >= pq->max_capacity)
+	{
+		errno = ENOMEM;
+		return 1;
+	}
+
+	need = (__u64) pq_ring_count(pq, pq->head, pq->tail) + n;
+	count = pq->user_capacity;
+	while (count < need && count < pq->max_capacity)
+		count <<= 1;
+	if (count > pq->max_capacity)
+		count = pq->max_capacity;
+
+	return pq_ring_resize(pq, count);
+}
+
+/*
+ * Copy n entries starting at index pos out of the ring with at most two memcpy's
+ */
+static void pq_ring_read(struct ptr_queue *pq, __u32 pos, void **out, __u32 n)
+{
+	__u32 first;
+
+	pos = pq_ring_slot(pq, pos);
+	first = pq->array_capacity - pos;
+	if (first > n)
+		first = n;
+
+	memcpy(out, &pq->data[pos], first * sizeof(void *));
+	memcpy(&out[first], pq->data, (n - first) * sizeof(void *));
+	pq_latency_record(pq, pos, n);
+}
+
+/*
+ * Move the entries of a mutex queue to a new array of count slots
+ *
+ * Called with mtx held. The entries are copied in FIFO order to the start
+ * of the new array, so the ring no longer wraps inside them.
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ *
+ * STEPS
+ * 1: Size the new array
+ * 2: Allocate the new array
+ * 3: Copy the entries with at most two memcpy's across the wrap point
+ * 4: Swap in the new array
+ */
+static int pq_ring_resize(struct ptr_queue *pq, __u32 count)
+{
+	__u8 *old, *array;
+	size_t elem, map;
+	__u32 capacity, len, pos, first;
+
+	// STEP 1: Size the new array
+	elem = pq->msgs != NULL ? pq->msg_stride : sizeof(void *);
+	capacity = count + 1;
+	if (pq->flags & PQ_ATTR_POW2)
+		capacity = count;
+
+	len = pq_ring_count(pq, pq->head, pq->tail);
+	if (len > count || capacity > SIZE_MAX / elem)
+	{
+		errno = EINVAL;
+		return 1;
+	}
+
+	// STEP 2: Allocate the new array
+	array = (__u8 *) pq_mem_alloc(capacity * elem, PQ_CACHELINE, pq->flags, 
+			pq->numa_node, &map);
+	if (array == NULL)
+		return 1;
+
+	// STEP 3: Copy the entries with at most two memcpy's across the wrap point
+	old = pq->msgs != NULL ? pq->msgs : (__u8 *) pq->data;
+	pos = pq_ring_slot(pq, pq->head);
+	first = pq->array_capacity - pos;
+	if (first > len)
+		first = len;
+
+	memcpy(array, &old[pos * elem], first * elem);
+	memcpy(&array[first * elem], old, (len - first) * elem);
+
+	// STEP 4: Swap in the new array
+	if (pq->msgs != NULL)
+	{
+		pq_mem_free(pq->msgs, pq->msgs_map);
+		pq->msgs = array;
+		pq->msgs_map = map;
+	}
+	else
+	{
+		pq_mem_free(pq->data, pq->data_map);
+		pq->data = (void **) array;
+		pq->data_map = map;
+	}
+
+	pq->array_capacity = capacity;
+	pq->user_capacity = count;
+	if (pq->flags & PQ_ATTR_POW2)
+		pq->mask = capacity - 1;
+	__atomic_store_n(&pq->head, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&pq->tail, len, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/*
+ * Halve a grown queue after sustained low occupancy, called with mtx held
+ *
+ * Only queues created with PQ_ATTR_SHRINK shrink. The queue must stay a 
+ * quarter full or less for as many consecutive pops as it has slots, so a 
+ * queue that drains between bursts does not shrink and grow again each time.
+ */
+static void pq_ring_shrink(struct ptr_queue *pq)
+{
+	__u32 count;
+
+	if (!(pq->flags & PQ_ATTR_SHRINK) || pq->user_capacity <= pq->min_capacity)
+		return;
+
+	if (pq_ring_count(pq, pq->head, pq->tail) > pq->user_capacity / 4)
+	{
+		pq->low_pops = 0;
+		return;
+	}
+
+	if (++pq->low_pops < pq->user_capacity)
+		return;
+
+	pq->low_pops = 0;
+	count = pq->user_capacity / 2;
+	if (count < pq->min_capacity)
+		count = pq->min_capacity;
+
+	// A failed allocation leaves the queue at its current size
+	pq_ring_resize(pq, count);
+}
+
+/*
+ * Return the slot of the data array that index pos refers to
+ */
+static __u32 pq_ring_slot(struct ptr_queue *pq, __u32 pos)
+{
+	if (pq->flags & PQ_ATTR_POW2)
+		return pos & pq->mask;
+
+	return pos;
+}
+
+/*
+ * Copy n entries into the ring starting at index pos with at most two memcpy's
+ */
+static void pq_ring_write(struct ptr_queue *pq, __u32 pos, void **ptrs, __u32 n)
+{
+	__u32 first;
+
+	pos = pq_ring_slot(pq, pos);
+	first = pq->array_capacity - pos;
+	if (first > n)
+		first = n;
+
+	memcpy(&pq->data[pos], ptrs, first * sizeof(void *));
+	memcpy(pq->data, &ptrs[first], (n - first) * sizeof(void *));
+	pq_latency_stamp(pq, pos, n);
+}
+
+/*
+ * Change what a push does when the queue is full and the caller does not wait
+ *
+ * Param:
+ *	policy : enum pq_overflow. PQ_OVERFLOW_OVERWRITE needs PQ_ENGINE_MUTEX, 
+ *	         the lock-free engines cannot take the oldest entry back from 
+ *	         under a consumer
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+int pq_set_overflow(struct ptr_queue *pq, int policy)
+{
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL || policy < 0 || policy >= PQ_OVERFLOW_MAX || 
+		(policy == PQ_OVERFLOW_OVERWRITE && pq->engine != PQ_ENGINE_MUTEX))
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Store the policy
+	__atomic_store_n(&pq->overflow, policy, __ATOMIC_RELAXED);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Change the wait strategy of a queue
+ *
+ * Param:
+ *	strategy : enum pq_wait_strategy
+ *	spin     : Spin budget in iterations, 0 selects PQ_SPIN_DEFAULT. With 
+ *	           PQ_ATTR_SPIN_ADAPTIVE this is the upper bound of the budget
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+int pq_set_wait_strategy(struct ptr_queue *pq, int strategy, __u32 spin)
+{
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Validate inputs
+	if (pq == NULL || strategy < 0 || strategy >= PQ_WAIT_MAX)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	if (spin == 0)
+		spin = PQ_SPIN_DEFAULT;
+
+	// STEP 2: Store the strategy and reset the adaptive budgets
+	__atomic_store_n(&pq->spin_max, spin, __ATOMIC_RELAXED);
+	__atomic_store_n(&pq->spin_budget, spin, __ATOMIC_RELAXED);
+	__atomic_store_n(&pq->spin_budget_full, spin, __ATOMIC_RELAXED);
+	__atomic_store_n(&pq->wait_strategy, strategy, __ATOMIC_RELAXED);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Map a shared queue region and check its header
+ *
+ * Return pointer upon success, NULL otherwise and set errno. errno is 
+ * EAGAIN if the creator has not finished initializing the region
+ *
+ * STEPS
+ * 1: Map the region 
+ * 2: Check the header
+ * 3: Resolve the offsets in this process
+ */
+static struct pq_shm *pq_shm_attach(int fd)
+{
+	struct pq_shm *sq;
+	struct pq_shm_hdr *hdr;
+	struct stat st;
+	void *base;
+
+	// Initialize variables
+	sq = NULL;
+
+	// STEP 1: Map the region 
+	if (fstat(fd, &st) != 0)
+		goto end;
+	if ((size_t) st.st_size < sizeof(struct pq_shm_hdr))
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		goto end;
+	hdr = (struct pq_shm_hdr *) base;
+
+	// STEP 2: Check the header
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != PQ_SHM_MAGIC)
+	{
+		munmap(base, st.st_size);
+		errno = EAGAIN;
+		goto end;
+	}
+	if (hdr->version != PQ_SHM_VERSION || hdr->size != (__u64) st.st_size)
+	{
+		munmap(base, st.st_size);
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 3: Resolve the offsets in this process
+	sq = (struct pq_shm *) calloc(1, sizeof(*sq));
+	if (sq == NULL)
+	{
+		munmap(base, st.st_size);
+		errno = ENOMEM;
+		goto end;
+	}
+
+	sq->base = (__u8 *) base;
+	sq->size = st.st_size;
+	sq->fd = fd;
+	sq->hdr = hdr;
+	for ( int i = 0 ; i < PQ_SHM_RINGS ; i++ )
+	{
+		sq->slots[i] = (__u64 *) (sq->base + hdr->slots_off[i]);
+		sq->seq[i] = (__u32 *) (sq->base + hdr->seq_off[i]);
+	}
+	sq->buf = sq->base + hdr->buf_off;
+
+end:
+
+	return sq;
+}
+
+/*
+ * Unmap a shared queue and close its descriptor
+ *
+ * The region itself lives on until the last process closes it and, for a 
+ * named queue, pq_shm_unlink() is called
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+int pq_shm_close(struct pq_shm *sq)
+{
+	int rv;
+
+	// Initialize variables
+	rv = 1;
+
+	if (sq == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	munmap(sq->base, sq->size);
+	close(sq->fd);
+	free(sq);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Create a queue and an object pool in one shared memory region
+ *
+ * The region holds a header, a free ring holding the count objects and an
+ * empty work ring. Rings store object offsets from the start of the region,
+ * so every process that maps it exchanges objects without copying.
+ *
+ * Param:
+ *	name     : shm_open() name such as "/capture". NULL creates an anonymous 
+ *	           memfd shared through pq_shm_fd() with fork() or SCM_RIGHTS. 
+ *	           Like shm_open() it is close-on-exec
+ *	count    : Number of objects
+ *	obj_size : Size of each object, rounded up to whole cache lines
+ *
+ * Returns a pointer to a struct pq_shm upon success. Upon error, returns NULL and sets errno 
+ *
+ * STEPS
+ * 1: Validate inputs
+ * 2: Lay out the region
+ * 3: Create and size the shared memory object
+ * 4: Initialize the header and the rings
+ * 5: Publish the header and map the region
+ */
+struct pq_shm *pq_shm_create(const char *name, size_t count, size_t obj_size)
+{
+	struct pq_shm *sq;
+	struct pq_shm_hdr *hdr;
+	__u64 slots_off[PQ_SHM_RINGS], seq_off[PQ_SHM_RINGS];
+	__u64 buf_off, size, stride;
+	__u8 *base;
+	__u32 cap;
+	int fd, err;
+
+	// Initialize variables
+	sq = NULL;
+
+	// STEP 1: Validate inputs
+	if (count == 0 || count > (1U << 31) || obj_size == 0 || 
+		obj_size > (1UL << 32))
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	// STEP 2: Lay out the region
+	cap = 1;
+	while (cap < count)
+		cap <<= 1;
+	stride = (obj_size + PQ_CACHELINE - 1) & ~((__u64) PQ_CACHELINE - 1);
+
+	buf_off = sizeof(struct pq_shm_hdr);
+	for ( int i = 0 ; i < PQ_SHM_RINGS ; i++ )
+	{
+		slots_off[i] = buf_off;
+		seq_off[i] = slots_off[i] + (__u64) cap * sizeof(__u64);
+		buf_off = seq_off[i] + (__u64) cap * sizeof(__u32);
+		buf_off = (buf_off + PQ_CACHELINE - 1) & ~((__u64) PQ_CACHELINE - 1);
+	}
+	size = buf_off + count * stride;
+
+	// STEP 3: Create and size the shared memory object
+	if (name != NULL)
+		fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	else
+		fd = memfd_create("ptrqueue", MFD_CLOEXEC);
+	if (fd < 0)
+		goto end;
+
+	if (ftruncate(fd, size) != 0)
+		goto fail;
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		goto fail;
+
+	// STEP 4: Initialize the header and the rings
+	hdr = (struct pq_shm_hdr *) base;
+	hdr->version = PQ_SHM_VERSION;
+	hdr->capacity = cap;
+	hdr->count = count;
+	hdr->size = size;
+	hdr->obj_size = obj_size;
+	hdr->obj_stride = stride;
+	hdr->buf_off = buf_off;
+	for ( int i = 0 ; i < PQ_SHM_RINGS ; i++ )
+	{
+		hdr->slots_off[i] = slots_off[i];
+		hdr->seq_off[i] = seq_off[i];
+		for ( __u32 j = 0 ; j < cap ; j++ )
+			((__u32 *) (base + seq_off[i]))[j] = j;
+	}
+
+	// The free ring starts out holding every object 
+	for ( __u32 j = 0 ; j < count ; j++ )
+	{
+		((__u64 *) (base + slots_off[PQ_SHM_FREE]))[j] = buf_off + j * stride;
+		((__u32 *) (base + seq_off[PQ_SHM_FREE]))[j] = j + 1;
+	}
+	hdr->ring[PQ_SHM_FREE].tail = count;
+
+	// STEP 5: Publish the header and map the region
+	__atomic_store_n(&hdr->magic, PQ_SHM_MAGIC, __ATOMIC_RELEASE);
+	munmap(base, size);
+
+	sq = pq_shm_attach(fd);
+	if (sq == NULL)
+		goto fail;
+
+	goto end;
+
+fail:
+
+	err = errno;
+	close(fd);
+	if (name != NULL)
+		shm_unlink(name);
+	errno = err;
+
+end:
+
+	return sq;
+}
+
+/*
+ * Return the file descriptor of the shared region 
+ *
+ * Hand it to another process over fork() or SCM_RIGHTS and attach there
+ * with pq_shm_open_fd()
+ */
+int pq_shm_fd(struct pq_shm *sq)
+{
+	if (sq == NULL)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	return sq->fd;
+}
+
+/*
+ * Take a free object from the shared pool
+ *
+ * Param:
+ *	wait : If non zero, block until a process returns an object
+ *
+ * Return pointer upon success, 0 otherwise and set errno. errno is EAGAIN
+ * if the pool is exhausted and wait == 0
+ */
+void *pq_shm_get(struct pq_shm *sq, int wait)
+{
+	if (sq == NULL)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return pq_shm_ring_pop(sq, PQ_SHM_FREE, wait);
+}
+
+/*
+ * Return the number of objects waiting in the work ring
+ *
+ * Returns length upon success, -EINVAL if sq is NULL
+ */
+__s32 pq_shm_len(struct pq_shm *sq)
+{
+	struct pq_shm_ring *ring;
+
+	if (sq == NULL)
+		return -EINVAL;
+
+	ring = &sq->hdr->ring[PQ_SHM_WORK];
+
+	return (__s32) (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - 
+		__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Convert an object pointer of this process to its offset in the region
+ *
+ * Return offset upon success, 0 if obj is not an object of the region
+ */
+static __u64 pq_shm_obj(struct pq_shm *sq, void *obj)
+{
+	__u64 off;
+
+	off = (uintptr_t) obj - (uintptr_t) sq->buf;
+	if (obj == NULL || off >= (__u64) sq->hdr->count * sq->hdr->obj_stride || 
+		off % sq->hdr->obj_stride != 0)
+		return 0;
+
+	return sq->hdr->buf_off + off;
+}
+
+/*
+ * Attach to a named shared queue created by pq_shm_create()
+ *
+ * Returns a pointer to a struct pq_shm upon success. Upon error, returns NULL and sets errno 
+ */
+struct pq_shm *pq_shm_open(const char *name)
+{
+	struct pq_shm *sq;
+	int fd, err;
+
+	// Initialize variables
+	sq = NULL;
+
+	if (name == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		goto end;
+
+	sq = pq_shm_attach(fd);
+	if (sq == NULL)
+	{
+		err = errno;
+		close(fd);
+		errno = err;
+	}
+
+end:
+
+	return sq;
+}
+
+/*
+ * Attach to a shared queue through a descriptor from pq_shm_fd()
+ *
+ * The descriptor is duplicated, the caller keeps ownership of fd
+ *
+ * Returns a pointer to a struct pq_shm upon success. Upon error, returns NULL and sets errno 
+ */
+struct pq_shm *pq_shm_open_fd(int fd)
+{
+	struct pq_shm *sq;
+	int dup_fd, err;
+
+	// Initialize variables
+	sq = NULL;
+
+	dup_fd = dup(fd);
+	if (dup_fd < 0)
+		goto end;
+
+	sq = pq_shm_attach(dup_fd);
+	if (sq == NULL)
+	{
+		err = errno;
+		close(dup_fd);
+		errno = err;
+	}
+
+end:
+
+	return sq;
+}
+
+/*
+ * Receive an object from the work ring
+ *
+ * Param:
+ *	wait : If non zero, block until a process pushes an object
+ *
+ * Return pointer upon success, 0 otherwise and set errno. errno is EAGAIN
+ * if the work ring is empty and wait == 0
+ */
+void *pq_shm_pop(struct pq_shm *sq, int wait)
+{
+	if (sq == NULL)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return pq_shm_ring_pop(sq, PQ_SHM_WORK, wait);
+}
+
+/*
+ * Send an object of the region to the work ring
+ *
+ * Return 0 upon success, 1 otherwise and set errno. errno is EINVAL if obj
+ * is not an object of the region
+ */
+int pq_shm_push(struct pq_shm *sq, void *obj)
+{
+	__u64 off;
+
+	off = sq ? pq_shm_obj(sq, obj) : 0;
+	if (off == 0)
+	{
+		errno = EINVAL;
+		return 1;
+	}
+
+	return pq_shm_ring_push(sq, PQ_SHM_WORK, off);
+}
+
+/*
+ * Return an object to the shared pool
+ *
+ * Return 0 upon success, 1 otherwise and set errno. errno is EINVAL if obj
+ * is not an object of the region
+ */
+int pq_shm_put(struct pq_shm *sq, void *obj)
+{
+	__u64 off;
+
+	off = sq ? pq_shm_obj(sq, obj) : 0;
+	if (off == 0)
+	{
+		errno = EINVAL;
+		return 1;
+	}
+
+	return pq_shm_ring_push(sq, PQ_SHM_FREE, off);
+}
+
+/*
+ * Remove the entry at the head of a shared ring
+ *
+ * The ring follows the MPMC engine: a slot at position pos holds an entry
+ * once its sequence number is pos + 1. Sleeping consumers park on the ring
+ * eventcount with a process shared futex, see pq_ec_wait().
+ *
+ * Return pointer upon success, NULL if empty and wait == 0
+ *
+ * STEPS
+ * 1: Find a ready slot and claim it with a CAS of head
+ * 2: If empty, return or sleep until a producer publishes an entry
+ * 3: Get the offset out of the ring and release the slot
+ */
+static void *pq_shm_ring_pop(struct pq_shm *sq, int r, int wait)
+{
+	struct pq_shm_ring *ring;
+	__u32 *seq;
+	__u32 mask, pos, s, key, head;
+	__u64 off;
+
+	ring = &sq->hdr->ring[r];
+	seq = sq->seq[r];
+	mask = sq->hdr->capacity - 1;
+
+	for (;;)
+	{
+		// STEP 1: Find a ready slot and claim it with a CAS of head
+		pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		for (;;)
+		{
+			s = __atomic_load_n(&seq[pos & mask], __ATOMIC_ACQUIRE);
+			if (s == pos + 1)
+			{
+				if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1, 
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					goto found;
+			}
+			else if ((__s32) (s - (pos + 1)) < 0)
+				break;
+			else
+				pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		}
+
+		// STEP 2: If empty, return or sleep until a producer publishes an entry
+		if (!wait)
+		{
+			errno = EAGAIN;
+			return NULL;
+		}
+
+		__atomic_add_fetch(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+		key = __atomic_load_n(&ring->ec, __ATOMIC_ACQUIRE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&seq[head & mask], __ATOMIC_ACQUIRE) != head + 1)
+			pq_futex_wait(&ring->ec, key, 1, NULL);
+
+		__atomic_sub_fetch(&ring->waiting, 1, __ATOMIC_RELAXED);
+	}
+
+found:
+
+	// STEP 3: Get the offset out of the ring and release the slot
+	off = sq->slots[r][pos & mask];
+	__atomic_store_n(&seq[pos & mask], pos + sq->hdr->capacity, __ATOMIC_RELEASE);
+
+	return sq->base + off;
+}
+
+/*
+ * Add an object offset at the tail of a shared ring
+ *
+ * Return 0 upon success, 1 otherwise and set errno. errno is ENOMEM if the
+ * ring is full, which only happens if an object was pushed twice
+ *
+ * STEPS
+ * 1: Find a free slot and claim it with a CAS of tail
+ * 2: Publish the offset
+ * 3: Wake a consumer of any process if one is sleeping
+ */
+static int pq_shm_ring_push(struct pq_shm *sq, int r, __u64 off)
+{
+	struct pq_shm_ring *ring;
+	__u32 *seq;
+	__u32 mask, pos, s;
+
+	ring = &sq->hdr->ring[r];
+	seq = sq->seq[r];
+	mask = sq->hdr->capacity - 1;
+
+	// STEP 1: Find a free slot and claim it with a CAS of tail
+	pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		s = __atomic_load_n(&seq[pos & mask], __ATOMIC_ACQUIRE);
+		if (s == pos)
+		{
+			if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, 
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if ((__s32) (s - pos) < 0)
+		{
+			errno = ENOMEM;
+			return 1;
+		}
+		else
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	}
+
+	// STEP 2: Publish the offset
+	sq->slots[r][pos & mask] = off;
+	__atomic_store_n(&seq[pos & mask], pos + 1, __ATOMIC_RELEASE);
+
+	// STEP 3: Wake a consumer of any process if one is sleeping
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED) > 0)
+	{
+		__atomic_add_fetch(&ring->ec, 1, __ATOMIC_RELEASE);
+		pq_futex_wake(&ring->ec, 1, 1);
+	}
+
+	return 0;
+}
+
+/*
+ * Remove the name of a shared queue
+ *
+ * Processes attached to it keep working, the region goes away with the 
+ * last of them
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+int pq_shm_unlink(const char *name)
+{
+	if (name == NULL)
+	{
+		errno = EINVAL;
+		return 1;
+	}
+
+	return shm_unlink(name) != 0;
+}
+
+/*
+ * Take the entry out of a slot
+ *
+ * In message mode the message is copied to out and out is returned. 
+ * Otherwise the slot pointer is returned and cleared.
+ */
+static void *pq_slot_load(struct ptr_queue *pq, __u32 slot, void *out)
+{
+	void *rv;
+
+	pq_latency_record(pq, slot, 1);
+
+	if (pq->msgs != NULL)
+	{
+		memcpy(out, pq_msg_slot(pq, slot), pq->msg_size);
+		return out;
+	}
+
+	rv = pq->data[slot];
+	pq->data[slot] = NULL;
+
+	return rv;
+}
+
+/*
+ * Store an entry in a slot
+ *
+ * In message mode ptr points to the message that is copied in
+ */
+static void pq_slot_store(struct ptr_queue *pq, __u32 slot, void *ptr)
+{
+	pq_latency_stamp(pq, slot, 1);
+
+	if (pq->msgs != NULL)
+		memcpy(pq_msg_slot(pq, slot), ptr, pq->msg_size);
+	else
+		pq->data[slot] = ptr;
+}
+
+/*
+ * Spin until the queue goes non empty (full == 0) or not full (full == 1)
+ *
+ * PQ_WAIT_SPIN spins until the condition holds, PQ_WAIT_SPIN_YIELD yields 
+ * the CPU between checks once the spin budget is used up, and 
+ * PQ_WAIT_SPIN_PARK gives up after the budget so the caller can park. 
+ *
+ * With PQ_ATTR_SPIN_ADAPTIVE the budget tracks twice the recent successful 
+ * spin lengths and is halved every time spinning failed, so busy queues keep 
+ * spinning and idle queues quickly fall back to sleeping.
+ *
+ * Returns 0 once the condition holds, EAGAIN if the caller should park, 
+ * ETIMEDOUT if the deadline passed
+ */
+static int pq_spin(struct ptr_queue *pq, int full, const struct timespec *deadline)
+{
+	struct timespec now;
+	__u32 *budget_ptr;
+	__u32 budget, target;
+	int strategy;
+	__u32 i;
+
+	strategy = __atomic_load_n(&pq->wait_strategy, __ATOMIC_RELAXED);
+	if (strategy == PQ_WAIT_PARK)
+		return EAGAIN;
 
-		// Set bit to indicate the consumer is waiting
-		pq->waiting = 1;
+	budget_ptr = full ? &pq->spin_budget_full : &pq->spin_budget;
+	budget = __atomic_load_n(budget_ptr, __ATOMIC_RELAXED);
+
+	for ( i = 0 ; ; i++ )
+	{
+		if (!(full ? pq_lf_full(pq) : pq_lf_empty(pq)))
+			break;
 
-		// Check again if queue is still empty 
-		if (pq->head == pq->tail) 
+		if (i >= budget)
 		{
-			// Set call back condition when queue goes non empty
-			pthread_cond_wait(&pq->cond, &pq->mtx);
-		} 
+			if (strategy == PQ_WAIT_SPIN_PARK)
+			{
+				if ((pq->flags & PQ_ATTR_SPIN_ADAPTIVE) && budget > PQ_SPIN_MIN)
+					__atomic_store_n(budget_ptr, budget / 2, __ATOMIC_RELAXED);
+				return EAGAIN;
+			}
 
-		// Reset waiting bit to 0
-		pq->waiting = 0;
+			if (strategy == PQ_WAIT_SPIN_YIELD)
+				sched_yield();
+		}
+
+		// Check the deadline every so often, clock_gettime() is not free
+		if (deadline != NULL && (i & 0x3FF) == 0x3FF)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec > deadline->tv_sec || 
+				(now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec))
+				return ETIMEDOUT;
+		}
 
-		// At this point the queue is no longer empty, get the value and return normally
+		pq_cpu_relax();
 	}
 
-	// STEP 4: Get the value out of the array
-	rv = pq->data[pq->head];
-	pq->data[pq->head] = NULL;
+	// Move the budget towards twice the spin length that just succeeded
+	if (pq->flags & PQ_ATTR_SPIN_ADAPTIVE)
+	{
+		target = 2 * i;
+		if (target < PQ_SPIN_MIN)
+			target = PQ_SPIN_MIN;
+		if (target > pq->spin_max)
+			target = pq->spin_max;
+		if (target != budget)
+			__atomic_store_n(budget_ptr, budget - budget / 8 + target / 8, __ATOMIC_RELAXED);
+	}
 
-	// STEP 5: Compute new head
-	pq->head = pq->head + 1;
-	if (pq->head >= pq->array_capacity)
-		pq->head -= pq->array_capacity;
+	return 0;
+}
 
-unlock:
+/*
+ * Remove the entry at the head of a lock-free SPSC queue
+ *
+ * Only the consumer thread writes head, so it is loaded relaxed. The acquire
+ * load of tail pairs with the release store in pq_spsc_push() so that the
+ * slot contents are visible before they are read. The consumer works from its
+ * cached copy of tail and only reads the producer's line when the cached copy
+ * says the queue is empty.
+ *
+ * Returns 1 and stores the entry (out in message mode) in *ptr upon success,
+ * 0 otherwise and sets errno. A NULL entry is popped like any other
+ *
+ * STEPS
+ * 1: Load indices
+ * 2: If empty, return or sleep until the producer publishes an entry
+ * 3: Get the value out of the array
+ * 4: Publish the new head
+ */
+static __s32 pq_spsc_pop(
+	struct ptr_queue *pq, 
+	void **ptr,
+	int wait, 
+	const struct timespec *deadline,
+	void *out)
+{
+	__s32 rv;
+	__u32 head;
 
-	// STEP 6: Unlock mutex and return 
-	pthread_mutex_unlock(&pq->mtx); 
+	// Initialize variables
+	rv = 0;
+
+	// STEP 1: Load indices
+	head = __atomic_load_n(&pq->head, __ATOMIC_RELAXED);
+	if (head == pq->tail_cache)
+		pq->tail_cache = __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE);
+
+	// STEP 2: If empty, return or sleep until the producer publishes an entry
+	if (head == pq->tail_cache)
+	{
+		if (!wait)
+		{
+			errno = EAGAIN;
+			goto end;
+		}
+
+		if (pq_lf_wait(pq, 0, deadline) != 0)
+		{
+			errno = ETIMEDOUT;
+			goto end;
+		}
+		pq->tail_cache = __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE);
+	}
+
+	// STEP 3: Get the value out of the array
+	*ptr = pq_slot_load(pq, pq_ring_slot(pq, head), out);
+	rv = 1;
+
+	// STEP 4: Publish the new head
+	__atomic_store_n(&pq->head, pq_ring_advance(pq, head, 1), __ATOMIC_RELEASE);
+	pq_lf_wake_full(pq, 1);
 
 end:
 
 	return rv;
 }
 
-void pq_print(struct ptr_queue *pq)
+/*
+ * Remove up to max entries from the head of a lock-free SPSC queue
+ *
+ * Returns the number of entries popped
+ *
+ * STEPS
+ * 1: Load indices
+ * 2: If empty, return or sleep until the producer publishes an entry
+ * 3: Copy the entries out of the array
+ * 4: Publish the new head
+ */
+static __s32 pq_spsc_pop_n(struct ptr_queue *pq, void **out, __u32 max, int wait)
 {
-	if (pq == NULL) {
-		return;
+	__u32 head, len;
+
+	// STEP 1: Load indices
+	head = __atomic_load_n(&pq->head, __ATOMIC_RELAXED);
+	len = pq_ring_count(pq, head, pq->tail_cache);
+	if (len < max)
+	{
+		pq->tail_cache = __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE);
+		len = pq_ring_count(pq, head, pq->tail_cache);
 	}
 
-	printf("Printing ptr_queue ------------------------------\n");
-	printf("pq address:            %p\n", pq);
-	printf("pq->data:              %p\n", pq->data);
-	printf("pq->array_capacity:    %u\n", pq->array_capacity);
-	printf("pq->user_capacity:     %u\n", pq->user_capacity);
-	printf("pq->len:               %u\n", pq_len(pq));
-	printf("pq->head:              %u\n", pq->head);
-	printf("pq->tail:              %u\n", pq->tail);
-	printf("pq->waiting:           %d\n", pq->waiting);
+	// STEP 2: If empty, return or sleep until the producer publishes an entry
+	if (len == 0)
+	{
+		if (!wait)
+		{
+			errno = EAGAIN;
+			return 0;
+		}
+
+		pq_lf_wait(pq, 0, NULL);
+		pq->tail_cache = __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE);
+		len = pq_ring_count(pq, head, pq->tail_cache);
+	}
+
+	if (max > len)
+		max = len;
+
+	// STEP 3: Copy the entries out of the array
+	pq_ring_read(pq, head, out, max);
+
+	// STEP 4: Publish the new head
+	__atomic_store_n(&pq->head, pq_ring_advance(pq, head, max), __ATOMIC_RELEASE);
+	pq_lf_wake_full(pq, max);
+
+	return max;
+}
+
+/*
+ * Insert a new entry at the tail of a lock-free SPSC queue
+ *
+ * Only the producer thread writes tail, so it is loaded relaxed. The acquire
+ * load of head pairs with the release store in pq_spsc_pop() so that a slot
+ * is not overwritten before the consumer has read it. The producer works from
+ * its cached copy of head and only reads the consumer's line when the cached
+ * copy says the queue is full.
+ *
+ * Return 0 upon success, 1 if full and set errno
+ *
+ * STEPS
+ * 1: Compute new tail
+ * 2: Check if we are full
+ * 3: Store the new ptr and publish the new tail
+ * 4: If the consumer is sleeping, signal it
+ */
+static int pq_spsc_push(struct ptr_queue *pq, void *ptr)
+{
+	int rv;
+	__u32 tail, new_tail;
+
+	// Initialize variables
+	rv = 1;
+
+	// STEP 1: Compute new tail
+	tail = __atomic_load_n(&pq->tail, __ATOMIC_RELAXED);
+	new_tail = pq_ring_advance(pq, tail, 1);
 
-	for ( __u32 i = 0 ; i < pq->array_capacity ; i++ ) 
+	// STEP 2: Check if we are full
+	if (pq_ring_count(pq, pq->head_cache, tail) == pq->user_capacity)
 	{
-		printf("data[%02d]:       %p\n", i, pq->data[i]);
+		pq->head_cache = __atomic_load_n(&pq->head, __ATOMIC_ACQUIRE);
+		if (pq_ring_count(pq, pq->head_cache, tail) == pq->user_capacity)
+		{
+			errno = ENOMEM;
+			goto end;
+		}
 	}
+
+	// STEP 3: Store the new ptr and publish the new tail
+	pq_slot_store(pq, pq_ring_slot(pq, tail), ptr);
+	__atomic_store_n(&pq->tail, new_tail, __ATOMIC_RELEASE);
+
+	// STEP 4: If the consumer is sleeping, signal it
+	pq_lf_wake(pq, 1);
+
+	rv = 0;
+
+end:
+
+	return rv;
 }
 
 /*
- * Insert a new entry at the current tail location
+ * Insert up to n entries at the tail of a lock-free SPSC queue
  *
- * Return 0 upon success, 1 if error and set errno
+ * Returns the number of entries pushed
+ *
+ * STEPS
+ * 1: Compute free space
+ * 2: Store the new ptrs and publish the new tail
+ * 3: If the consumer is sleeping, signal it
+ */
+static __s32 pq_spsc_push_n(struct ptr_queue *pq, void **ptrs, __u32 n)
+{
+	__u32 tail, space;
+
+	// STEP 1: Compute free space
+	tail = __atomic_load_n(&pq->tail, __ATOMIC_RELAXED);
+	space = pq->user_capacity - pq_ring_count(pq, pq->head_cache, tail);
+	if (space < n)
+	{
+		pq->head_cache = __atomic_load_n(&pq->head, __ATOMIC_ACQUIRE);
+		space = pq->user_capacity - pq_ring_count(pq, pq->head_cache, tail);
+	}
+
+	if (n > space)
+		n = space;
+	if (n == 0)
+		return 0;
+
+	// STEP 2: Store the new ptrs and publish the new tail
+	pq_ring_write(pq, tail, ptrs, n);
+	__atomic_store_n(&pq->tail, pq_ring_advance(pq, tail, n), __ATOMIC_RELEASE);
+
+	// STEP 3: If the consumer is sleeping, signal it
+	pq_lf_wake(pq, n);
+
+	return n;
+}
+
+/*
+ * Take a snapshot of the counters of a queue created with PQ_ATTR_STATS
+ *
+ * The shards are summed without stopping the queue, so counters updated 
+ * meanwhile may or may not be included. Each counter on its own is exact.
+ *
+ * Return 0 upon success, 1 otherwise and set errno (ENOTSUP if the queue 
+ * keeps no counters)
  *
  * STEPS
  * 1: Validate inputs
- * 2: Obtain lock 
- * 3: Compute new tail
- * 4: Check if we are full
- * 5: Store the new ptr at the current tail 
- * 6: Store the new tail index
- * 7: If consumer thread is waiting for queue to go nonempty, signal it
- * 8: Unlock and exit 
+ * 2: Sum the shards
+ * 3: Copy the high-water mark
  */
-int pq_push(struct ptr_queue *pq, void *ptr)
+int pq_stats(struct ptr_queue *pq, struct pq_stats *out)
 {
-	int rv; 
-	__u32 new_tail; 
+	__u64 sum[PQ_STAT_MAX];
+	int rv;
 
-	// Initialize variables 
+	// Initialize variables
 	rv = 1;
 
 	// STEP 1: Validate inputs
-	if (pq == NULL) 
+	if (pq == NULL || out == NULL)
 	{
 		errno = EINVAL;
 		goto end;
 	}
+	if (pq->stats == NULL)
+	{
+		errno = ENOTSUP;
+		goto end;
+	}
 
-	// STEP 2: Obtain lock 
-	pthread_mutex_lock(&pq->mtx); 
+	// STEP 2: Sum the shards
+	memset(sum, 0, sizeof(sum));
+	for ( int i = 0 ; i < PQ_STATS_SHARDS ; i++ )
+		for ( int j = 0 ; j < PQ_STAT_MAX ; j++ )
+			sum[j] += __atomic_load_n(&pq->stats[i].count[j], __ATOMIC_RELAXED);
+
+	out->pushes = sum[PQ_STAT_PUSHES];
+	out->pops = sum[PQ_STAT_POPS];
+	out->full = sum[PQ_STAT_FULL];
+	out->empty = sum[PQ_STAT_EMPTY];
+	out->trylock_fails = sum[PQ_STAT_TRYLOCK_FAILS];
+	out->waits = sum[PQ_STAT_WAITS];
+	out->signals = sum[PQ_STAT_SIGNALS];
+	out->lock_wait_ns = sum[PQ_STAT_LOCK_WAIT_NS];
+	out->wait_ns = sum[PQ_STAT_WAIT_NS];
+
+	// STEP 3: Copy the high-water mark
+	out->high_water = __atomic_load_n(&pq->high_water, __ATOMIC_RELAXED);
+
+	rv = 0;
+
+end:
+
+	return rv;
+}
+
+/*
+ * Add n to a counter in the shard of the calling thread
+ *
+ * Does nothing unless the queue was created with PQ_ATTR_STATS. Shards may 
+ * be shared by threads, so the add is atomic, but a shard line is normally 
+ * only written by one thread and stays in its cache.
+ */
+static void pq_stats_add(struct ptr_queue *pq, int stat, __u64 n)
+{
+	if (pq->stats == NULL)
+		return;
+
+	if (pq_stats_slot == 0)
+		pq_stats_slot = __atomic_add_fetch(&pq_stats_threads, 1, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&pq->stats[pq_stats_slot & (PQ_STATS_SHARDS - 1)].count[stat], 
+		n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Raise the high-water mark of a PQ_ATTR_STATS queue to len
+ *
+ * The mark is shared, but only written when a new maximum is seen
+ */
+static void pq_stats_level(struct ptr_queue *pq, __u32 len)
+{
+	__u32 mark;
+
+	if (pq->stats == NULL)
+		return;
+
+	mark = __atomic_load_n(&pq->high_water, __ATOMIC_RELAXED);
+	while (len > mark && 
+		!__atomic_compare_exchange_n(&pq->high_water, &mark, len, 1, 
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Return CLOCK_MONOTONIC in nanoseconds
+ */
+static __u64 pq_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	// STEP 3: Compute new tail
-	new_tail = pq->tail + 1;
-	if (new_tail >= pq->array_capacity)
-		new_tail -= pq->array_capacity; 
+	return (__u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Count the outcome of a pop that returned n entries
+ *
+ * A pop that returned nothing is counted as empty when errno says so
+ */
+static void pq_stats_pop(struct ptr_queue *pq, __u32 n)
+{
+	if (pq->stats == NULL)
+		return;
+
+	if (n > 0)
+		pq_stats_add(pq, PQ_STAT_POPS, n);
+	else if (errno == EAGAIN || errno == ETIMEDOUT)
+		pq_stats_add(pq, PQ_STAT_EMPTY, 1);
+}
+
+/*
+ * Count the outcome of a push that stored n entries
+ *
+ * A push that stored nothing is counted as full when errno says so. The 
+ * mutex engine samples the high-water mark under its lock, the other 
+ * engines sample a snapshot of the length here.
+ */
+static void pq_stats_push(struct ptr_queue *pq, __u32 n)
+{
+	if (pq->stats == NULL)
+		return;
 
-	// STEP 4: Check if we are full
-	if (new_tail == pq->head) 
+	if (n > 0)
 	{
-		errno = ENOMEM;;
-		goto unlock;
+		pq_stats_add(pq, PQ_STAT_PUSHES, n);
+		if (pq->engine != PQ_ENGINE_MUTEX)
+			pq_stats_level(pq, pq_lf_len(pq));
 	}
+	else if (errno == ENOMEM || errno == ETIMEDOUT)
+		pq_stats_add(pq, PQ_STAT_FULL, 1);
+}
 
-	// STEP 5: Store the new ptr at the current tail 
-	pq->data[pq->tail] = ptr;
+/*
+ * Zero the counters and the high-water mark of a PQ_ATTR_STATS queue
+ *
+ * Counts made while resetting may survive it
+ *
+ * Return 0 upon success, 1 otherwise and set errno
+ */
+int pq_stats_reset(struct ptr_queue *pq)
+{
+	int rv;
 
-	// STEP 6: Store the new tail index
-	pq->tail = new_tail;
+	// Initialize variables
+	rv = 1;
 
-	// STEP 7: If consumer thread is waiting for queue to go nonempty, signal it
-	if (pq->waiting == 1) 
-		pthread_cond_signal(&pq->cond);
+	// STEP 1: Validate inputs
+	if (pq == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (pq->stats == NULL)
+	{
+		errno = ENOTSUP;
+		goto end;
+	}
 
-	rv = 0;
+	// STEP 2: Zero every shard
+	for ( int i = 0 ; i < PQ_STATS_SHARDS ; i++ )
+		for ( int j = 0 ; j < PQ_STAT_MAX ; j++ )
+			__atomic_store_n(&pq->stats[i].count[j], 0, __ATOMIC_RELAXED);
 
-unlock:
+	__atomic_store_n(&pq->high_water, 0, __ATOMIC_RELAXED);
 
-	// STEP 8: Unlock and exit 
-	pthread_mutex_unlock(&pq->mtx); 
+	rv = 0;
 
 end:
 
 	return rv;
 }
 
+/*
+ * Wake threads sleeping on a lock-free queue and call its async waiters
+ *
+ * For the main_inline.h fast path, which publishes entries or slots itself
+ * and only calls into the library when someone may be waiting
+ *
+ * Param:
+ *	n    : Entries (full == 0) or slots (full == 1) made available
+ *	full : Zero to wake consumers and notify the poll set and eventfd, non 
+ *	       zero to wake producers
+ */
+void pq_wake(struct ptr_queue *pq, __u32 n, int full)
+{
+	if (pq == NULL || pq->engine == PQ_ENGINE_MUTEX)
+		return;
+
+	if (full)
+		pq_lf_wake_full(pq, n);
+	else
+		pq_lf_wake(pq, n);
+
+	pq_async_wake(pq, n, full);
+}
+
+/*
+ * Call the watermark callback if the length crossed a watermark
+ *
+ * wm_above is switched with a CAS, so each crossing is reported once even 
+ * with many threads pushing and popping, and the reports alternate between 
+ * high and low. Callbacks made by different threads may still overlap. 
+ * Without a callback this is one test of a NULL pointer.
+ */
+static void pq_watermark(struct ptr_queue *pq)
+{
+	__u32 len;
+	int above;
+
+	if (pq->wm_fn == NULL)
+		return;
+
+	len = pq_lf_len(pq);
+	above = __atomic_load_n(&pq->wm_above, __ATOMIC_RELAXED);
+
+	if (!above && len >= pq->wm_high)
+	{
+		if (__atomic_compare_exchange_n(&pq->wm_above, &above, 1, 0, 
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			pq->wm_fn(pq, 1, len, pq->wm_arg);
+	}
+	else if (above && len <= pq->wm_low)
+	{
+		if (__atomic_compare_exchange_n(&pq->wm_above, &above, 0, 0, 
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			pq->wm_fn(pq, 0, len, pq->wm_arg);
+	}
+}
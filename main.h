@@ -17,43 +17,544 @@
 /* INCLUDES ==================================================================*/
 
 #include <pthread.h>
+#include <time.h>
 
 #include <linux/types.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* MACROS ====================================================================*/
 
+/**
+ * Size of a cache line. Fields written by different threads are kept on
+ * separate lines of this size to avoid false sharing.
+ */
+#ifndef PQ_CACHELINE
+ #define PQ_CACHELINE 64
+#endif
+
+#define PQ_ALIGNED __attribute__((aligned(PQ_CACHELINE)))
+
+/**
+ * Default spin budget, in iterations, of the spinning wait strategies
+ */
+#define PQ_SPIN_DEFAULT 1000
+
+/**
+ * Size of a huge page. Queues created with PQ_ATTR_HUGEPAGE round their
+ * ring and object buffer up to a multiple of this size.
+ */
+#ifndef PQ_HUGEPAGE_SIZE
+ #define PQ_HUGEPAGE_SIZE (2UL << 20)
+#endif
+
+/**
+ * NUMA nodes for struct pq_attr.numa_node
+ */
+#define PQ_NUMA_ANY		(-1)	//!< Leave placement to the heap
+#define PQ_NUMA_LOCAL	(-2)	//!< Node of the thread creating the queue
+
+/**
+ * Highest number of NUMA nodes memory can be bound to
+ */
+#define PQ_NUMA_NODES	1024
+
+/**
+ * Free chunks a PQ_ENGINE_CHUNKED queue keeps for reuse. Chunks retired 
+ * beyond this are returned to the system.
+ */
+#ifndef PQ_CHUNK_SPARES
+ #define PQ_CHUNK_SPARES 4
+#endif
+
+/**
+ * Most entries an idle worker of a struct pq_group steals at once
+ */
+#ifndef PQ_GROUP_STEAL
+ #define PQ_GROUP_STEAL 32
+#endif
+
+/**
+ * Most levels of a struct pq_prio, one bit each in its occupancy bitmap
+ */
+#define PQ_PRIO_LEVELS	64
+
+/**
+ * Counter shards of a queue created with PQ_ATTR_STATS, a power of two. 
+ * Threads are spread over the shards so counting does not bounce one line.
+ */
+#ifndef PQ_STATS_SHARDS
+ #define PQ_STATS_SHARDS 16
+#endif
+
+/**
+ * Rings of a shared memory queue: the free ring of the pool and the work ring
+ */
+#define PQ_SHM_RINGS	2
+
 /* ENUMERATIONS ==============================================================*/
 
+/**
+ * Queue engines
+ *
+ * The engine selects how pq_push() and pq_pop() synchronize access to the
+ * ring. All engines share the same struct ptr_queue API.
+ */
+enum pq_engine {
+	PQ_ENGINE_MUTEX		= 0,	//!< Global mutex, multi-writer multi-reader
+	PQ_ENGINE_SPSC		= 1,	//!< Lock-free, single-writer single-reader
+	PQ_ENGINE_MPMC		= 2,	//!< Lock-free, multi-writer multi-reader
+	PQ_ENGINE_CHUNKED	= 3,	//!< Two-lock, unbounded list of fixed size chunks
+	PQ_ENGINE_MAX
+};
+
+/**
+ * Pointer Queue creation flags (struct pq_attr.flags)
+ */
+enum pq_attr_flags {
+	PQ_ATTR_POW2		= (1 << 0),	//!< Round capacity up to a power of two, mask indices
+	PQ_ATTR_SPIN_ADAPTIVE = (1 << 1),	//!< Adapt the spin budget to recent wait times
+	PQ_ATTR_OBJ_PAD		= (1 << 2),	//!< Pad pool objects to whole cache lines
+	PQ_ATTR_HUGEPAGE	= (1 << 3),	//!< Back the ring and the pool objects with huge pages
+	PQ_ATTR_POOL_CHECK	= (1 << 4),	//!< pq_pool_put() rejects objects not from the pool
+	PQ_ATTR_PREFAULT	= (1 << 5),	//!< Fault in all queue memory at creation
+	PQ_ATTR_MLOCK		= (1 << 6),	//!< Lock all queue memory into RAM
+	PQ_ATTR_SHRINK		= (1 << 7),	//!< Shrink a grown queue back after sustained low occupancy
+	PQ_ATTR_STATS		= (1 << 8),	//!< Keep the counters returned by pq_stats()
+	PQ_ATTR_LATENCY		= (1 << 9),	//!< Keep the sojourn time histogram read by pq_latency()
+};
+
+/**
+ * Wait strategies for blocked pushes and pops
+ */
+enum pq_wait_strategy {
+	PQ_WAIT_PARK		= 0,	//!< Sleep on the condition right away
+	PQ_WAIT_SPIN		= 1,	//!< Busy spin, never sleep
+	PQ_WAIT_SPIN_YIELD	= 2,	//!< Spin, then sched_yield() between checks
+	PQ_WAIT_SPIN_PARK	= 3,	//!< Spin, then sleep on the condition
+	PQ_WAIT_MAX
+};
+
+/**
+ * What a push does when the queue is full and the caller does not wait
+ */
+enum pq_overflow {
+	PQ_OVERFLOW_REJECT		= 0,	//!< Fail with ENOMEM
+	PQ_OVERFLOW_BLOCK		= 1,	//!< Wait for a consumer to make room
+	PQ_OVERFLOW_OVERWRITE	= 2,	//!< Evict the oldest entry, PQ_ENGINE_MUTEX only
+	PQ_OVERFLOW_DROP		= 3,	//!< Discard the new entry and count it
+	PQ_OVERFLOW_MAX
+};
+
+/**
+ * Timeout flags for the timed calls
+ */
+enum pq_time_flags {
+	PQ_TIME_ABS			= (1 << 0),	//!< Timeout is an absolute CLOCK_MONOTONIC time
+};
+
+/**
+ * What the producer of a struct pq_bcast does when the slowest reader is a 
+ * whole ring behind
+ */
+enum pq_bcast_policy {
+	PQ_BCAST_BLOCK		= 0,	//!< Wait for the slowest reader, no entry is lost
+	PQ_BCAST_DROP		= 1,	//!< Overwrite, lapped readers skip ahead and count drops
+	PQ_BCAST_MAX
+};
+
+/**
+ * How pq_group_push() picks the queue of an entry
+ */
+enum pq_group_dist {
+	PQ_GROUP_RR			= 0,	//!< Round-robin over the workers
+	PQ_GROUP_HASH		= 1,	//!< Worker selected by the key. Affinity only, stealing may reorder a key
+	PQ_GROUP_LEAST		= 2,	//!< Worker with the shortest queue
+	PQ_GROUP_MAX
+};
+
 /* STRUCTS ===================================================================*/
 
+struct pq_chunk;
+struct pq_hist;
+struct pq_mag;
+struct pq_poll;
+struct pq_shm_hdr;
+struct pq_stats_shard;
+
+/**
+ * Counters of a queue created with PQ_ATTR_STATS, see pq_stats()
+ */
+struct pq_stats {
+	__u64 pushes;				//!< Entries pushed
+	__u64 pops;					//!< Entries popped
+	__u64 full;					//!< Pushes rejected or timed out because the queue was full
+	__u64 empty;				//!< Pops that returned nothing because the queue was empty
+	__u64 trylock_fails;		//!< Lock acquisitions that found the mutex taken
+	__u64 waits;				//!< Sleeps on a condition variable or eventcount
+	__u64 signals;				//!< Wakeups issued to sleeping threads
+	__u64 lock_wait_ns;			//!< Time spent blocked acquiring a contended mutex
+	__u64 wait_ns;				//!< Time spent asleep in those waits
+	__u32 high_water;			//!< Most entries seen queued after a push
+};
+
+/**
+ * Sojourn times of a queue created with PQ_ATTR_LATENCY, see pq_latency()
+ *
+ * Times are in nanoseconds from push to pop, each the upper bound of its 
+ * histogram bucket
+ */
+struct pq_latency {
+	__u64 count;				//!< Entries recorded
+	__u64 p50;
+	__u64 p90;
+	__u64 p99;
+	__u64 p999;
+	__u64 max;
+};
+
+struct ptr_queue;
+
+/**
+ * Called when the length of a queue crosses one of its watermarks
+ *
+ * high is 1 when the length rose to wm_high and 0 when it fell to wm_low. 
+ * Runs in the pushing or popping thread, after the queue lock is released
+ */
+typedef void (*pq_watermark_fn)(struct ptr_queue *pq, int high, __u32 len, void *arg);
+
+/**
+ * Continuation registered with pq_async_wait()
+ *
+ * The memory belongs to the caller and must stay valid until fn has been 
+ * called or pq_async_cancel() took the waiter back. fn runs inside the 
+ * pq_push() or pq_pop() that made the queue ready. If fn pushes or pops 
+ * itself, that call may run further waiters before it returns, so a fn that
+ * does more than hand the work off should guard against nesting
+ */
+struct pq_waiter {
+	void (*fn)(struct pq_waiter *w);	//!< Called once the queue may be ready
+	void *arg;					//!< For the caller
+	struct pq_waiter *next;		//!< Private to the queue, NULL once taken off it
+	struct pq_waiter *prev;		//!< Private to the queue
+	int full;					//!< Private to the queue, the full argument of pq_async_wait()
+};
+
+/**
+ * Pointer Queue creation attributes
+ *
+ * Initialize with pq_attr_init() before changing any field
+ */
+struct pq_attr {
+	int engine;					//!< enum pq_engine
+	__u32 flags;				//!< enum pq_attr_flags
+	int wait_strategy;			//!< enum pq_wait_strategy
+	__u32 spin;					//!< Spin budget in iterations
+	__u32 obj_align;			//!< Pool object alignment, power of two. 0 packs objects
+	__u32 mag_size;				//!< Objects cached per thread by a pool, 0 disables
+	int numa_node;				//!< Node of the queue memory, PQ_NUMA_ANY or PQ_NUMA_LOCAL
+	__u32 msg_size;				//!< Size of the messages stored inline in slots, 0 for pointers
+	size_t max_count;			//!< Capacity a mutex queue grows to when full, 0 keeps it fixed
+	int overflow;				//!< enum pq_overflow
+	__u32 wm_low;				//!< Length that ends a high watermark episode
+	__u32 wm_high;				//!< Length that starts a high watermark episode
+	pq_watermark_fn wm_fn;		//!< Watermark callback, NULL disables the watermarks
+	void *wm_arg;				//!< Passed to wm_fn
+};
+
 /**
  * Pointer Queue data structure
+ *
+ * The read-mostly, producer, consumer and mutex fields each start on their
+ * own cache line so that producers and consumers on different cores do not
+ * invalidate each other's lines. The waiter counts live next to the 
+ * eventcount of their side, on the line the waking side already writes, so
+ * the lock-free wake check of a push or pop never reads the mutex line.
  */
 struct ptr_queue {
-	// Mutex fields
-	pthread_mutex_t mtx;
-	pthread_cond_t cond;
-	int waiting;
-
-	// Data storage fields	
+	// Read-mostly fields
 	void **data;
+	__u8 *msgs;					//!< Inline message slots, replaces data in message mode
 	__u8 *buf;
-	__u32 head;
-	__u32 tail;
+	__u32 *seq;
+	__u32 mask;
 	__u32 array_capacity;
 	__u32 user_capacity;
+	__u32 flags;
+	int engine;
+	int wait_strategy;
+	int overflow;				//!< enum pq_overflow
+	__u32 spin_max;
+	size_t obj_size;			//!< Size of a pool object as requested
+	size_t obj_stride;			//!< Distance between pool objects in buf
+	size_t buf_size;			//!< Bytes of buf holding pool objects
+	size_t buf_map;				//!< Length of the mapping backing buf, 0 if on the heap
+	__u32 mag_size;				//!< Capacity of the per thread magazines
+	__u32 mag_id;				//!< Index of the pool in the magazine table of each thread
+	__u64 mag_serial;			//!< Tells the pool from freed ones that had the same mag_id
+	int numa_node;				//!< Node the queue memory is bound to, PQ_NUMA_ANY if none
+	size_t data_map;			//!< Length of the mapping backing data, 0 if on the heap
+	size_t seq_map;				//!< Length of the mapping backing seq, 0 if on the heap
+	size_t self_map;			//!< Length of the mapping backing this struct, 0 if on the heap
+	size_t msgs_map;			//!< Length of the mapping backing msgs, 0 if on the heap
+	size_t msg_size;			//!< Size of an inline message
+	size_t msg_stride;			//!< Distance between inline message slots
+	struct pq_poll *poll;		//!< Poll set the queue is registered with, NULL if none
+	int notifying;				//!< Producers between reading poll and waking it
+	int efd;					//!< eventfd from pq_eventfd(), -1 if none
+	struct pq_stats_shard *stats;	//!< Counter shards, NULL unless PQ_ATTR_STATS
+	__u64 *stamp;				//!< Push time of each slot, NULL unless PQ_ATTR_LATENCY
+	size_t stamp_map;			//!< Length of the mapping backing stamp, 0 if on the heap
+	struct pq_hist *hist;		//!< Sojourn time histogram, NULL unless PQ_ATTR_LATENCY
+	int fast_path;				//!< Non zero if the main_inline.h fast path may be used
+	__u32 wm_low;				//!< Watermarks, see pq_attr
+	__u32 wm_high;
+	pq_watermark_fn wm_fn;
+	void *wm_arg;
+
+	// Producer fields
+	__u32 tail PQ_ALIGNED;
+	__u32 head_cache;			//!< Producer copy of head (SPSC)
+	__u32 spin_budget_full;		//!< Spin budget of producers waiting on full
+	__u32 ec_empty;				//!< Eventcount lock-free consumers park on
+	int waiting;				//!< Consumers waiting for the queue to go non empty, any engine
+	int async_waiting;			//!< Waiters on async
+	struct pq_chunk *tail_chunk;	//!< Chunk producers write to (CHUNKED)
+	__u32 tail_slot;			//!< Next free slot of tail_chunk (CHUNKED)
+	pthread_mutex_t tail_mtx;	//!< Serializes producers (CHUNKED)
+	__u64 dropped;				//!< Entries discarded or evicted by the overflow policy
+
+	// Consumer fields
+	__u32 head PQ_ALIGNED;
+	__u32 tail_cache;			//!< Consumer copy of tail (SPSC)
+	__u32 spin_budget;			//!< Spin budget of consumers waiting on empty
+	__u32 ec_full;				//!< Eventcount lock-free producers park on
+	int waiting_full;			//!< Producers waiting for the queue to go not full, any engine
+	int async_waiting_full;		//!< Waiters on async_full
+	struct pq_chunk *head_chunk;	//!< Chunk consumers read from (CHUNKED)
+	__u32 head_slot;			//!< Next queued slot of head_chunk (CHUNKED)
+
+	// Mutex fields
+	pthread_mutex_t mtx PQ_ALIGNED;
+	pthread_cond_t cond;
+	pthread_cond_t cond_full;	//!< Signaled when the queue goes not full
+	struct pq_mag *mags;		//!< All magazines of the pool, protected by mtx
+	__u32 min_capacity;			//!< Capacity at creation, a queue never shrinks below it
+	__u32 max_capacity;			//!< Capacity a growable queue may reach, user_capacity if fixed
+	__u32 low_pops;				//!< Consecutive pops that left the queue a quarter full or less
+	struct pq_chunk *chunk_free;	//!< Retired chunks kept for reuse (CHUNKED)
+	__u32 chunk_spares;			//!< Chunks on chunk_free
+	int efd_armed;				//!< Non zero while the consumer waits for an efd signal
+	__u32 high_water;			//!< Most entries seen queued (PQ_ATTR_STATS)
+	int wm_above;				//!< Non zero between a high and a low watermark call
+	struct pq_waiter async;		//!< Head of the waiters for an entry, protected by mtx
+	struct pq_waiter async_full;	//!< Head of the waiters for a free slot, protected by mtx
+};
+
+/**
+ * Object pool sharded by NUMA node
+ *
+ * Each node online when the pool was created has its own struct ptr_queue
+ * pool bound to it. Gets prefer the pool of the calling thread's node.
+ */
+struct pq_numa_pool {
+	int nodes;					//!< Entries in pools
+	struct ptr_queue **pools;	//!< Pool of each node, NULL for nodes not online
+	__u32 ec PQ_ALIGNED;		//!< Eventcount getters park on, bumped by puts to any node
+	int waiting;				//!< Getters parked on ec
+};
+
+/**
+ * Cursor of a reader of a struct pq_bcast
+ */
+struct pq_bcast_reader {
+	__u32 head PQ_ALIGNED;		//!< Position of the next entry to read
+	int active;					//!< Non zero while the reader is joined
+	__u32 dropped;				//!< Entries overwritten before this reader got to them, see pq_bcast_dropped()
+};
+
+/**
+ * Broadcast ring: one producer, every reader sees every entry
+ *
+ * The producer publishes each entry once. Every reader follows it with its 
+ * own cursor and slots are reused once the slowest reader passed them, or 
+ * right away with PQ_BCAST_DROP.
+ */
+struct pq_bcast {
+	// Read-mostly fields
+	void **data;
+	__u32 mask;
+	__u32 capacity;				//!< Slots, a power of two
+	int policy;					//!< enum pq_bcast_policy
+	int readers;				//!< Entries in reader
+	struct pq_bcast_reader *reader;	//!< Reader cursors
+	pthread_mutex_t mtx;		//!< Serializes pq_bcast_join() and pq_bcast_leave()
+
+	// Producer fields
+	__u32 tail PQ_ALIGNED;		//!< Position of the next entry to publish
+	__u32 ec;					//!< Eventcount readers park on
+	int waiting;				//!< Readers parked on ec
+
+	// Fields readers write
+	__u32 ec_full PQ_ALIGNED;	//!< Eventcount a blocked producer parks on
+	int waiting_full;			//!< Non zero while the producer is parked
+};
+
+/**
+ * Group of queues, one per worker
+ *
+ * Producers spread entries over the queues. A worker pops its own queue and
+ * steals from its siblings when that runs dry, so there is no queue that all
+ * consumers contend on. Idle workers park on a group wide eventcount.
+ */
+struct pq_group {
+	int count;					//!< Entries in queues, one per worker
+	int dist;					//!< enum pq_group_dist
+	struct ptr_queue **queues;	//!< Queue of each worker
+	__u32 next PQ_ALIGNED;		//!< Round-robin cursor of the producers
+	__u32 ec PQ_ALIGNED;		//!< Eventcount idle workers park on
+	int waiting;				//!< Workers parked on ec
+};
+
+/**
+ * Priority queue of several FIFO levels
+ *
+ * Level 0 is the most urgent. Bit i of bitmap is set while level i may hold
+ * entries, so a pop finds the most urgent level with a count of trailing 
+ * zeros. All levels share one eventcount consumers park on.
+ */
+struct pq_prio {
+	int levels;					//!< Entries in queues
+	__u32 starve;				//!< Every starve-th pop serves the least urgent level, 0 never
+	struct ptr_queue **queues;	//!< Queue of each level
+	__u64 bitmap PQ_ALIGNED;	//!< Levels that may be non empty
+	__u32 pops;					//!< Pops so far, paces starvation protection
+	__u32 ec PQ_ALIGNED;		//!< Eventcount idle consumers park on
+	int waiting;				//!< Consumers parked on ec
+};
+
+/**
+ * Set of queues a consumer waits on at once
+ *
+ * Producers of every registered queue wake the consumers parked on the 
+ * shared eventcount when they publish entries.
+ */
+struct pq_poll {
+	int count;					//!< Entries in queues
+	int next;					//!< Queue pq_poll_wait() checks first, rotated for fairness
+	struct ptr_queue **queues;	//!< Registered queues
+	__u32 ec PQ_ALIGNED;		//!< Eventcount consumers park on
+	int waiting;				//!< Consumers parked on ec
+};
+
+/**
+ * Process local handle of a queue in shared memory
+ *
+ * The region holds the header, the rings and the objects. Rings store object
+ * offsets from the start of the region, the handle turns them into pointers
+ * of this process.
+ */
+struct pq_shm {
+	__u8 *base;					//!< Start of the mapping in this process
+	size_t size;				//!< Length of the mapping
+	int fd;						//!< shm_open() or memfd_create() descriptor
+	struct pq_shm_hdr *hdr;		//!< Shared header at the start of the region
+	__u64 *slots[PQ_SHM_RINGS];	//!< Object offsets of each ring
+	__u32 *seq[PQ_SHM_RINGS];	//!< Slot sequence numbers of each ring
+	__u8 *buf;					//!< First object
 };
 
 /* GLOBAL VARIABLES ==========================================================*/
 
 /* PROTOTYPES ================================================================*/
 
+int pq_async_cancel(struct ptr_queue *pq, struct pq_waiter *w);
+int pq_async_wait(struct ptr_queue *pq, struct pq_waiter *w, int full);
+int pq_attr_init(struct pq_attr *attr);
+__u32 pq_bcast_dropped(struct pq_bcast *b, int id);
+int pq_bcast_free(struct pq_bcast *b);
+struct pq_bcast *pq_bcast_init(size_t count, int readers, int policy);
+int pq_bcast_join(struct pq_bcast *b);
+int pq_bcast_leave(struct pq_bcast *b, int id);
+void *pq_bcast_pop(struct pq_bcast *b, int id, int wait);
+int pq_bcast_push(struct pq_bcast *b, void *ptr, int wait);
+int pq_commit(struct ptr_queue *pq, void **span, __u32 n);
+__u64 pq_dropped(struct ptr_queue *pq);
 int pq_empty(struct ptr_queue *pq);
+int pq_eventfd(struct ptr_queue *pq);
+int pq_eventfd_arm(struct ptr_queue *pq);
 int pq_free(struct ptr_queue *pq);
+int pq_group_free(struct pq_group *g);
+struct pq_group *pq_group_init(int workers, size_t count, int dist, const struct pq_attr *attr);
+__s32 pq_group_len(struct pq_group *g);
+void *pq_group_pop(struct pq_group *g, int worker, int wait);
+__s32 pq_group_pop_n(struct pq_group *g, int worker, void **out, __u32 max, int wait);
+int pq_group_push(struct pq_group *g, void *ptr, __u64 key);
 struct ptr_queue *pq_init(size_t count, size_t obj_size);
+struct ptr_queue *pq_init_attr(size_t count, size_t obj_size, const struct pq_attr *attr);
+struct ptr_queue *pq_init_chunked(size_t count, size_t obj_size);
+struct ptr_queue *pq_init_mpmc(size_t count, size_t obj_size);
+struct ptr_queue *pq_init_node(size_t count, size_t obj_size, int node);
+struct ptr_queue *pq_init_spsc(size_t count, size_t obj_size);
+int pq_latency(struct ptr_queue *pq, struct pq_latency *out);
+int pq_latency_quantile(struct ptr_queue *pq, double q, __u64 *ns);
+int pq_latency_reset(struct ptr_queue *pq);
 __s32 pq_len(struct ptr_queue *pq);
+int pq_msg_commit(struct ptr_queue *pq);
+const void *pq_msg_peek(struct ptr_queue *pq, int wait);
+int pq_msg_release(struct ptr_queue *pq);
+void *pq_msg_reserve(struct ptr_queue *pq);
+int pq_numa_pool_free(struct pq_numa_pool *np);
+void *pq_numa_pool_get(struct pq_numa_pool *np, int wait);
+struct pq_numa_pool *pq_numa_pool_init(size_t count, size_t obj_size, const struct pq_attr *attr);
+int pq_numa_pool_put(struct pq_numa_pool *np, void *obj);
+__s32 pq_peek_n(struct ptr_queue *pq, void ***span, __u32 max, int wait);
+int pq_poll_free(struct pq_poll *p);
+struct pq_poll *pq_poll_init(struct ptr_queue **queues, int count);
+int pq_poll_wait(struct pq_poll *p, const struct timespec *ts, int flags);
+int pq_pool_flush(struct ptr_queue *pq);
+void *pq_pool_get(struct ptr_queue *pq, int wait);
+int pq_pool_owns(struct ptr_queue *pq, void *obj);
+int pq_pool_put(struct ptr_queue *pq, void *obj);
 void *pq_pop(struct ptr_queue *pq, int wait);
+int pq_pop_copy(struct ptr_queue *pq, void *out, int wait);
+__s32 pq_pop_n(struct ptr_queue *pq, void **out, __u32 max, int wait);
+void *pq_pop_timed(struct ptr_queue *pq, const struct timespec *ts, int flags);
 void pq_print(struct ptr_queue *pq);
+int pq_prio_free(struct pq_prio *p);
+struct pq_prio *pq_prio_init(int levels, size_t count, __u32 starve, const struct pq_attr *attr);
+__s32 pq_prio_len(struct pq_prio *p);
+void *pq_prio_pop(struct pq_prio *p, int wait);
+int pq_prio_push(struct pq_prio *p, void *ptr, int level);
 int pq_push(struct ptr_queue *pq, void *ptr);
+int pq_push_copy(struct ptr_queue *pq, const void *msg, int wait);
+int pq_push_evict(struct ptr_queue *pq, void *ptr, void **evicted);
+__s32 pq_push_n(struct ptr_queue *pq, void **ptrs, __u32 n);
+int pq_push_timed(struct ptr_queue *pq, void *ptr, const struct timespec *ts, int flags);
+int pq_push_wait(struct ptr_queue *pq, void *ptr);
+int pq_release(struct ptr_queue *pq, void **span, __u32 n);
+__s32 pq_reserve(struct ptr_queue *pq, void ***span, __u32 n);
+int pq_set_overflow(struct ptr_queue *pq, int policy);
+int pq_set_wait_strategy(struct ptr_queue *pq, int strategy, __u32 spin);
+int pq_shm_close(struct pq_shm *sq);
+struct pq_shm *pq_shm_create(const char *name, size_t count, size_t obj_size);
+int pq_shm_fd(struct pq_shm *sq);
+void *pq_shm_get(struct pq_shm *sq, int wait);
+__s32 pq_shm_len(struct pq_shm *sq);
+struct pq_shm *pq_shm_open(const char *name);
+struct pq_shm *pq_shm_open_fd(int fd);
+void *pq_shm_pop(struct pq_shm *sq, int wait);
+int pq_shm_push(struct pq_shm *sq, void *obj);
+int pq_shm_put(struct pq_shm *sq, void *obj);
+int pq_shm_unlink(const char *name);
+int pq_stats(struct ptr_queue *pq, struct pq_stats *out);
+int pq_stats_reset(struct ptr_queue *pq);
+void pq_wake(struct ptr_queue *pq, __u32 n, int full);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* ifndef _PTRQUEUE_H */
@@ -0,0 +1,290 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file        ptrqueue_async.hpp
+ *
+ * @brief       C++20 coroutine awaitables for the Pointer Queue library
+ *
+ * pq::queue wraps a struct ptr_queue so a coroutine can co_await q.pop() or
+ * co_await q.push(ptr) instead of blocking its thread. A coroutine that
+ * finds the queue empty (or full) registers a pq_waiter with
+ * pq_async_wait() and suspends. The thread whose push (or pop) makes the
+ * queue ready takes the entry (or the slot) for it and hands the coroutine
+ * to the queue's resume function. By default that resumes it in the waking
+ * thread, once the call that woke it is back in the outermost resume of the
+ * thread, so a resumed coroutine that pushes or pops again does not nest. An
+ * executor passes its own function to post the handle to its threads.
+ *
+ * The awaitables use pq_pop_n(pq, ..., 0) and pq_push(), so they need a 
+ * pointer queue whose overflow policy does not block. An awaitable must not
+ * be destroyed while its coroutine is suspended on it.
+ *
+ * @copyright   Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date        Mar 2024
+ * @author      Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+#ifndef _PTRQUEUE_ASYNC_HPP
+#define _PTRQUEUE_ASYNC_HPP
+
+/* INCLUDES ==================================================================*/
+
+#include <cerrno>
+#include <coroutine>
+#include <ctime>
+#include <deque>
+
+#include "main.h"
+
+namespace pq {
+
+/* TYPES =====================================================================*/
+
+/**
+ * Resumes a coroutine whose queue became ready, ctx is the one given to queue
+ */
+using resume_fn = void (*)(std::coroutine_handle<> h, void *ctx);
+
+/**
+ * Default resume_fn: resume the coroutine in the thread that made it ready
+ *
+ * A waker runs inside the pq_push() or pq_pop() that made the queue ready. 
+ * If that call was itself made by a coroutine being resumed here, the 
+ * handle is queued and resumed once that coroutine suspends or finishes, so
+ * chains of coroutines waking each other do not grow the stack.
+ */
+inline void resume_inline(std::coroutine_handle<> h, void *)
+{
+	static thread_local std::deque<std::coroutine_handle<>> pending;
+	static thread_local bool running;
+
+	pending.push_back(h);
+	if (running)
+		return;
+
+	running = true;
+	while (!pending.empty())
+	{
+		h = pending.front();
+		pending.pop_front();
+		h.resume();
+	}
+	running = false;
+}
+
+/**
+ * A struct ptr_queue that coroutines can await, the queue is not owned
+ */
+class queue
+{
+public:
+	class pop_awaiter;
+	class push_awaiter;
+
+	explicit queue(struct ptr_queue *pq, resume_fn resume = resume_inline, void *ctx = nullptr)
+		: pq_(pq), resume_(resume), ctx_(ctx) {}
+
+	struct ptr_queue *get() const { return pq_; }
+
+	/**
+	 * co_await q.pop() returns the entry at the head of the queue, waiting
+	 * for one if it is empty. errno is 0 upon success, so a queued NULL 
+	 * entry can be told from a failed pop, which returns NULL with errno set
+	 */
+	pop_awaiter pop();
+
+	/**
+	 * co_await q.push(ptr) returns 0 once ptr is queued, waiting for room if
+	 * the queue is full. 1 if the queue failed, errno tells why
+	 */
+	push_awaiter push(void *ptr);
+
+private:
+	struct ptr_queue *pq_;
+	resume_fn resume_;
+	void *ctx_;
+};
+
+/**
+ * Awaitable returned by queue::pop()
+ */
+class queue::pop_awaiter
+{
+public:
+	explicit pop_awaiter(queue &q) : q_(q), value_(nullptr), err_(0), waiter_{}
+	{
+		waiter_.fn = wake;
+		waiter_.arg = this;
+	}
+
+	// The queue keeps a pointer to the waiter
+	pop_awaiter(const pop_awaiter &) = delete;
+	pop_awaiter &operator=(const pop_awaiter &) = delete;
+
+	bool await_ready()
+	{
+		return try_pop();
+	}
+
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		handle_ = h;
+		return arm();
+	}
+
+	// The coroutine may resume on another thread, errno is set here
+	void *await_resume() const
+	{
+		errno = err_;
+		return value_;
+	}
+
+private:
+	/* Pop without waiting for an entry. Returns true when done: popped, 
+	 * maybe a NULL entry, or failed for a reason other than empty
+	 */
+	bool try_pop()
+	{
+		__s32 n;
+
+		value_ = nullptr;
+		n = pq_pop_n(q_.pq_, &value_, 1, 0);
+		err_ = (n == 1) ? 0 : errno;
+		return err_ != EAGAIN;
+	}
+
+	/* Register the waiter, or take an entry that arrived meanwhile. Returns
+	 * true if registered, then the waiter may run before arm() returns
+	 */
+	bool arm()
+	{
+		for (;;)
+		{
+			if (pq_async_wait(q_.pq_, &waiter_, 0) == 0)
+				return true;
+			if (errno != EALREADY)
+			{
+				err_ = errno;
+				return false;
+			}
+
+			if (try_pop())
+				return false;
+		}
+	}
+
+	// Another consumer may take the entry first, then wait again
+	static void wake(struct pq_waiter *w)
+	{
+		pop_awaiter *a = static_cast<pop_awaiter *>(w->arg);
+
+		if (!a->try_pop() && a->arm())
+			return;
+
+		a->q_.resume_(a->handle_, a->q_.ctx_);
+	}
+
+	queue &q_;
+	void *value_;
+	int err_;
+	struct pq_waiter waiter_;
+	std::coroutine_handle<> handle_;
+};
+
+/**
+ * Awaitable returned by queue::push()
+ */
+class queue::push_awaiter
+{
+public:
+	push_awaiter(queue &q, void *ptr) : q_(q), ptr_(ptr), rv_(1), err_(0), waiter_{}
+	{
+		waiter_.fn = wake;
+		waiter_.arg = this;
+	}
+
+	// The queue keeps a pointer to the waiter
+	push_awaiter(const push_awaiter &) = delete;
+	push_awaiter &operator=(const push_awaiter &) = delete;
+
+	bool await_ready()
+	{
+		return try_push();
+	}
+
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		handle_ = h;
+		return arm();
+	}
+
+	// The coroutine may resume on another thread, errno is set here
+	int await_resume() const
+	{
+		errno = err_;
+		return rv_;
+	}
+
+private:
+	// Returns true when done: pushed, or failed for a reason other than full
+	bool try_push()
+	{
+		rv_ = pq_push(q_.pq_, ptr_);
+		err_ = (rv_ == 0) ? 0 : errno;
+		return rv_ == 0 || err_ != ENOMEM;
+	}
+
+	/* Register the waiter, or push into a slot freed meanwhile. Returns true
+	 * if registered, then the waiter may run before arm() returns
+	 */
+	bool arm()
+	{
+		for (;;)
+		{
+			if (pq_async_wait(q_.pq_, &waiter_, 1) == 0)
+				return true;
+			if (errno != EALREADY)
+			{
+				rv_ = 1;
+				err_ = errno;
+				return false;
+			}
+
+			if (try_push())
+				return false;
+		}
+	}
+
+	// Another producer may take the slot first, then wait again
+	static void wake(struct pq_waiter *w)
+	{
+		push_awaiter *a = static_cast<push_awaiter *>(w->arg);
+
+		if (!a->try_push() && a->arm())
+			return;
+
+		a->q_.resume_(a->handle_, a->q_.ctx_);
+	}
+
+	queue &q_;
+	void *ptr_;
+	int rv_;
+	int err_;
+	struct pq_waiter waiter_;
+	std::coroutine_handle<> handle_;
+};
+
+inline queue::pop_awaiter queue::pop()
+{
+	return pop_awaiter(*this);
+}
+
+inline queue::push_awaiter queue::push(void *ptr)
+{
+	return push_awaiter(*this, ptr);
+}
+
+} // namespace pq
+
+#endif /* ifndef _PTRQUEUE_ASYNC_HPP */
@@ -0,0 +1,190 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file        ptrqueue_inline.h
+ *
+ * @brief       Inline push and pop fast path for the lock-free engines
+ *
+ * pq_push_inline() and pq_pop_inline() compile into the caller for queues
+ * whose fast_path is set: PQ_ENGINE_MPMC, or PQ_ENGINE_SPSC with
+ * PQ_ATTR_POW2, without inline messages, PQ_ATTR_STATS or PQ_ATTR_LATENCY.
+ * Any other queue, and every case that has to wait, goes to pq_push() or
+ * pq_pop(), so the result is always the same as calling those.
+ *
+ * Argument checks are only compiled in without NDEBUG.
+ *
+ * @copyright   Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date        Mar 2024
+ * @author      Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+#ifndef _PTRQUEUE_INLINE_H
+#define _PTRQUEUE_INLINE_H
+
+/* INCLUDES ==================================================================*/
+
+#include <errno.h>
+
+#include "main.h"
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Wake sleepers after the fast path published entries or slots
+ *
+ * Same fence then load as the library wakers: the call is only made when a
+ * thread or a pq_async_wait() waiter announced itself, or the queue is 
+ * watched by a poll set or eventfd.
+ */
+static inline void pq_inline_wake(struct ptr_queue *pq, int full)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (full)
+	{
+		if (__atomic_load_n(&pq->waiting_full, __ATOMIC_RELAXED) != 0 ||
+			__atomic_load_n(&pq->async_waiting_full, __ATOMIC_RELAXED) != 0)
+			pq_wake(pq, 1, 1);
+		return;
+	}
+
+	if (__atomic_load_n(&pq->waiting, __ATOMIC_RELAXED) != 0 ||
+		__atomic_load_n(&pq->async_waiting, __ATOMIC_RELAXED) != 0 ||
+		__atomic_load_n(&pq->poll, __ATOMIC_RELAXED) != NULL ||
+		__atomic_load_n(&pq->efd, __ATOMIC_RELAXED) >= 0)
+		pq_wake(pq, 1, 0);
+}
+
+/**
+ * Return the pointer at the head of the queue, inline when possible
+ *
+ * Same contract as pq_pop()
+ */
+static inline void *pq_pop_inline(struct ptr_queue *pq, int wait)
+{
+	void *rv;
+	__u32 pos, seq;
+	__s32 dif;
+
+#ifndef NDEBUG
+	if (pq == NULL)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+#endif
+
+	if (!pq->fast_path)
+		return pq_pop(pq, wait);
+
+	if (pq->engine == PQ_ENGINE_SPSC)
+	{
+		pos = __atomic_load_n(&pq->head, __ATOMIC_RELAXED);
+		if (pos == pq->tail_cache)
+		{
+			pq->tail_cache = __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE);
+			if (pos == pq->tail_cache)
+				return pq_pop(pq, wait);
+		}
+
+		rv = pq->data[pos & pq->mask];
+		pq->data[pos & pq->mask] = NULL;
+		__atomic_store_n(&pq->head, pos + 1, __ATOMIC_RELEASE);
+		pq_inline_wake(pq, 1);
+
+		return rv;
+	}
+
+	// PQ_ENGINE_MPMC: claim a ready slot with a CAS of head
+	pos = __atomic_load_n(&pq->head, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		seq = __atomic_load_n(&pq->seq[pos & pq->mask], __ATOMIC_ACQUIRE);
+		dif = (__s32) (seq - (pos + 1));
+
+		if (dif == 0)
+		{
+			if (__atomic_compare_exchange_n(&pq->head, &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (dif < 0)
+			return pq_pop(pq, wait);
+		else
+			pos = __atomic_load_n(&pq->head, __ATOMIC_RELAXED);
+	}
+
+	rv = pq->data[pos & pq->mask];
+	pq->data[pos & pq->mask] = NULL;
+	__atomic_store_n(&pq->seq[pos & pq->mask], pos + pq->array_capacity, __ATOMIC_RELEASE);
+	pq_inline_wake(pq, 1);
+
+	return rv;
+}
+
+/**
+ * Insert a new entry at the tail of the queue, inline when possible
+ *
+ * Same contract as pq_push()
+ */
+static inline int pq_push_inline(struct ptr_queue *pq, void *ptr)
+{
+	__u32 pos, seq;
+	__s32 dif;
+
+#ifndef NDEBUG
+	if (pq == NULL)
+	{
+		errno = EINVAL;
+		return 1;
+	}
+#endif
+
+	if (!pq->fast_path)
+		return pq_push(pq, ptr);
+
+	if (pq->engine == PQ_ENGINE_SPSC)
+	{
+		pos = __atomic_load_n(&pq->tail, __ATOMIC_RELAXED);
+		if (pos - pq->head_cache == pq->user_capacity)
+		{
+			pq->head_cache = __atomic_load_n(&pq->head, __ATOMIC_ACQUIRE);
+			if (pos - pq->head_cache == pq->user_capacity)
+				return pq_push(pq, ptr);
+		}
+
+		pq->data[pos & pq->mask] = ptr;
+		__atomic_store_n(&pq->tail, pos + 1, __ATOMIC_RELEASE);
+		pq_inline_wake(pq, 0);
+
+		return 0;
+	}
+
+	// PQ_ENGINE_MPMC: claim a free slot with a CAS of tail
+	pos = __atomic_load_n(&pq->tail, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		seq = __atomic_load_n(&pq->seq[pos & pq->mask], __ATOMIC_ACQUIRE);
+		dif = (__s32) (seq - pos);
+
+		if (dif == 0)
+		{
+			if (__atomic_compare_exchange_n(&pq->tail, &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (dif < 0)
+			return pq_push(pq, ptr);
+		else
+			pos = __atomic_load_n(&pq->tail, __ATOMIC_RELAXED);
+	}
+
+	pq->data[pos & pq->mask] = ptr;
+	__atomic_store_n(&pq->seq[pos & pq->mask], pos + 1, __ATOMIC_RELEASE);
+	pq_inline_wake(pq, 0);
+
+	return 0;
+}
+
+#endif /* ifndef _PTRQUEUE_INLINE_H */
@@ -14,17 +14,37 @@
 /* INCLUDES ==================================================================*/
 
 #include <unistd.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include <fcntl.h>
+#include <poll.h>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include <linux/types.h>
 
 #include "main.h"
+#include "main_inline.h"
 
 /* MACROS ====================================================================*/
 
 #define QUEUE_CAPACITY 10
 #define ITERATIONS 10000
+#define STRESS_ITERATIONS 200000
+#define MPMC_THREADS 4
+#define MPMC_ITERATIONS 200000
+#define MPMC_BATCH 8
+#define MAG_SIZE 8
+#define WARM_CAPACITY (1 << 16)
+#define SHM_ITERATIONS 100000
+#define POLL_QUEUES 3
+#define POLL_ROUNDS 10000
 
 /* ENUMERATIONS ==============================================================*/
 
@@ -32,8 +52,23 @@
 
 /* GLOBAL VARIABLES ==========================================================*/
 
+/* Use pq_push_n() / pq_pop_n() in mpmc_stress() */
+int mpmc_batch;
+
+/* Group shared by the group_worker() threads */
+struct pq_group *group;
+
+/* Priority queue shared by the prio_producer() threads */
+struct pq_prio *prio;
+struct pq_bcast *bcast_ring;
+
+/* Tells poll_churner() to return */
+int poll_stop;
+
 /* PROTOTYPES ================================================================*/
 
+void *stress_consumer(void *arg);
+
 void *consumer(void *arg)
 {
 	struct ptr_queue *pq;
@@ -158,27 +193,2496 @@ void iterate(struct ptr_queue *pq)
 	}
 }
 
-int main()
+/* Push and pop batches of varying size across the wrap point, check order */
+void batch(struct ptr_queue *pq)
+{
+	void *ptrs[QUEUE_CAPACITY + 4];
+	__u64 next_push;
+	__u64 next_pop;
+	__s32 rv;
+
+	printf("-----------------------------\n");
+	printf("batch %d\n", ITERATIONS);
+
+	next_push = 1;
+	next_pop = 1;
+
+	for ( int i = 0 ; i < ITERATIONS ; i++ ) {
+		int n = 1 + (i % (QUEUE_CAPACITY + 3));
+
+		for ( int j = 0 ; j < n ; j++ )
+			ptrs[j] = (void*) (next_push + j);
+
+		rv = pq_push_n(pq, ptrs, n);
+		if (rv < 0 || rv > n) {
+			printf("%d pq_push_n() returned %d\n", i, rv);
+			exit(-1);
+		}
+		next_push += rv;
+
+		rv = pq_pop_n(pq, ptrs, 1 + (i % 5), 0);
+		if (rv < 0) {
+			printf("%d pq_pop_n() returned %d\n", i, rv);
+			exit(-1);
+		}
+		for ( int j = 0 ; j < rv ; j++ ) {
+			if ((__u64) ptrs[j] != next_pop) {
+				printf("%d pq_pop_n() popped %p expected %llu\n", i, ptrs[j], next_pop);
+				exit(-1);
+			}
+			next_pop++;
+		}
+	}
+
+	while ((rv = pq_pop_n(pq, ptrs, QUEUE_CAPACITY + 4, 0)) > 0)
+		for ( int j = 0 ; j < rv ; j++ )
+			if ((__u64) ptrs[j] != next_pop++) {
+				printf("drain popped %p\n", ptrs[j]);
+				exit(-1);
+			}
+
+	if (next_pop != next_push || !pq_empty(pq)) {
+		printf("%s lost entries\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	printf("batch passed\n");
+}
+
+void *backpressure_producer(void *arg)
 {
 	struct ptr_queue *pq;
 
-	pq = pq_init(QUEUE_CAPACITY, 0);
+	pq = (struct ptr_queue*) arg;
 
-	pq_print(pq);
+	for ( __u64 i = 1 ; i <= STRESS_ITERATIONS ; i++ )
+		if (pq_push_wait(pq, (void*) i) != 0) {
+			printf("%s pq_push_wait() failed\n", __FUNCTION__);
+			exit(-1);
+		}
 
-	fill(pq);
+	return NULL;
+}
 
-	pq_print(pq);
+/* Timed push on a full queue, then a producer that parks instead of spinning */
+void backpressure(struct ptr_queue *pq)
+{
+	struct timespec ts;
+	pthread_t producer_thread;
+	pthread_t consumer_thread;
+	int rv;
 
-	empty(pq);
+	printf("-----------------------------\n");
+	printf("backpressure %d\n", STRESS_ITERATIONS);
 
-	pq_print(pq);
+	while (pq_push(pq, (void*) 1) == 0)
+		;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 10000000;
+	rv = pq_push_timed(pq, (void*) 1, &ts, 0);
+	if (rv == 0 || errno != ETIMEDOUT) {
+		printf("%s pq_push_timed() on a full queue returned %d\n", __FUNCTION__, rv);
+		exit(-1);
+	}
+
+	while (pq_pop(pq, 0) != NULL)
+		;
+
+	pthread_create( &consumer_thread, NULL, stress_consumer, (void*) pq );
+	pthread_create( &producer_thread, NULL, backpressure_producer, (void*) pq );
+
+	pthread_join( producer_thread, NULL);
+	pthread_join( consumer_thread, NULL);
+
+	printf("backpressure passed\n");
+}
+
+/* Timed and non blocking pops on an empty queue */
+void timed(struct ptr_queue *pq)
+{
+	struct timespec ts;
+	void *ptr;
+
+	printf("-----------------------------\n");
+	printf("timed pop\n");
+
+	errno = 0;
+	ptr = pq_pop(pq, 0);
+	if (ptr != NULL || errno != EAGAIN) {
+		printf("%s pq_pop() on an empty queue returned %p errno %d\n", __FUNCTION__, ptr, errno);
+		exit(-1);
+	}
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 10000000;
+	ptr = pq_pop_timed(pq, &ts, 0);
+	if (ptr != NULL || errno != ETIMEDOUT) {
+		printf("%s pq_pop_timed() on an empty queue returned %p\n", __FUNCTION__, ptr);
+		exit(-1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ptr = pq_pop_timed(pq, &ts, PQ_TIME_ABS);
+	if (ptr != NULL || errno != ETIMEDOUT) {
+		printf("%s pq_pop_timed() with a past deadline returned %p\n", __FUNCTION__, ptr);
+		exit(-1);
+	}
+
+	// Out of range nanoseconds are rejected, relative or absolute
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000000L;
+	ptr = pq_pop_timed(pq, &ts, 0);
+	if (ptr != NULL || errno != EINVAL) {
+		printf("%s pq_pop_timed() accepted tv_nsec %ld\n", __FUNCTION__, ts.tv_nsec);
+		exit(-1);
+	}
+	ts.tv_nsec = -1;
+	if (pq_pop_timed(pq, &ts, PQ_TIME_ABS) != NULL || errno != EINVAL || 
+	    pq_push_timed(pq, (void*) 7, &ts, 0) == 0 || errno != EINVAL || !pq_empty(pq)) {
+		printf("%s timed call accepted tv_nsec %ld\n", __FUNCTION__, ts.tv_nsec);
+		exit(-1);
+	}
+
+	pq_push(pq, (void*) 7);
+	ts.tv_sec = 1;
+	ts.tv_nsec = 0;
+	ptr = pq_pop_timed(pq, &ts, 0);
+	if (ptr != (void*) 7) {
+		printf("%s pq_pop_timed() returned %p\n", __FUNCTION__, ptr);
+		exit(-1);
+	}
+
+	printf("timed pop passed\n");
+}
+
+void *stress_consumer(void *arg)
+{
+	struct ptr_queue *pq;
+	__u64 expected;
+	__u64 val;
+
+	pq = (struct ptr_queue*) arg;
+
+	for ( expected = 1 ; expected <= STRESS_ITERATIONS ; expected++ ) {
+		val = (__u64) pq_pop(pq, 1);
+		if (val != expected) {
+			printf("%s popped %llu expected %llu\n", __FUNCTION__, val, expected);
+			exit(-1);
+		}
+	}
+
+	return NULL;
+}
+
+void *stress_producer(void *arg)
+{
+	struct ptr_queue *pq;
+
+	pq = (struct ptr_queue*) arg;
+
+	for ( __u64 i = 1 ; i <= STRESS_ITERATIONS ; i++ )
+		while (pq_push(pq, (void*) i) != 0)
+			sched_yield();
+
+	return NULL;
+}
+
+/* Single producer, single consumer ordering check */
+void stress(struct ptr_queue *pq)
+{
+	pthread_t producer_thread;
+	pthread_t consumer_thread;
+
+	printf("-----------------------------\n");
+	printf("stress %d\n", STRESS_ITERATIONS);
+
+	pthread_create( &consumer_thread, NULL, stress_consumer, (void*) pq );
+	pthread_create( &producer_thread, NULL, stress_producer, (void*) pq );
+
+	pthread_join( producer_thread, NULL);
+	pthread_join( consumer_thread, NULL);
+
+	printf("stress passed\n");
+}
+
+void *mpmc_consumer(void *arg)
+{
+	struct ptr_queue *pq;
+	void *ptrs[MPMC_BATCH];
+	__u64 sum;
+	int remaining;
+	int rv;
+
+	pq = (struct ptr_queue*) arg;
+	sum = 0;
+
+	if (!mpmc_batch) {
+		for ( int i = 0 ; i < MPMC_ITERATIONS ; i++ )
+			sum += (__u64) pq_pop(pq, 1);
+		return (void*) sum;
+	}
+
+	remaining = MPMC_ITERATIONS;
+	while (remaining > 0) {
+		rv = pq_pop_n(pq, ptrs, remaining < MPMC_BATCH ? remaining : MPMC_BATCH, 1);
+		for ( int j = 0 ; j < rv ; j++ )
+			sum += (__u64) ptrs[j];
+		remaining -= rv;
+	}
+
+	return (void*) sum;
+}
+
+void *mpmc_producer(void *arg)
+{
+	struct ptr_queue *pq;
+	void *ptrs[MPMC_BATCH];
+	__u64 i;
+	int n;
+	int rv;
+
+	pq = (struct ptr_queue*) arg;
+
+	if (!mpmc_batch) {
+		for ( i = 1 ; i <= MPMC_ITERATIONS ; i++ )
+			while (pq_push(pq, (void*) i) != 0)
+				sched_yield();
+		return NULL;
+	}
+
+	for ( i = 1 ; i <= MPMC_ITERATIONS ; ) {
+		n = 0;
+		while (n < MPMC_BATCH && i + n <= MPMC_ITERATIONS) {
+			ptrs[n] = (void*) (i + n);
+			n++;
+		}
+
+		rv = pq_push_n(pq, ptrs, n);
+		if (rv <= 0)
+			sched_yield();
+		else
+			i += rv;
+	}
+
+	return NULL;
+}
+
+/* Multiple producers and consumers, check that every entry is popped once */
+void mpmc_stress(struct ptr_queue *pq)
+{
+	pthread_t producer_thread[MPMC_THREADS];
+	pthread_t consumer_thread[MPMC_THREADS];
+	__u64 expected;
+	__u64 sum;
+	void *ptr;
+
+	printf("-----------------------------\n");
+	printf("mpmc stress %d x %d batch %d\n", MPMC_THREADS, MPMC_ITERATIONS, mpmc_batch);
+
+	for ( int i = 0 ; i < MPMC_THREADS ; i++ ) {
+		pthread_create( &consumer_thread[i], NULL, mpmc_consumer, (void*) pq );
+		pthread_create( &producer_thread[i], NULL, mpmc_producer, (void*) pq );
+	}
+
+	sum = 0;
+	for ( int i = 0 ; i < MPMC_THREADS ; i++ ) {
+		pthread_join( producer_thread[i], NULL);
+		pthread_join( consumer_thread[i], &ptr);
+		sum += (__u64) ptr;
+	}
+
+	expected = (__u64) MPMC_THREADS * MPMC_ITERATIONS * (MPMC_ITERATIONS + 1) / 2;
+	if (sum != expected || !pq_empty(pq)) {
+		printf("%s sum %llu expected %llu\n", __FUNCTION__, sum, expected);
+		exit(-1);
+	}
+
+	printf("mpmc stress passed\n");
+}
+
+/* A one slot request still gets a working MPMC queue of two slots */
+void mpmc_tiny()
+{
+	struct ptr_queue *pq;
+	void *ptr;
+
+	printf("-----------------------------\n");
+	printf("mpmc capacity 1\n");
+
+	pq = pq_init_mpmc(1, 0);
+	if (pq == NULL || pq->user_capacity != 2) {
+		printf("%s capacity %u\n", __FUNCTION__, pq ? pq->user_capacity : 0);
+		exit(-1);
+	}
+
+	// Several laps, so every slot is reused with a later sequence number
+	for ( __u64 i = 1 ; i < 64 ; i += 2 ) {
+		if (pq_push(pq, (void*) i) != 0 || pq_push(pq, (void*) (i + 1)) != 0) {
+			printf("%s push %llu failed\n", __FUNCTION__, i);
+			exit(-1);
+		}
+		if (pq_push(pq, (void*) 99) == 0 || errno != ENOMEM) {
+			printf("%s push into a full queue\n", __FUNCTION__);
+			exit(-1);
+		}
+		if ((ptr = pq_pop(pq, 0)) != (void*) i || (ptr = pq_pop(pq, 0)) != (void*) (i + 1)) {
+			printf("%s lap %llu popped %p\n", __FUNCTION__, i, ptr);
+			exit(-1);
+		}
+		if (pq_pop(pq, 0) != NULL || errno != EAGAIN) {
+			printf("%s pop from an empty queue\n", __FUNCTION__);
+			exit(-1);
+		}
+	}
+
+	pq_free(pq);
+
+	printf("mpmc capacity 1 passed\n");
+}
+
+void mpmc()
+{
+	struct ptr_queue *pq;
+
+	printf("=============================\n");
+	printf("mpmc engine\n");
+
+	pq = pq_init_mpmc(QUEUE_CAPACITY, 0);
+
+	fill(pq);
+
+	empty(pq);
 
 	iterate(pq);
 
-	threads(pq);
+	batch(pq);
+
+	stress(pq);
+
+	backpressure(pq);
+
+	timed(pq);
+
+	mpmc_stress(pq);
+
+	mpmc_batch = 1;
+	mpmc_stress(pq);
+	mpmc_batch = 0;
+
+	pq_free(pq);
+
+	mpmc_tiny();
+}
+
+/* Unbounded queue of linked chunks */
+void chunked()
+{
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+	void *ptrs[MPMC_BATCH];
+	void **span;
+	__u64 next, expect;
+	__s32 n;
+
+	printf("=============================\n");
+	printf("chunked engine\n");
+
+	pq_attr_init(&attr);
+	attr.engine = PQ_ENGINE_CHUNKED;
+	attr.msg_size = 16;
+	if (pq_init_attr(QUEUE_CAPACITY, 0, &attr) != NULL || errno != EINVAL) {
+		printf("%s accepted message mode\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	// Chunks smaller than a batch so batches straddle chunk boundaries
+	pq = pq_init_chunked(MPMC_BATCH - 3, 0);
+	if (pq_reserve(pq, &span, 1) != -ENOTSUP) {
+		printf("%s reserve accepted\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	// Far past the chunk size, pushes never fail
+	next = expect = 1;
+	for ( int i = 0 ; i < ITERATIONS ; i++ )
+		if (pq_push(pq, (void*) next++) != 0) {
+			printf("%s push failed %d\n", __FUNCTION__, errno);
+			exit(-1);
+		}
+	if (pq_len(pq) != ITERATIONS) {
+		printf("%s bad length %d\n", __FUNCTION__, pq_len(pq));
+		exit(-1);
+	}
+
+	while (expect < next) {
+		n = pq_pop_n(pq, ptrs, MPMC_BATCH, 0);
+		for ( __s32 i = 0 ; i < n ; i++ )
+			if ((__u64) ptrs[i] != expect++) {
+				printf("%s bad entry %p\n", __FUNCTION__, ptrs[i]);
+				exit(-1);
+			}
+
+		// Interleave batches of pushes with the pops
+		if (next <= 2 * ITERATIONS) {
+			for ( int i = 0 ; i < MPMC_BATCH ; i++ )
+				ptrs[i] = (void*) next++;
+			pq_push_n(pq, ptrs, MPMC_BATCH);
+		}
+	}
+
+	// Retired chunks are recycled up to the spare limit
+	if (!pq_empty(pq) || pq->chunk_spares > PQ_CHUNK_SPARES) {
+		printf("%s %u spare chunks\n", __FUNCTION__, pq->chunk_spares);
+		exit(-1);
+	}
+
+	timed(pq);
+
+	stress(pq);
+
+	mpmc_stress(pq);
+
+	mpmc_batch = 1;
+	mpmc_stress(pq);
+	mpmc_batch = 0;
 
 	pq_free(pq);
+}
+
+/* Take every object out of a pool and check their placement */
+void pool_drain(struct ptr_queue *pq, void **objs, size_t count, size_t align)
+{
+	for ( size_t i = 0 ; i < count ; i++ ) {
+		objs[i] = pq_pool_get(pq, 0);
+		if (objs[i] == NULL || ((uintptr_t) objs[i] & (align - 1)) != 0) {
+			printf("%s bad object %p\n", __FUNCTION__, objs[i]);
+			exit(-1);
+		}
+		if (i > 0 && objs[i] == objs[i-1]) {
+			printf("%s object handed out twice %p\n", __FUNCTION__, objs[i]);
+			exit(-1);
+		}
+	}
+
+	if (pq_pool_get(pq, 0) != NULL || errno != EAGAIN) {
+		printf("%s pool not exhausted\n", __FUNCTION__);
+		exit(-1);
+	}
+}
+
+struct msg {
+	__u64 seq;
+	__u64 check;
+	__u64 pad;
+};
+
+void *msg_producer(void *arg)
+{
+	struct ptr_queue *pq;
+	struct msg m, *slot;
+
+	pq = (struct ptr_queue*) arg;
+
+	for ( __u64 i = 0 ; i < STRESS_ITERATIONS ; i++ ) {
+		m.seq = i;
+		m.check = ~i;
+
+		// The SPSC engine builds every other message in place
+		if (pq->engine == PQ_ENGINE_SPSC && (i & 1)) {
+			while ((slot = pq_msg_reserve(pq)) == NULL)
+				sched_yield();
+			*slot = m;
+			pq_msg_commit(pq);
+		}
+		else
+			pq_push_copy(pq, &m, 1);
+	}
+
+	return NULL;
+}
+
+/* Pass messages stored inline in the ring */
+void msgs()
+{
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+	pthread_t thread;
+	struct msg m;
+	const struct msg *peek;
+
+	printf("=============================\n");
+	printf("inline messages\n");
+
+	pq_attr_init(&attr);
+	attr.msg_size = sizeof(struct msg);
+
+	for ( attr.engine = PQ_ENGINE_MUTEX ; attr.engine < PQ_ENGINE_CHUNKED ; attr.engine++ ) {
+		pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+		if (pq == NULL || pq->data != NULL) {
+			printf("%s init failed\n", __FUNCTION__);
+			exit(-1);
+		}
+
+		// Pointer calls do not apply to message queues
+		if (pq_push(pq, &m) == 0 || pq_pop(pq, 0) != NULL || errno != EINVAL) {
+			printf("%s pointer call accepted\n", __FUNCTION__);
+			exit(-1);
+		}
+		if (attr.engine != PQ_ENGINE_SPSC && 
+			(pq_msg_reserve(pq) != NULL || errno != ENOTSUP)) {
+			printf("%s reserve accepted\n", __FUNCTION__);
+			exit(-1);
+		}
+
+		pthread_create(&thread, NULL, msg_producer, pq);
+
+		for ( __u64 i = 0 ; i < STRESS_ITERATIONS ; i++ ) {
+			if (attr.engine == PQ_ENGINE_SPSC && (i & 1)) {
+				peek = pq_msg_peek(pq, 1);
+				m = *peek;
+				pq_msg_release(pq);
+			}
+			else if (pq_pop_copy(pq, &m, 1) != 0) {
+				printf("%s pop failed %d\n", __FUNCTION__, errno);
+				exit(-1);
+			}
+
+			if (m.seq != i || m.check != ~i) {
+				printf("%s bad message %llu at %llu\n", __FUNCTION__, 
+					(unsigned long long) m.seq, (unsigned long long) i);
+				exit(-1);
+			}
+		}
+
+		pthread_join(thread, NULL);
+
+		if (pq_pop_copy(pq, &m, 0) == 0 || errno != EAGAIN) {
+			printf("%s queue not empty\n", __FUNCTION__);
+			exit(-1);
+		}
+
+		pq_free(pq);
+	}
+}
+
+void *group_pop(void *arg)
+{
+	return pq_group_pop(group, (int) (intptr_t) arg, 0);
+}
+
+void *group_worker(void *arg)
+{
+	__u64 sum;
+	__u64 val;
+	int worker;
+
+	worker = (int) (intptr_t) arg;
+
+	sum = 0;
+	for (;;) {
+		val = (__u64) pq_group_pop(group, worker, 1);
+		if (val == 0)
+			break;
+		sum += val;
+	}
+
+	return (void*) sum;
+}
+
+/* Per worker queues with work stealing */
+void groups()
+{
+	pthread_t threads[MPMC_THREADS];
+	void *ptrs[QUEUE_CAPACITY];
+	struct pq_attr attr;
+	__u64 sum, expected;
+	void *ptr;
+	__s32 n;
+
+	printf("=============================\n");
+	printf("queue group\n");
+
+	pq_attr_init(&attr);
+	attr.engine = PQ_ENGINE_SPSC;
+	if (pq_group_init(MPMC_THREADS, QUEUE_CAPACITY, PQ_GROUP_RR, &attr) != NULL || errno != EINVAL) {
+		printf("%s accepted the SPSC engine\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	// Round-robin and least-loaded spread entries evenly
+	for ( int dist = PQ_GROUP_RR ; dist < PQ_GROUP_MAX ; dist += PQ_GROUP_LEAST ) {
+		group = pq_group_init(MPMC_THREADS, QUEUE_CAPACITY, dist, NULL);
+		for ( __u64 i = 1 ; i <= MPMC_THREADS * 2 ; i++ )
+			pq_group_push(group, (void*) i, 0);
+		for ( int i = 0 ; i < MPMC_THREADS ; i++ )
+			if (pq_len(group->queues[i]) != 2) {
+				printf("%s dist %d queue %d has %d\n", __FUNCTION__, dist, i, 
+					pq_len(group->queues[i]));
+				exit(-1);
+			}
+		pq_group_free(group);
+	}
+
+	// Entries of a key keep their order in one queue, until it is full
+	group = pq_group_init(MPMC_THREADS, QUEUE_CAPACITY, PQ_GROUP_HASH, NULL);
+	for ( __u64 i = 1 ; i <= QUEUE_CAPACITY ; i++ )
+		pq_group_push(group, (void*) i, 42);
+	if (pq_group_push(group, (void*) 1, 42) == 0 || errno != ENOMEM || 
+		pq_group_len(group) != QUEUE_CAPACITY) {
+		printf("%s hashed push went elsewhere\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	// An idle worker steals one entry, or half of a sibling's entries in a batch
+	for ( int i = 0 ; i < MPMC_THREADS ; i++ ) {
+		if (pq_len(group->queues[i]) == 0)
+			continue;
+
+		ptr = pq_group_pop(group, (i + 1) % MPMC_THREADS, 0);
+		if (ptr != (void*) 1 || pq_len(group->queues[(i + 1) % MPMC_THREADS]) != 0 || 
+			pq_len(group->queues[i]) != QUEUE_CAPACITY - 1) {
+			printf("%s bad steal %p\n", __FUNCTION__, ptr);
+			exit(-1);
+		}
+
+		n = pq_group_pop_n(group, (i + 1) % MPMC_THREADS, ptrs, QUEUE_CAPACITY, 0);
+		if (n != QUEUE_CAPACITY / 2 || ptrs[0] != (void*) 2 || ptrs[n - 1] != (void*) (intptr_t) (n + 1) || 
+			pq_len(group->queues[i]) != QUEUE_CAPACITY - 1 - n) {
+			printf("%s bad batch steal %d\n", __FUNCTION__, n);
+			exit(-1);
+		}
+		break;
+	}
+	pq_group_free(group);
+
+	// A worker whose own queue is locked waits for it instead of stealing
+	group = pq_group_init(2, QUEUE_CAPACITY, PQ_GROUP_RR, NULL);
+	pq_group_push(group, (void*) 1, 0);
+	pq_group_push(group, (void*) 2, 0);
+	pthread_mutex_lock(&group->queues[0]->mtx);
+	pthread_create(&threads[0], NULL, group_pop, (void*) 0);
+	usleep(10000);
+	pthread_mutex_unlock(&group->queues[0]->mtx);
+	pthread_join(threads[0], &ptr);
+	if (ptr != (void*) 1 || pq_len(group->queues[1]) != 1) {
+		printf("%s stole %p past a contended own queue\n", __FUNCTION__, ptr);
+		exit(-1);
+	}
+
+	// Nor does a thief skip a sibling whose queue is locked
+	pthread_mutex_lock(&group->queues[1]->mtx);
+	pthread_create(&threads[0], NULL, group_pop, (void*) 0);
+	usleep(10000);
+	pthread_mutex_unlock(&group->queues[1]->mtx);
+	pthread_join(threads[0], &ptr);
+	if (ptr != (void*) 2 || pq_group_len(group) != 0) {
+		printf("%s skipped a contended victim, got %p\n", __FUNCTION__, ptr);
+		exit(-1);
+	}
+	pq_group_free(group);
+
+	// Workers drain a group fed unevenly, parking when it runs dry
+	for ( int engine = PQ_ENGINE_MUTEX ; engine < PQ_ENGINE_MAX ; engine++ ) {
+		if (engine == PQ_ENGINE_SPSC)
+			continue;
+
+		attr.engine = engine;
+		group = pq_group_init(MPMC_THREADS, QUEUE_CAPACITY, PQ_GROUP_HASH, &attr);
+		for ( int i = 0 ; i < MPMC_THREADS ; i++ )
+			pthread_create(&threads[i], NULL, group_worker, (void*) (intptr_t) i);
+
+		// Most entries hash to a single worker
+		for ( __u64 i = 1 ; i <= MPMC_ITERATIONS ; i++ )
+			while (pq_group_push(group, (void*) i, (i & 7) ? 1 : i) != 0)
+				sched_yield();
+
+		// One stop marker per worker
+		for ( int i = 0 ; i < MPMC_THREADS ; i++ )
+			while (pq_group_push(group, NULL, i) != 0)
+				sched_yield();
+
+		sum = 0;
+		for ( int i = 0 ; i < MPMC_THREADS ; i++ ) {
+			pthread_join(threads[i], &ptr);
+			sum += (__u64) ptr;
+		}
+
+		// A worker stops at the first marker it pops, maybe leaving entries behind
+		while ((ptr = pq_group_pop(group, 0, 0)) != NULL)
+			sum += (__u64) ptr;
+
+		expected = (__u64) MPMC_ITERATIONS * (MPMC_ITERATIONS + 1) / 2;
+		if (sum != expected) {
+			printf("%s engine %d sum %llu expected %llu\n", __FUNCTION__, engine, 
+				(unsigned long long) sum, (unsigned long long) expected);
+			exit(-1);
+		}
+
+		pq_group_free(group);
+	}
+}
+
+void *prio_consumer(void *arg)
+{
+	(void) arg;
+
+	return pq_prio_pop(prio, 0);
+}
+
+void *prio_producer(void *arg)
+{
+	int level;
+
+	level = (int) (intptr_t) arg;
+
+	for ( __u64 i = 1 ; i <= MPMC_ITERATIONS ; i++ )
+		while (pq_prio_push(prio, (void*) i, level) != 0)
+			sched_yield();
+
+	return NULL;
+}
+
+/* Priority levels behind one wait point */
+void prios()
+{
+	pthread_t threads[MPMC_THREADS];
+	struct pq_attr attr;
+	__u64 val, sum, expected;
+	int levels[4] = { 3, 1, 2, 0 };
+
+	printf("=============================\n");
+	printf("priority queue\n");
+
+	if (pq_prio_init(0, QUEUE_CAPACITY, 0, NULL) != NULL || 
+		pq_prio_init(PQ_PRIO_LEVELS + 1, QUEUE_CAPACITY, 0, NULL) != NULL || errno != EINVAL) {
+		printf("%s accepted a bad level count\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	// Levels in order, each level in FIFO order
+	prio = pq_prio_init(4, QUEUE_CAPACITY, 0, NULL);
+	for ( int i = 0 ; i < 8 ; i++ )
+		pq_prio_push(prio, (void*) (__u64) (levels[i % 4] * 100 + i), levels[i % 4]);
+	if (pq_prio_push(prio, NULL, 4) == 0 || errno != EINVAL || pq_prio_len(prio) != 8) {
+		printf("%s bad level accepted\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	expected = 0;
+	for ( int i = 0 ; i < 8 ; i++ ) {
+		val = (__u64) pq_prio_pop(prio, 0);
+		if (val < expected) {
+			printf("%s popped %llu after %llu\n", __FUNCTION__, 
+				(unsigned long long) val, (unsigned long long) expected);
+			exit(-1);
+		}
+		expected = val;
+	}
+	if (pq_prio_pop(prio, 0) != NULL || errno != EAGAIN || prio->bitmap != 0) {
+		printf("%s not empty\n", __FUNCTION__);
+		exit(-1);
+	}
+	pq_prio_free(prio);
+
+	// Every fourth pop serves the bulk level
+	prio = pq_prio_init(4, QUEUE_CAPACITY, 4, NULL);
+	for ( int i = 0 ; i < QUEUE_CAPACITY ; i++ ) {
+		pq_prio_push(prio, (void*) 1, 0);
+		pq_prio_push(prio, (void*) 2, 3);
+	}
+	for ( int i = 1 ; i <= QUEUE_CAPACITY ; i++ ) {
+		if ((__u64) pq_prio_pop(prio, 0) != ((i % 4) ? 1 : 2)) {
+			printf("%s bulk level starved at pop %d\n", __FUNCTION__, i);
+			exit(-1);
+		}
+	}
+	pq_prio_free(prio);
+
+	// A level whose mutex is held is waited for, not passed over
+	prio = pq_prio_init(4, QUEUE_CAPACITY, 0, NULL);
+	pq_prio_push(prio, (void*) 1, 0);
+	pq_prio_push(prio, (void*) 2, 3);
+	pthread_mutex_lock(&prio->queues[0]->mtx);
+	pthread_create(&threads[0], NULL, prio_consumer, NULL);
+	usleep(10000);
+	pthread_mutex_unlock(&prio->queues[0]->mtx);
+	pthread_join(threads[0], (void**) &val);
+	if (val != 1 || pq_prio_len(prio) != 1) {
+		printf("%s popped %llu past a contended level\n", __FUNCTION__, (unsigned long long) val);
+		exit(-1);
+	}
+	pq_prio_free(prio);
+
+	// A parked consumer wakes on any level
+	pq_attr_init(&attr);
+	for ( int engine = PQ_ENGINE_MUTEX ; engine < PQ_ENGINE_MAX ; engine++ ) {
+		if (engine == PQ_ENGINE_SPSC)
+			continue;
+
+		attr.engine = engine;
+		prio = pq_prio_init(MPMC_THREADS, QUEUE_CAPACITY, 0, &attr);
+		for ( int i = 0 ; i < MPMC_THREADS ; i++ )
+			pthread_create(&threads[i], NULL, prio_producer, (void*) (intptr_t) i);
+
+		sum = 0;
+		for ( int i = 0 ; i < MPMC_THREADS * MPMC_ITERATIONS ; i++ )
+			sum += (__u64) pq_prio_pop(prio, 1);
+
+		for ( int i = 0 ; i < MPMC_THREADS ; i++ )
+			pthread_join(threads[i], NULL);
+
+		expected = (__u64) MPMC_THREADS * MPMC_ITERATIONS * (MPMC_ITERATIONS + 1) / 2;
+		if (sum != expected || pq_prio_len(prio) != 0) {
+			printf("%s engine %d sum %llu expected %llu\n", __FUNCTION__, engine, 
+				(unsigned long long) sum, (unsigned long long) expected);
+			exit(-1);
+		}
+		pq_prio_free(prio);
+	}
+}
+
+void *poll_producer(void *arg)
+{
+	struct ptr_queue **queues;
+
+	queues = (struct ptr_queue**) arg;
+
+	for ( __u64 i = 1 ; i <= STRESS_ITERATIONS ; i++ )
+		while (pq_push(queues[i % POLL_QUEUES], (void*) i) != 0)
+			sched_yield();
+
+	return NULL;
+}
+
+/* Push and pop on a queue until told to stop */
+void *poll_churner(void *arg)
+{
+	struct ptr_queue *pq;
+
+	pq = (struct ptr_queue*) arg;
+
+	while (!__atomic_load_n(&poll_stop, __ATOMIC_RELAXED)) {
+		pq_push(pq, (void*) 1);
+		pq_pop(pq, 0);
+	}
+
+	return NULL;
+}
+
+/* Return 1 if a descriptor is readable right now */
+int readable(int fd)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+/* Wait on several queues at once, and on a queue through an eventfd */
+void polls()
+{
+	struct ptr_queue *queues[POLL_QUEUES];
+	struct pq_poll *p;
+	struct timespec ts;
+	pthread_t thread, threads[POLL_QUEUES];
+	__u64 sum, expected, val;
+	void *ptr;
+	int i, fd;
+
+	printf("=============================\n");
+	printf("poll\n");
+
+	queues[PQ_ENGINE_MUTEX] = pq_init(QUEUE_CAPACITY, 0);
+	queues[PQ_ENGINE_SPSC] = pq_init_spsc(QUEUE_CAPACITY, 0);
+	queues[PQ_ENGINE_MPMC] = pq_init_mpmc(QUEUE_CAPACITY, 0);
+
+	p = pq_poll_init(queues, POLL_QUEUES);
+	if (p == NULL || pq_poll_init(&queues[1], 1) != NULL || errno != EBUSY) {
+		printf("%s queue registered twice\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 10000000;
+	if (pq_poll_wait(p, &ts, 0) != -1 || errno != ETIMEDOUT) {
+		printf("%s empty set did not time out\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	ts.tv_nsec = 1000000000L;
+	if (pq_poll_wait(p, &ts, 0) != -1 || errno != EINVAL) {
+		printf("%s accepted tv_nsec %ld\n", __FUNCTION__, ts.tv_nsec);
+		exit(-1);
+	}
+	ts.tv_nsec = 10000000;
+
+	pq_push(queues[PQ_ENGINE_MPMC], (void*) 1);
+	if (pq_poll_wait(p, &ts, 0) != PQ_ENGINE_MPMC) {
+		printf("%s non empty queue not found\n", __FUNCTION__);
+		exit(-1);
+	}
+	pq_pop(queues[PQ_ENGINE_MPMC], 0);
+
+	// A single consumer sleeps on the set while one producer feeds all queues
+	pthread_create(&thread, NULL, poll_producer, queues);
+
+	sum = 0;
+	for ( int n = 0 ; n < STRESS_ITERATIONS ; ) {
+		i = pq_poll_wait(p, NULL, 0);
+		while ((ptr = pq_pop(queues[i], 0)) != NULL) {
+			sum += (__u64) ptr;
+			n++;
+		}
+	}
+
+	pthread_join(thread, NULL);
+
+	expected = (__u64) STRESS_ITERATIONS * (STRESS_ITERATIONS + 1) / 2;
+	if (sum != expected) {
+		printf("%s sum %llu expected %llu\n", __FUNCTION__, 
+			(unsigned long long) sum, (unsigned long long) expected);
+		exit(-1);
+	}
+
+	pq_poll_free(p);
+
+	// Sets come and go while producers keep notifying them
+	poll_stop = 0;
+	for ( i = 0 ; i < POLL_QUEUES ; i++ )
+		pthread_create(&threads[i], NULL, poll_churner, queues[i]);
+	for ( int n = 0 ; n < POLL_ROUNDS ; n++ ) {
+		p = pq_poll_init(queues, POLL_QUEUES);
+		if (p == NULL || pq_poll_free(p) != 0) {
+			printf("%s set %d not registered and freed\n", __FUNCTION__, n);
+			exit(-1);
+		}
+	}
+	__atomic_store_n(&poll_stop, 1, __ATOMIC_RELAXED);
+	for ( i = 0 ; i < POLL_QUEUES ; i++ )
+		pthread_join(threads[i], NULL);
+
+	// The eventfd signals once per arming
+	for ( i = 0 ; i < POLL_QUEUES ; i++ ) {
+		fd = pq_eventfd(queues[i]);
+		if (fd < 0 || pq_eventfd(queues[i]) != fd || readable(fd)) {
+			printf("%s bad eventfd %d\n", __FUNCTION__, fd);
+			exit(-1);
+		}
+
+		pq_push(queues[i], (void*) 1);
+		pq_push(queues[i], (void*) 2);
+		if (!readable(fd) || read(fd, &val, sizeof(val)) != sizeof(val) || val != 1) {
+			printf("%s eventfd not signaled\n", __FUNCTION__);
+			exit(-1);
+		}
+
+		// Entries pushed before re-arming signal at once
+		pq_pop(queues[i], 0);
+		pq_eventfd_arm(queues[i]);
+		if (!readable(fd) || read(fd, &val, sizeof(val)) != sizeof(val)) {
+			printf("%s eventfd missed an entry\n", __FUNCTION__);
+			exit(-1);
+		}
+
+		pq_pop(queues[i], 0);
+		pq_eventfd_arm(queues[i]);
+		if (readable(fd)) {
+			printf("%s empty queue signaled\n", __FUNCTION__);
+			exit(-1);
+		}
+
+		pq_free(queues[i]);
+	}
+}
+
+void *bcast_reader(void *arg)
+{
+	__u64 val, prev, count;
+	int id;
+
+	id = (int) (intptr_t) arg;
+	prev = 0;
+	count = 0;
+
+	// Every reader sees the entries in order, with gaps only when dropping
+	while (prev < MPMC_ITERATIONS) {
+		val = (__u64) pq_bcast_pop(bcast_ring, id, 1);
+		if (val <= prev || (bcast_ring->policy == PQ_BCAST_BLOCK && val != prev + 1)) {
+			printf("%s reader %d read %llu after %llu\n", __FUNCTION__, id, 
+				(unsigned long long) val, (unsigned long long) prev);
+			exit(-1);
+		}
+		prev = val;
+		count++;
+	}
+
+	if (count + pq_bcast_dropped(bcast_ring, id) != MPMC_ITERATIONS) {
+		printf("%s reader %d read %llu and dropped %u\n", __FUNCTION__, id, 
+			(unsigned long long) count, pq_bcast_dropped(bcast_ring, id));
+		exit(-1);
+	}
+
+	return NULL;
+}
+
+/* One producer, every reader sees every entry */
+void bcast()
+{
+	pthread_t threads[MPMC_THREADS];
+	int ids[MPMC_THREADS];
+	int a, b;
+
+	printf("=============================\n");
+	printf("broadcast ring\n");
+
+	if (pq_bcast_init(0, 1, PQ_BCAST_BLOCK) != NULL || 
+		pq_bcast_init(QUEUE_CAPACITY, 0, PQ_BCAST_BLOCK) != NULL || 
+		pq_bcast_init(QUEUE_CAPACITY, 1, PQ_BCAST_MAX) != NULL || errno != EINVAL) {
+		printf("%s accepted bad arguments\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	// The slowest reader holds the producer back until it leaves
+	bcast_ring = pq_bcast_init(QUEUE_CAPACITY, 2, PQ_BCAST_BLOCK);
+	a = pq_bcast_join(bcast_ring);
+	b = pq_bcast_join(bcast_ring);
+	if (a < 0 || b < 0 || pq_bcast_join(bcast_ring) >= 0 || errno != EBUSY) {
+		printf("%s bad join\n", __FUNCTION__);
+		exit(-1);
+	}
+	for ( __u64 i = 1 ; i <= bcast_ring->capacity ; i++ )
+		pq_bcast_push(bcast_ring, (void*) i, 0);
+	if (pq_bcast_push(bcast_ring, (void*) 1, 0) == 0 || errno != ENOMEM) {
+		printf("%s pushed past the slowest reader\n", __FUNCTION__);
+		exit(-1);
+	}
+	for ( __u64 i = 1 ; i <= bcast_ring->capacity ; i++ ) {
+		if ((__u64) pq_bcast_pop(bcast_ring, a, 0) != i) {
+			printf("%s reader %d out of order\n", __FUNCTION__, a);
+			exit(-1);
+		}
+	}
+	if (pq_bcast_pop(bcast_ring, a, 0) != NULL || errno != EAGAIN || 
+		pq_bcast_push(bcast_ring, (void*) 1, 0) == 0) {
+		printf("%s reader %d not caught up\n", __FUNCTION__, a);
+		exit(-1);
+	}
+	pq_bcast_leave(bcast_ring, b);
+	if (pq_bcast_push(bcast_ring, (void*) 1, 0) != 0 || 
+		pq_bcast_pop(bcast_ring, b, 0) != NULL || errno != EINVAL) {
+		printf("%s reader %d still holds the producer\n", __FUNCTION__, b);
+		exit(-1);
+	}
+	pq_bcast_free(bcast_ring);
+
+	// A lapped reader skips to the oldest entry left
+	bcast_ring = pq_bcast_init(QUEUE_CAPACITY, 1, PQ_BCAST_DROP);
+	a = pq_bcast_join(bcast_ring);
+	for ( __u64 i = 1 ; i <= 40 ; i++ )
+		pq_bcast_push(bcast_ring, (void*) i, 0);
+	for ( __u64 i = 40 - bcast_ring->capacity + 2 ; i <= 40 ; i++ ) {
+		if ((__u64) pq_bcast_pop(bcast_ring, a, 0) != i) {
+			printf("%s lapped reader did not skip to %llu\n", __FUNCTION__, 
+				(unsigned long long) i);
+			exit(-1);
+		}
+	}
+	if (pq_bcast_dropped(bcast_ring, a) != 40 - bcast_ring->capacity + 1) {
+		printf("%s dropped %u\n", __FUNCTION__, pq_bcast_dropped(bcast_ring, a));
+		exit(-1);
+	}
+	if (pq_bcast_dropped(bcast_ring, 1) != 0 || errno != EINVAL) {
+		printf("%s dropped of reader slot 1 of 1\n", __FUNCTION__);
+		exit(-1);
+	}
+	pq_bcast_leave(bcast_ring, a);
+	a = pq_bcast_join(bcast_ring);
+	if (pq_bcast_dropped(bcast_ring, a) != 0) {
+		printf("%s dropped kept across a join\n", __FUNCTION__);
+		exit(-1);
+	}
+	pq_bcast_free(bcast_ring);
+
+	// Threaded, both policies
+	for ( int policy = 0 ; policy < PQ_BCAST_MAX ; policy++ ) {
+		bcast_ring = pq_bcast_init(QUEUE_CAPACITY, MPMC_THREADS, policy);
+		for ( int i = 0 ; i < MPMC_THREADS ; i++ ) {
+			ids[i] = pq_bcast_join(bcast_ring);
+			pthread_create(&threads[i], NULL, bcast_reader, (void*) (intptr_t) ids[i]);
+		}
+
+		for ( __u64 i = 1 ; i <= MPMC_ITERATIONS ; i++ )
+			pq_bcast_push(bcast_ring, (void*) i, 1);
+
+		for ( int i = 0 ; i < MPMC_THREADS ; i++ )
+			pthread_join(threads[i], NULL);
+
+		printf("%s policy %d pass\n", __FUNCTION__, policy);
+		pq_bcast_free(bcast_ring);
+	}
+}
+
+void *stats_consumer(void *arg)
+{
+	return pq_pop((struct ptr_queue *) arg, 1);
+}
+
+void *stats_trypop(void *arg)
+{
+	return pq_pop((struct ptr_queue *) arg, 0);
+}
+
+/* Counters of a PQ_ATTR_STATS queue, every engine */
+void stats()
+{
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+	struct pq_stats s;
+	pthread_t thread;
+	void **span;
+	void *ret;
+	__u32 cap;
+
+	printf("=============================\n");
+	printf("stats\n");
+
+	pq = pq_init(QUEUE_CAPACITY, 0);
+	if (pq_stats(pq, &s) == 0 || errno != ENOTSUP) {
+		printf("%s counters without PQ_ATTR_STATS\n", __FUNCTION__);
+		exit(-1);
+	}
+	pq_free(pq);
+
+	for ( int engine = 0 ; engine < PQ_ENGINE_MAX ; engine++ ) {
+		pq_attr_init(&attr);
+		attr.engine = engine;
+		attr.flags = PQ_ATTR_STATS;
+		pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+
+		// Fill, overfill, drain and overdrain. A chunked queue is never full
+		cap = (engine == PQ_ENGINE_CHUNKED) ? QUEUE_CAPACITY : pq->user_capacity;
+		for ( __u64 i = 1 ; i <= cap + 1 ; i++ )
+			pq_push(pq, (void*) i);
+		for ( __u32 i = 0 ; i <= cap + 1 ; i++ )
+			pq_pop(pq, 0);
+
+		pq_stats(pq, &s);
+		if (s.pushes != cap + (engine == PQ_ENGINE_CHUNKED) || 
+			s.pops != s.pushes || s.empty != 1 + (engine != PQ_ENGINE_CHUNKED) ||
+			s.full != (engine != PQ_ENGINE_CHUNKED) || s.high_water != s.pushes) {
+			printf("%s engine %d pushes %llu pops %llu full %llu empty %llu high %u\n", 
+				__FUNCTION__, engine, (unsigned long long) s.pushes, 
+				(unsigned long long) s.pops, (unsigned long long) s.full, 
+				(unsigned long long) s.empty, s.high_water);
+			exit(-1);
+		}
+
+		// A non blocking pop that finds the consumer mutex taken waits for it
+		if (engine == PQ_ENGINE_MUTEX || engine == PQ_ENGINE_CHUNKED) {
+			pq_push(pq, (void*) 1);
+			pthread_mutex_lock(&pq->mtx);
+			pthread_create(&thread, NULL, stats_trypop, pq);
+			usleep(10000);
+			pthread_mutex_unlock(&pq->mtx);
+			pthread_join(thread, &ret);
+			if (ret != (void*) 1) {
+				printf("%s engine %d pop failed on a taken mutex\n", __FUNCTION__, engine);
+				exit(-1);
+			}
+			pq_stats(pq, &s);
+			if (s.trylock_fails != 1) {
+				printf("%s engine %d trylock failures %llu\n", __FUNCTION__, engine, 
+					(unsigned long long) s.trylock_fails);
+				exit(-1);
+			}
+		}
+
+		// A NULL entry counts as a pop, whatever errno was before
+		pq_stats_reset(pq);
+		pq_push(pq, NULL);
+		errno = EAGAIN;
+		pq_pop(pq, 0);
+		pq_stats(pq, &s);
+		if (s.pops != 1 || s.empty != 0) {
+			printf("%s engine %d NULL entry pops %llu empty %llu\n", __FUNCTION__, engine, 
+				(unsigned long long) s.pops, (unsigned long long) s.empty);
+			exit(-1);
+		}
+
+		// Reserved and peeked spans count like pushes and pops
+		if (engine == PQ_ENGINE_SPSC || engine == PQ_ENGINE_MPMC) {
+			pq_stats_reset(pq);
+			pq_commit(pq, span, pq_reserve(pq, &span, 3));
+			pq_release(pq, span, pq_peek_n(pq, &span, 3, 0));
+			pq_stats(pq, &s);
+			if (s.pushes != 3 || s.pops != 3 || s.high_water != 3) {
+				printf("%s engine %d span pushes %llu pops %llu high %u\n", __FUNCTION__, engine, 
+					(unsigned long long) s.pushes, (unsigned long long) s.pops, s.high_water);
+				exit(-1);
+			}
+		}
+
+		/* A parked consumer is counted and timed, and so is its wakeup. The 
+		 * lock-free engines sample the length after publishing, by then the 
+		 * consumer may have taken the entry 
+		 */
+		pq_stats_reset(pq);
+		pthread_create(&thread, NULL, stats_consumer, pq);
+		while (__atomic_load_n(&pq->waiting, __ATOMIC_ACQUIRE) == 0)
+			sched_yield();
+		pq_push(pq, (void*) 1);
+		pthread_join(thread, &ret);
+
+		pq_stats(pq, &s);
+		if (ret != (void*) 1 || s.waits == 0 || s.wait_ns == 0 || s.signals == 0 || 
+			s.pushes != 1 || s.pops != 1 || s.high_water > 1) {
+			printf("%s engine %d waits %llu wait_ns %llu signals %llu pushes %llu pops %llu high %u\n", 
+				__FUNCTION__, engine, (unsigned long long) s.waits, 
+				(unsigned long long) s.wait_ns, (unsigned long long) s.signals, 
+				(unsigned long long) s.pushes, (unsigned long long) s.pops, s.high_water);
+			exit(-1);
+		}
+
+		pq_print(pq);
+		pq_free(pq);
+	}
+
+	// So do messages built or read in place
+	pq_attr_init(&attr);
+	attr.engine = PQ_ENGINE_SPSC;
+	attr.flags = PQ_ATTR_STATS;
+	attr.msg_size = sizeof(__u64);
+	pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+	*(__u64*) pq_msg_reserve(pq) = 1;
+	pq_msg_commit(pq);
+	pq_msg_peek(pq, 0);
+	pq_msg_release(pq);
+	pq_stats(pq, &s);
+	if (s.pushes != 1 || s.pops != 1 || s.high_water != 1) {
+		printf("%s message pushes %llu pops %llu high %u\n", __FUNCTION__, 
+			(unsigned long long) s.pushes, (unsigned long long) s.pops, s.high_water);
+		exit(-1);
+	}
+	pq_free(pq);
+}
+
+/* Sojourn time histogram of a PQ_ATTR_LATENCY queue */
+void latency()
+{
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+	struct pq_latency lat;
+	void *ptrs[QUEUE_CAPACITY];
+	__u64 ns;
+
+	printf("=============================\n");
+	printf("latency\n");
+
+	pq_attr_init(&attr);
+	attr.flags = PQ_ATTR_LATENCY;
+	attr.engine = PQ_ENGINE_CHUNKED;
+	if (pq_init_attr(QUEUE_CAPACITY, 0, &attr) != NULL || errno != EINVAL) {
+		printf("%s chunked engine accepted\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	for ( int engine = 0 ; engine < PQ_ENGINE_CHUNKED ; engine++ ) {
+		attr.engine = engine;
+		pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+
+		// Entries wait 2ms, half of them pushed and popped in batches
+		for ( __u64 i = 0 ; i < QUEUE_CAPACITY ; i++ )
+			ptrs[i] = (void*) (i + 1);
+		pq_push_n(pq, ptrs, QUEUE_CAPACITY / 2);
+		for ( __u64 i = QUEUE_CAPACITY / 2 ; i < QUEUE_CAPACITY ; i++ )
+			pq_push(pq, ptrs[i]);
+		usleep(2000);
+		pq_pop_n(pq, ptrs, QUEUE_CAPACITY / 2, 0);
+		for ( int i = QUEUE_CAPACITY / 2 ; i < QUEUE_CAPACITY ; i++ )
+			pq_pop(pq, 0);
+
+		// One entry that does not wait at all
+		pq_push(pq, (void*) 1);
+		pq_pop(pq, 0);
+
+		pq_latency(pq, &lat);
+		if (lat.count != QUEUE_CAPACITY + 1 || lat.p50 < 2000000 || 
+			lat.p50 > lat.p99 || lat.p99 > lat.max || lat.max > 1000000000 || 
+			pq_latency_quantile(pq, 0.0, &ns) != 0 || ns >= 2000000) {
+			printf("%s engine %d count %llu p50 %llu p99 %llu max %llu min %llu\n", 
+				__FUNCTION__, engine, (unsigned long long) lat.count, 
+				(unsigned long long) lat.p50, (unsigned long long) lat.p99, 
+				(unsigned long long) lat.max, (unsigned long long) ns);
+			exit(-1);
+		}
+
+		pq_latency_reset(pq);
+		pq_latency(pq, &lat);
+		if (lat.count != 0 || lat.p99 != 0 || pq_latency_quantile(pq, 2.0, &ns) == 0) {
+			printf("%s engine %d not reset\n", __FUNCTION__, engine);
+			exit(-1);
+		}
+
+		printf("%s engine %d pass\n", __FUNCTION__, engine);
+		pq_free(pq);
+	}
+}
+
+void *inline_producer(void *arg)
+{
+	struct ptr_queue *pq;
+
+	pq = (struct ptr_queue *) arg;
+
+	for ( __u64 i = 1 ; i <= MPMC_ITERATIONS ; i++ )
+		while (pq_push_inline(pq, (void*) i) != 0)
+			sched_yield();
+
+	return NULL;
+}
+
+/* Header inline fast path, and its fallback to the library */
+void inlined()
+{
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+	pthread_t thread;
+	__u64 val, expect;
+
+	printf("=============================\n");
+	printf("inline fast path\n");
+
+	for ( int engine = 0 ; engine < PQ_ENGINE_MAX ; engine++ ) {
+		pq_attr_init(&attr);
+		attr.engine = engine;
+		attr.flags = PQ_ATTR_POW2;
+		pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+		if (pq->fast_path != (engine == PQ_ENGINE_SPSC || engine == PQ_ENGINE_MPMC)) {
+			printf("%s engine %d fast_path %d\n", __FUNCTION__, engine, pq->fast_path);
+			exit(-1);
+		}
+
+		// Full and empty fall back to the library, which sets errno
+		if (engine != PQ_ENGINE_CHUNKED) {
+			for ( __u32 i = 0 ; i < pq->user_capacity ; i++ )
+				pq_push_inline(pq, (void*) 1);
+			if (pq_push_inline(pq, (void*) 1) == 0 || errno != ENOMEM) {
+				printf("%s engine %d pushed into a full queue\n", __FUNCTION__, engine);
+				exit(-1);
+			}
+			while (pq_pop_inline(pq, 0) != NULL)
+				;
+		}
+		if (pq_pop_inline(pq, 0) != NULL || errno != EAGAIN) {
+			printf("%s engine %d popped from an empty queue\n", __FUNCTION__, engine);
+			exit(-1);
+		}
+
+		// A consumer parked in the library is woken by an inline push
+		pthread_create(&thread, NULL, inline_producer, pq);
+		expect = 1;
+		for ( int i = 0 ; i < MPMC_ITERATIONS ; i++ ) {
+			val = (__u64) pq_pop_inline(pq, 1);
+			if (val != expect++) {
+				printf("%s engine %d popped %llu\n", __FUNCTION__, engine, 
+					(unsigned long long) val);
+				exit(-1);
+			}
+		}
+		pthread_join(thread, NULL);
+
+		printf("%s engine %d pass\n", __FUNCTION__, engine);
+		pq_free(pq);
+	}
+}
+
+/* Queues that grow when full and shrink back when idle */
+void grow()
+{
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+	void *ptrs[QUEUE_CAPACITY * 16];
+	__u64 next, expect;
+
+	printf("=============================\n");
+	printf("grow\n");
+
+	pq_attr_init(&attr);
+	attr.max_count = QUEUE_CAPACITY * 8;
+
+	attr.engine = PQ_ENGINE_SPSC;
+	if (pq_init_attr(QUEUE_CAPACITY, 0, &attr) != NULL || errno != EINVAL) {
+		printf("%s lock-free engine accepted\n", __FUNCTION__);
+		exit(-1);
+	}
+	attr.engine = PQ_ENGINE_MUTEX;
+
+	for ( int round = 0 ; round < 2 ; round++ ) {
+		attr.flags = round ? PQ_ATTR_POW2 | PQ_ATTR_SHRINK : PQ_ATTR_SHRINK;
+		pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+		if (pq == NULL) {
+			printf("%s init failed\n", __FUNCTION__);
+			exit(-1);
+		}
+
+		// Move head off slot 0 so the first growth copies across the wrap
+		next = expect = 1;
+		for ( int i = 0 ; i < QUEUE_CAPACITY / 2 ; i++ )
+			pq_push(pq, (void*) next++);
+		for ( int i = 0 ; i < QUEUE_CAPACITY / 2 ; i++ )
+			if ((__u64) pq_pop(pq, 0) != expect++) {
+				printf("%s bad entry before growth\n", __FUNCTION__);
+				exit(-1);
+			}
+
+		// Fill up to the limit without blocking, part of it in one batch
+		while (pq_push(pq, (void*) next) == 0)
+			next++;
+		if (errno != ENOMEM || pq->user_capacity != pq->max_capacity || 
+			(__u64) pq_len(pq) != next - expect) {
+			printf("%s grew to %u of %u\n", __FUNCTION__, pq->user_capacity, pq->max_capacity);
+			exit(-1);
+		}
+
+		for ( __u64 i = expect ; i < next ; i++ )
+			if ((__u64) pq_pop(pq, 0) != i) {
+				printf("%s bad entry after growth\n", __FUNCTION__);
+				exit(-1);
+			}
+		expect = next;
+
+		// Low occupancy for long enough shrinks the ring step by step
+		for ( int i = 0 ; i < ITERATIONS ; i++ ) {
+			pq_push(pq, (void*) next++);
+			if ((__u64) pq_pop(pq, 0) != expect++) {
+				printf("%s bad entry while shrinking\n", __FUNCTION__);
+				exit(-1);
+			}
+		}
+		if (pq->user_capacity != pq->min_capacity) {
+			printf("%s did not shrink: %u\n", __FUNCTION__, pq->user_capacity);
+			exit(-1);
+		}
+
+		// A batch larger than the ring grows it in one step
+		for ( __u32 i = 0 ; i < pq->max_capacity ; i++ )
+			ptrs[i] = (void*) next++;
+		if (pq_push_n(pq, ptrs, pq->max_capacity) != (__s32) pq->max_capacity) {
+			printf("%s batch did not grow the queue\n", __FUNCTION__);
+			exit(-1);
+		}
+		for ( __u32 i = 0 ; i < pq->max_capacity ; i++ )
+			if ((__u64) pq_pop(pq, 0) != expect++) {
+				printf("%s bad entry after batch\n", __FUNCTION__);
+				exit(-1);
+			}
+
+		pq_free(pq);
+	}
+
+	// Threads keep their order while the ring grows and shrinks under them
+	attr.flags = PQ_ATTR_SHRINK;
+	attr.max_count = WARM_CAPACITY;
+	pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+	stress(pq);
+	pq_free(pq);
+}
+
+/* Queues and pools bound to NUMA nodes */
+void *numa_getter(void *arg)
+{
+	return pq_numa_pool_get((struct pq_numa_pool *) arg, 1);
+}
+
+void numa()
+{
+	struct ptr_queue *pq;
+	struct pq_numa_pool *np;
+	void *objs[QUEUE_CAPACITY];
+	pthread_t thread;
+	void *ret;
+	char stray;
+	int n;
+
+	printf("=============================\n");
+	printf("numa placement\n");
+
+	pq = pq_init_node(QUEUE_CAPACITY, 0, 0);
+
+	fill(pq);
+
+	empty(pq);
+
+	iterate(pq);
+
+	pq_free(pq);
+
+	pq = pq_init_node(QUEUE_CAPACITY, 64, PQ_NUMA_LOCAL);
+	if (pq == NULL || pq->numa_node < 0 || pq_len(pq) != QUEUE_CAPACITY) {
+		printf("%s local pool failed\n", __FUNCTION__);
+		exit(-1);
+	}
+	pq_free(pq);
+
+	if (pq_init_node(QUEUE_CAPACITY, 0, PQ_NUMA_NODES) != NULL) {
+		printf("%s accepted a bad node\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	np = pq_numa_pool_init(2, 64, NULL);
+	if (np == NULL || np->nodes * 2 > QUEUE_CAPACITY) {
+		printf("%s numa pool failed\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	// Drain the local node first, then the remote ones
+	for ( n = 0 ; n < QUEUE_CAPACITY ; n++ ) {
+		objs[n] = pq_numa_pool_get(np, 0);
+		if (objs[n] == NULL)
+			break;
+	}
+	if (n != np->nodes * 2) {
+		printf("%s bad object count %d\n", __FUNCTION__, n);
+		exit(-1);
+	}
+
+	if (pq_numa_pool_get(np, 0) != NULL || errno != EAGAIN) {
+		printf("%s pool not exhausted after %d objects\n", __FUNCTION__, n);
+		exit(-1);
+	}
+
+	if (pq_numa_pool_put(np, &stray) == 0) {
+		printf("%s accepted a foreign object\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	for ( int i = 0 ; i < n ; i++ ) {
+		if (pq_numa_pool_put(np, objs[i]) != 0) {
+			printf("%s put failed\n", __FUNCTION__);
+			exit(-1);
+		}
+	}
+
+	pq_numa_pool_free(np);
+
+	/* A blocked get wakes when an object is put back to any node. Two single
+	 * object pools stand in for two nodes, one of them is remote
+	 */
+	np = (struct pq_numa_pool *) calloc(1, sizeof(*np));
+	np->nodes = 2;
+	np->pools = (struct ptr_queue **) calloc(2, sizeof(struct ptr_queue *));
+	for ( int i = 0 ; i < 2 ; i++ ) {
+		np->pools[i] = pq_init(1, 64);
+		objs[i] = pq_pool_get(np->pools[i], 0);
+	}
+	for ( int i = 0 ; i < 2 ; i++ ) {
+		pthread_create(&thread, NULL, numa_getter, np);
+		usleep(10000);
+		pq_numa_pool_put(np, objs[i]);
+		pthread_join(thread, &ret);
+		if (ret != objs[i]) {
+			printf("%s get missed a put to node %d\n", __FUNCTION__, i);
+			exit(-1);
+		}
+	}
+	pq_numa_pool_free(np);
+}
+
+void pool()
+{
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+	void *objs[QUEUE_CAPACITY];
+	char stray;
+
+	printf("=============================\n");
+	printf("object pool\n");
+
+	pq_attr_init(&attr);
+	attr.flags = PQ_ATTR_OBJ_PAD | PQ_ATTR_POOL_CHECK;
+
+	for ( attr.engine = PQ_ENGINE_MUTEX ; attr.engine < PQ_ENGINE_MAX ; attr.engine++ ) {
+		pq = pq_init_attr(QUEUE_CAPACITY, 24, &attr);
+		if (pq == NULL || pq->obj_stride != PQ_CACHELINE) {
+			printf("%s bad stride\n", __FUNCTION__);
+			exit(-1);
+		}
+
+		pool_drain(pq, objs, QUEUE_CAPACITY, PQ_CACHELINE);
+
+		if (pq_pool_put(pq, &stray) == 0 || errno != EINVAL ||
+			pq_pool_put(pq, (char*) objs[0] + 8) == 0 || 
+			pq_pool_put(pq, (char*) pq->buf + pq->buf_size) == 0) {
+			printf("%s accepted a foreign object\n", __FUNCTION__);
+			exit(-1);
+		}
+
+		for ( int i = 0 ; i < QUEUE_CAPACITY ; i++ )
+			pq_pool_put(pq, objs[i]);
+
+		if (pq_len(pq) != QUEUE_CAPACITY) {
+			printf("%s bad length %d\n", __FUNCTION__, pq_len(pq));
+			exit(-1);
+		}
+
+		pq_free(pq);
+	}
+
+	attr.engine = PQ_ENGINE_MUTEX;
+	attr.flags = PQ_ATTR_HUGEPAGE;
+	attr.obj_align = 256;
+
+	pq = pq_init_attr(QUEUE_CAPACITY, 1500, &attr);
+	if (pq == NULL || pq->obj_stride != 1536) {
+		printf("%s hugepage pool failed\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	pool_drain(pq, objs, QUEUE_CAPACITY, 256);
+
+	for ( int i = 0 ; i < QUEUE_CAPACITY ; i++ )
+		pq_pool_put(pq, objs[i]);
+
+	pq_free(pq);
+
+	attr.obj_align = 48;
+	if (pq_init_attr(QUEUE_CAPACITY, 64, &attr) != NULL) {
+		printf("%s accepted a bad alignment\n", __FUNCTION__);
+		exit(-1);
+	}
+}
+
+void *pool_worker(void *arg)
+{
+	struct ptr_queue *pq;
+	void *objs[MAG_SIZE];
+
+	pq = (struct ptr_queue*) arg;
+
+	for ( int i = 0 ; i < ITERATIONS ; i++ ) {
+		for ( int j = 0 ; j < MAG_SIZE ; j++ )
+			objs[j] = pq_pool_get(pq, 1);
+		for ( int j = 0 ; j < MAG_SIZE ; j++ )
+			pq_pool_put(pq, objs[j]);
+	}
+
+	// The magazine is flushed when the thread exits
+	return NULL;
+}
+
+void *pool_trygetter(void *arg)
+{
+	return pq_pool_get((struct ptr_queue*) arg, 0);
+}
+
+/* Share a pool with per thread magazines between threads */
+void pool_mag()
+{
+	struct ptr_queue **pools;
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+	pthread_t threads[MPMC_THREADS];
+	void *obj;
+
+	printf("=============================\n");
+	printf("object pool magazines\n");
+
+	pq_attr_init(&attr);
+	attr.mag_size = MAG_SIZE;
+
+	for ( attr.engine = PQ_ENGINE_MUTEX ; attr.engine < PQ_ENGINE_MAX ; attr.engine += PQ_ENGINE_MPMC ) {
+		pq = pq_init_attr(MPMC_THREADS * MAG_SIZE * 2, 64, &attr);
+
+		for ( int i = 0 ; i < MPMC_THREADS ; i++ )
+			pthread_create(&threads[i], NULL, pool_worker, pq);
+		for ( int i = 0 ; i < MPMC_THREADS ; i++ )
+			pthread_join(threads[i], NULL);
+
+		if (pq_len(pq) != MPMC_THREADS * MAG_SIZE * 2) {
+			printf("%s objects lost %d\n", __FUNCTION__, pq_len(pq));
+			exit(-1);
+		}
+
+		// A get refills half a magazine, a put stays in the magazine
+		obj = pq_pool_get(pq, 0);
+		pq_pool_put(pq, obj);
+		if (pq_len(pq) != MPMC_THREADS * MAG_SIZE * 2 - MAG_SIZE / 2) {
+			printf("%s bad refill %d\n", __FUNCTION__, pq_len(pq));
+			exit(-1);
+		}
+
+		pq_pool_flush(pq);
+		if (pq_len(pq) != MPMC_THREADS * MAG_SIZE * 2) {
+			printf("%s bad flush %d\n", __FUNCTION__, pq_len(pq));
+			exit(-1);
+		}
+
+		pq_free(pq);
+	}
+
+	// A non blocking get waits for a pool lock held by another thread
+	pq = pq_init(QUEUE_CAPACITY, 64);
+	pthread_mutex_lock(&pq->mtx);
+	pthread_create(&threads[0], NULL, pool_trygetter, pq);
+	usleep(10000);
+	pthread_mutex_unlock(&pq->mtx);
+	pthread_join(threads[0], &obj);
+	if (obj == NULL) {
+		printf("%s get failed on a held lock\n", __FUNCTION__);
+		exit(-1);
+	}
+	pq_free(pq);
+
+	// Pools with magazines are not bounded by the pthread keys
+	attr.engine = PQ_ENGINE_MUTEX;
+	pools = (struct ptr_queue **) calloc(PTHREAD_KEYS_MAX + 1, sizeof(struct ptr_queue *));
+	for ( int i = 0 ; i <= PTHREAD_KEYS_MAX ; i++ ) {
+		pools[i] = pq_init_attr(1, 64, &attr);
+		if (pools[i] == NULL || pq_pool_get(pools[i], 0) == NULL) {
+			printf("%s pool %d with magazines failed %d\n", __FUNCTION__, i, errno);
+			exit(-1);
+		}
+	}
+	for ( int i = 0 ; i <= PTHREAD_KEYS_MAX ; i++ )
+		pq_free(pools[i]);
+	free(pools);
+}
+
+/* Check every page of a mapping is resident */
+void resident(void *addr, size_t len)
+{
+	unsigned char vec[len / 4096 + 1];
+
+	if (mincore(addr, len, vec) != 0) {
+		printf("%s mincore failed %d\n", __FUNCTION__, errno);
+		exit(-1);
+	}
+
+	for ( size_t i = 0 ; i < (len + 4095) / 4096 ; i++ ) {
+		if (!(vec[i] & 1)) {
+			printf("%s page %zu not resident\n", __FUNCTION__, i);
+			exit(-1);
+		}
+	}
+}
+
+void untouched(void *addr, size_t len)
+{
+	unsigned char vec[len / 4096 + 1];
+
+	if (mincore(addr, len, vec) != 0) {
+		printf("%s mincore failed %d\n", __FUNCTION__, errno);
+		exit(-1);
+	}
+
+	for ( size_t i = 0 ; i < (len + 4095) / 4096 ; i++ ) {
+		if (vec[i] & 1) {
+			printf("%s page %zu resident\n", __FUNCTION__, i);
+			exit(-1);
+		}
+	}
+}
+
+/* Pre-faulted, locked and huge page backed queues */
+void warm()
+{
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+
+	printf("=============================\n");
+	printf("pre-faulted queues\n");
+
+	pq_attr_init(&attr);
+	attr.flags = PQ_ATTR_PREFAULT;
+	attr.engine = PQ_ENGINE_MPMC;
+
+	pq = pq_init_attr(WARM_CAPACITY, 64, &attr);
+	if (pq == NULL || pq->data_map == 0 || pq->seq_map == 0 || pq->buf_map == 0) {
+		printf("%s mapping failed\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	resident(pq->data, pq->data_map);
+	resident(pq->seq, pq->seq_map);
+	resident(pq->buf, pq->buf_map);
+
+	pq_free(pq);
+
+	// Without flags a large ring is mapped but not committed up front
+	pq = pq_init(WARM_CAPACITY, 0);
+	if (pq == NULL || pq->data_map == 0) {
+		printf("%s large ring not mapped\n", __FUNCTION__);
+		exit(-1);
+	}
+	untouched(pq->data, pq->data_map);
+	pq_free(pq);
+
+	attr.flags = PQ_ATTR_HUGEPAGE | PQ_ATTR_PREFAULT | PQ_ATTR_MLOCK;
+
+	for ( attr.engine = PQ_ENGINE_MUTEX ; attr.engine < PQ_ENGINE_CHUNKED ; attr.engine++ ) {
+		pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+		if (pq == NULL || pq->data_map % PQ_HUGEPAGE_SIZE != 0) {
+			printf("%s huge page ring failed %d\n", __FUNCTION__, errno);
+			exit(-1);
+		}
+
+		resident(pq->data, pq->data_map);
+
+		fill(pq);
+
+		empty(pq);
+
+		stress(pq);
+
+		pq_free(pq);
+	}
+}
+
+void pow2()
+{
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+
+	printf("=============================\n");
+	printf("power of two capacity\n");
+
+	pq_attr_init(&attr);
+	attr.flags = PQ_ATTR_POW2;
+
+	for ( attr.engine = PQ_ENGINE_MUTEX ; attr.engine <= PQ_ENGINE_SPSC ; attr.engine++ ) {
+		pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+		if (pq_len(pq) != 0 || pq->user_capacity != 16) {
+			printf("%s bad capacity %u\n", __FUNCTION__, pq->user_capacity);
+			exit(-1);
+		}
+
+		fill(pq);
+
+		if (pq_len(pq) != 16) {
+			printf("%s bad length %d\n", __FUNCTION__, pq_len(pq));
+			exit(-1);
+		}
+
+		empty(pq);
+
+		iterate(pq);
+
+		batch(pq);
+
+		stress(pq);
+
+	backpressure(pq);
+
+	timed(pq);
+
+		pq_free(pq);
+	}
+}
+
+/* Run the blocking tests with the spinning wait strategies */
+void strategies()
+{
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+
+	printf("=============================\n");
+	printf("wait strategies\n");
+
+	pq_attr_init(&attr);
+	attr.flags = PQ_ATTR_SPIN_ADAPTIVE;
+
+	for ( attr.engine = PQ_ENGINE_MUTEX ; attr.engine < PQ_ENGINE_CHUNKED ; attr.engine++ ) {
+		for ( attr.wait_strategy = PQ_WAIT_SPIN ; attr.wait_strategy < PQ_WAIT_MAX ; attr.wait_strategy++ ) {
+			printf("engine %d strategy %d\n", attr.engine, attr.wait_strategy);
+
+			pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+
+			timed(pq);
+
+			// Busy spinning on a single CPU only makes progress when preempted
+			if (attr.wait_strategy != PQ_WAIT_SPIN)
+				backpressure(pq);
+
+			pq_free(pq);
+		}
+	}
+}
+
+/* Worker process attached through the memfd of the parent */
+int shm_worker(int fd)
+{
+	struct pq_shm *sq;
+	__u32 *obj;
+
+	sq = pq_shm_open_fd(fd);
+	if (sq == NULL)
+		return 1;
+
+	for ( __u32 i = 0 ; i < SHM_ITERATIONS ; i++ ) {
+		obj = pq_shm_pop(sq, 1);
+		if (obj == NULL || *obj != i)
+			return 2;
+		pq_shm_put(sq, obj);
+	}
+
+	pq_shm_close(sq);
+
+	return 0;
+}
+
+void *reserve_producer(void *arg)
+{
+	struct ptr_queue *pq;
+	void **span;
+	__u64 next;
+	__s32 n;
+
+	pq = (struct ptr_queue*) arg;
+	next = 1;
+
+	while (next <= STRESS_ITERATIONS) {
+		n = pq_reserve(pq, &span, MPMC_BATCH);
+		if (n <= 0) {
+			sched_yield();
+			continue;
+		}
+
+		for ( __s32 i = 0 ; i < n ; i++ )
+			span[i] = (void*) (next + i);
+
+		// Past the end the SPSC engine commits only what is left
+		if (pq->engine == PQ_ENGINE_SPSC && next + n > STRESS_ITERATIONS + 1)
+			n = STRESS_ITERATIONS + 1 - next;
+		else if (next + n > STRESS_ITERATIONS + 1)
+			for ( __s32 i = STRESS_ITERATIONS + 1 - next ; i < n ; i++ )
+				span[i] = (void*) 0;
+
+		pq_commit(pq, span, n);
+		next += n;
+	}
+
+	return NULL;
+}
+
+/* Fill and drain spans of the ring in place */
+void reserve()
+{
+	struct ptr_queue *pq;
+	pthread_t thread;
+	void **span;
+	__u64 expect;
+	__s32 n;
+
+	printf("=============================\n");
+	printf("reserve and peek\n");
+
+	pq = pq_init(QUEUE_CAPACITY, 0);
+	if (pq_reserve(pq, &span, 1) != -ENOTSUP || pq_peek_n(pq, &span, 1, 0) != -ENOTSUP) {
+		printf("%s mutex engine accepted\n", __FUNCTION__);
+		exit(-1);
+	}
+	pq_free(pq);
+
+	for ( int engine = PQ_ENGINE_SPSC ; engine < PQ_ENGINE_CHUNKED ; engine++ ) {
+		pq = engine == PQ_ENGINE_SPSC ? pq_init_spsc(QUEUE_CAPACITY, 0) : pq_init_mpmc(QUEUE_CAPACITY, 0);
+
+		pthread_create(&thread, NULL, reserve_producer, pq);
+
+		expect = 1;
+		while (expect <= STRESS_ITERATIONS) {
+			n = pq_peek_n(pq, &span, 3, 1);
+
+			for ( __s32 i = 0 ; i < n ; i++ ) {
+				if (span[i] == NULL)
+					continue;
+				if ((__u64) span[i] != expect) {
+					printf("%s bad entry %p expected %llu\n", __FUNCTION__, span[i], 
+						(unsigned long long) expect);
+					exit(-1);
+				}
+				expect++;
+			}
+
+			pq_release(pq, span, n);
+		}
+
+		pthread_join(thread, NULL);
+
+		// Padding entries of the last MPMC span
+		while (pq_peek_n(pq, &span, 1, 0) == 1)
+			pq_release(pq, span, 1);
+
+		if (pq_len(pq) != 0) {
+			printf("%s queue not empty %d\n", __FUNCTION__, pq_len(pq));
+			exit(-1);
+		}
+
+		pq_free(pq);
+	}
+}
+
+/* Hand objects of a shared pool between processes */
+void shm()
+{
+	struct pq_shm *sq, *peer;
+	char name[64];
+	__u32 *obj, *seen;
+	pid_t pid;
+	int status;
+
+	printf("=============================\n");
+	printf("shared memory queue\n");
+
+	sq = pq_shm_create(NULL, QUEUE_CAPACITY, sizeof(__u32));
+	if (sq == NULL) {
+		printf("%s create failed %d\n", __FUNCTION__, errno);
+		exit(-1);
+	}
+
+	// The memfd does not leak into programs the process executes
+	if (!(fcntl(pq_shm_fd(sq), F_GETFD) & FD_CLOEXEC)) {
+		printf("%s memfd not close-on-exec\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	pid = fork();
+	if (pid == 0)
+		_exit(shm_worker(pq_shm_fd(sq)));
+
+	for ( __u32 i = 0 ; i < SHM_ITERATIONS ; i++ ) {
+		obj = pq_shm_get(sq, 1);
+		*obj = i;
+		pq_shm_push(sq, obj);
+	}
+
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("%s worker failed %d\n", __FUNCTION__, status);
+		exit(-1);
+	}
+
+	if (pq_shm_len(sq) != 0 || pq_shm_push(sq, &status) == 0) {
+		printf("%s bad state\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	pq_shm_close(sq);
+
+	// A named queue mapped twice sees the same object at different addresses
+	snprintf(name, sizeof(name), "/ptrqueue-test-%d", getpid());
+	sq = pq_shm_create(name, QUEUE_CAPACITY, 64);
+	peer = pq_shm_open(name);
+	if (sq == NULL || peer == NULL || peer->base == sq->base) {
+		printf("%s named queue failed %d\n", __FUNCTION__, errno);
+		exit(-1);
+	}
+
+	obj = pq_shm_get(sq, 0);
+	*obj = 0xfeed;
+	pq_shm_push(sq, obj);
+
+	seen = pq_shm_pop(peer, 0);
+	if (seen == NULL || *seen != 0xfeed || pq_shm_pop(peer, 0) != NULL || errno != EAGAIN) {
+		printf("%s bad object %p\n", __FUNCTION__, (void*) seen);
+		exit(-1);
+	}
+	pq_shm_put(peer, seen);
+
+	pq_shm_unlink(name);
+	pq_shm_close(peer);
+	pq_shm_close(sq);
+}
+
+void spsc()
+{
+	struct ptr_queue *pq;
+
+	printf("=============================\n");
+	printf("spsc engine\n");
+
+	pq = pq_init_spsc(QUEUE_CAPACITY, 0);
+
+	fill(pq);
+
+	empty(pq);
+
+	iterate(pq);
+
+	batch(pq);
+
+	stress(pq);
+
+	backpressure(pq);
+
+	timed(pq);
+
+	pq_free(pq);
+}
+
+void *overflow_consumer(void *arg)
+{
+	usleep(10000);
+	pq_pop((struct ptr_queue *) arg, 0);
+
+	return NULL;
+}
+
+/* Overflow policies of a full queue */
+void overflow()
+{
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+	pthread_t thread;
+	void *evicted;
+	__u64 msg;
+	__u32 cap;
+
+	printf("=============================\n");
+	printf("overflow\n");
+
+	pq_attr_init(&attr);
+	attr.engine = PQ_ENGINE_SPSC;
+	attr.overflow = PQ_OVERFLOW_OVERWRITE;
+	if (pq_init_attr(QUEUE_CAPACITY, 0, &attr) != NULL || errno != EINVAL) {
+		printf("%s lock-free overwrite accepted\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	// Overwrite evicts the oldest entry and hands it back
+	attr.engine = PQ_ENGINE_MUTEX;
+	pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+	for ( __u64 i = 1 ; i <= QUEUE_CAPACITY ; i++ )
+		pq_push(pq, (void*) i);
+	if (pq_push_evict(pq, (void*) (QUEUE_CAPACITY + 1), &evicted) != 0 || 
+		evicted != (void*) 1 || pq_push(pq, (void*) (QUEUE_CAPACITY + 2)) != 0 || 
+		pq_len(pq) != QUEUE_CAPACITY || pq_dropped(pq) != 2) {
+		printf("%s overwrite evicted %p len %d dropped %llu\n", __FUNCTION__, 
+			evicted, pq_len(pq), (unsigned long long) pq_dropped(pq));
+		exit(-1);
+	}
+	for ( __u64 i = 3 ; i <= QUEUE_CAPACITY + 2 ; i++ ) {
+		if (pq_pop(pq, 0) != (void*) i) {
+			printf("%s overwrite out of order at %llu\n", __FUNCTION__, 
+				(unsigned long long) i);
+			exit(-1);
+		}
+	}
+	pq_free(pq);
+
+	// In message mode the oldest message is discarded
+	attr.msg_size = sizeof(msg);
+	pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+	for ( msg = 1 ; msg <= QUEUE_CAPACITY + 1 ; msg++ )
+		pq_push_copy(pq, &msg, 0);
+	if (pq_pop_copy(pq, &msg, 0) != 0 || msg != 2) {
+		printf("%s message overwrite got %llu\n", __FUNCTION__, (unsigned long long) msg);
+		exit(-1);
+	}
+	pq_free(pq);
+	printf("%s overwrite pass\n", __FUNCTION__);
+
+	for ( int engine = 0 ; engine < PQ_ENGINE_CHUNKED ; engine++ ) {
+		pq_attr_init(&attr);
+		attr.engine = engine;
+		pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+		cap = pq->user_capacity;
+		for ( __u64 i = 1 ; i <= cap ; i++ )
+			pq_push(pq, (void*) i);
+
+		// Reject fails the push
+		if (pq_push(pq, (void*) 1) == 0 || errno != ENOMEM) {
+			printf("%s engine %d reject accepted\n", __FUNCTION__, engine);
+			exit(-1);
+		}
+
+		// Drop discards the new entry and hands it back
+		if (pq_set_overflow(pq, PQ_OVERFLOW_OVERWRITE) == (engine == PQ_ENGINE_MUTEX) ||
+			pq_set_overflow(pq, PQ_OVERFLOW_DROP) != 0 || 
+			pq_push_evict(pq, (void*) (__u64) (cap + 1), &evicted) != 0 || 
+			evicted != (void*) (__u64) (cap + 1) || pq_push(pq, (void*) 1) != 0 ||
+			pq_dropped(pq) != 2 || pq_len(pq) != (__s32) cap) {
+			printf("%s engine %d drop evicted %p dropped %llu\n", __FUNCTION__, 
+				engine, evicted, (unsigned long long) pq_dropped(pq));
+			exit(-1);
+		}
+
+		// Block waits for a consumer to make room
+		pq_set_overflow(pq, PQ_OVERFLOW_BLOCK);
+		pthread_create(&thread, NULL, overflow_consumer, pq);
+		if (pq_push(pq, (void*) (__u64) (cap + 2)) != 0) {
+			printf("%s engine %d block failed\n", __FUNCTION__, engine);
+			exit(-1);
+		}
+		pthread_join(thread, NULL);
+
+		for ( __u64 i = 2 ; i <= cap + 2 ; i++ ) {
+			if (i == cap + 1)
+				continue;
+			if (pq_pop(pq, 0) != (void*) i) {
+				printf("%s engine %d out of order at %llu\n", __FUNCTION__, 
+					engine, (unsigned long long) i);
+				exit(-1);
+			}
+		}
+
+		printf("%s engine %d pass\n", __FUNCTION__, engine);
+		pq_free(pq);
+	}
+}
+
+int wm_events[8];
+__u32 wm_lens[8];
+int wm_count;
+
+void watermark_cb(struct ptr_queue *pq, int high, __u32 len, void *arg)
+{
+	(void) pq;
+
+	if (wm_count < 8) {
+		wm_events[wm_count] = high;
+		wm_lens[wm_count] = len;
+	}
+	wm_count++;
+	(*(int*) arg)++;
+}
+
+/* Lock-free length reads and watermark callbacks */
+void watermarks()
+{
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+	void *ptrs[QUEUE_CAPACITY];
+	int calls;
+
+	printf("=============================\n");
+	printf("watermarks\n");
+
+	pq_attr_init(&attr);
+	attr.wm_fn = watermark_cb;
+	attr.wm_arg = &calls;
+	attr.wm_low = 8;
+	attr.wm_high = 8;
+	if (pq_init_attr(QUEUE_CAPACITY, 0, &attr) != NULL || errno != EINVAL) {
+		printf("%s low == high accepted\n", __FUNCTION__);
+		exit(-1);
+	}
+
+	// The length is read without the lock
+	pq = pq_init(QUEUE_CAPACITY, 0);
+	pq_push(pq, (void*) 1);
+	pthread_mutex_lock(&pq->mtx);
+	if (pq_len(pq) != 1 || pq_empty(pq) != 0) {
+		printf("%s locked len %d\n", __FUNCTION__, pq_len(pq));
+		exit(-1);
+	}
+	pthread_mutex_unlock(&pq->mtx);
+	pq_free(pq);
+
+	attr.wm_low = 2;
+	for ( int engine = 0 ; engine < PQ_ENGINE_MAX ; engine++ ) {
+		attr.engine = engine;
+		pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+		if (pq->fast_path) {
+			printf("%s engine %d fast path with watermarks\n", __FUNCTION__, engine);
+			exit(-1);
+		}
+		calls = 0;
+		wm_count = 0;
+
+		// Up to 9, down to 1, then up to 10 in one batch
+		for ( __u64 i = 1 ; i <= 9 ; i++ )
+			pq_push(pq, (void*) i);
+		for ( int i = 0 ; i < 8 ; i++ )
+			pq_pop(pq, 0);
+		for ( __u64 i = 0 ; i < QUEUE_CAPACITY ; i++ )
+			ptrs[i] = (void*) (i + 1);
+		pq_pop(pq, 0);
+		pq_push_n(pq, ptrs, QUEUE_CAPACITY);
+
+		if (calls != 3 || wm_count != 3 || 
+			wm_events[0] != 1 || wm_lens[0] != 8 || 
+			wm_events[1] != 0 || wm_lens[1] != 2 || 
+			wm_events[2] != 1 || wm_lens[2] != QUEUE_CAPACITY) {
+			printf("%s engine %d calls %d\n", __FUNCTION__, engine, calls);
+			for ( int i = 0 ; i < wm_count && i < 8 ; i++ )
+				printf("%s event %d high %d len %u\n", __FUNCTION__, i, wm_events[i], wm_lens[i]);
+			exit(-1);
+		}
+
+		printf("%s engine %d pass\n", __FUNCTION__, engine);
+		pq_free(pq);
+	}
+
+	// A pool starts full without a call, draining it calls once
+	attr.engine = PQ_ENGINE_MUTEX;
+	calls = 0;
+	wm_count = 0;
+	pq = pq_init_attr(QUEUE_CAPACITY, sizeof(__u64), &attr);
+	if (calls != 0) {
+		printf("%s pool fill called %d\n", __FUNCTION__, calls);
+		exit(-1);
+	}
+	for ( int i = 0 ; i < QUEUE_CAPACITY - 2 ; i++ )
+		pq_pop(pq, 0);
+	if (calls != 1 || wm_events[0] != 0 || wm_lens[0] != 2) {
+		printf("%s pool drain calls %d\n", __FUNCTION__, calls);
+		exit(-1);
+	}
+	pq_free(pq);
+}
+
+void async_cb(struct pq_waiter *w)
+{
+	(*(int*) w->arg)++;
+}
+
+/* Continuations registered instead of blocking */
+void async()
+{
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+	struct pq_waiter w[2];
+	int calls[2];
+
+	printf("=============================\n");
+	printf("async\n");
+
+	for ( int engine = 0 ; engine < PQ_ENGINE_MAX ; engine++ ) {
+		pq_attr_init(&attr);
+		attr.engine = engine;
+		attr.flags = PQ_ATTR_POW2;
+		pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+		for ( int i = 0 ; i < 2 ; i++ ) {
+			calls[i] = 0;
+			w[i].fn = async_cb;
+			w[i].arg = &calls[i];
+		}
+
+		// One entry calls the first waiter only, the inline push included
+		if (pq_async_wait(pq, &w[0], 0) != 0 || pq_async_wait(pq, &w[1], 0) != 0) {
+			printf("%s engine %d wait on empty failed\n", __FUNCTION__, engine);
+			exit(-1);
+		}
+		pq_push_inline(pq, (void*) 1);
+		if (calls[0] != 1 || calls[1] != 0 || pq_async_cancel(pq, &w[0]) == 0 || errno != ENOENT) {
+			printf("%s engine %d calls %d %d\n", __FUNCTION__, engine, calls[0], calls[1]);
+			exit(-1);
+		}
+
+		// A ready queue does not register, a cancelled waiter is not called
+		if (pq_async_wait(pq, &w[0], 0) == 0 || errno != EALREADY) {
+			printf("%s engine %d registered on a ready queue\n", __FUNCTION__, engine);
+			exit(-1);
+		}
+		pq_pop(pq, 0);
+		if (pq_async_cancel(pq, &w[1]) != 0) {
+			printf("%s engine %d cancel failed\n", __FUNCTION__, engine);
+			exit(-1);
+		}
+		pq_push(pq, (void*) 1);
+		if (calls[0] != 1 || calls[1] != 0) {
+			printf("%s engine %d cancelled waiter called\n", __FUNCTION__, engine);
+			exit(-1);
+		}
+
+		// Waiters for a free slot are called by pops
+		if (engine != PQ_ENGINE_CHUNKED) {
+			while (pq_push(pq, (void*) 1) == 0)
+				;
+			if (pq_async_wait(pq, &w[1], 1) != 0) {
+				printf("%s engine %d wait on full failed\n", __FUNCTION__, engine);
+				exit(-1);
+			}
+			pq_pop_inline(pq, 0);
+			if (calls[1] != 1) {
+				printf("%s engine %d pop did not call\n", __FUNCTION__, engine);
+				exit(-1);
+			}
+		}
+
+		printf("%s engine %d pass\n", __FUNCTION__, engine);
+		pq_free(pq);
+	}
+}
+
+int main()
+{
+	struct ptr_queue *pq;
+
+	pq = pq_init(QUEUE_CAPACITY, 0);
+
+	pq_print(pq);
+
+	fill(pq);
+
+	pq_print(pq);
+
+	empty(pq);
+
+	pq_print(pq);
+
+	iterate(pq);
+
+	batch(pq);
+
+	threads(pq);
+
+	stress(pq);
+
+	backpressure(pq);
+
+	timed(pq);
+
+	mpmc_stress(pq);
+
+	mpmc_batch = 1;
+	mpmc_stress(pq);
+	mpmc_batch = 0;
+
+	pq_free(pq);
+
+	spsc();
+
+	mpmc();
+
+	pow2();
+
+	strategies();
+
+	pool();
+
+	pool_mag();
+
+	numa();
+
+	warm();
+
+	shm();
+
+	msgs();
+
+	reserve();
+
+	grow();
+
+	chunked();
+
+	groups();
+
+	prios();
+
+	polls();
+	bcast();
+	stats();
+	latency();
+	inlined();
+	overflow();
+	watermarks();
+	async();
 
 	return 0;
 }
@@ -0,0 +1,304 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**       
+ * @file        testbench_async.cpp
+ *
+ * @brief       Testbench for the C++20 coroutine awaitables of main_async.hpp
+ *   
+ * @copyright   Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *       
+ * @date        Mar 2024
+ * @author      Barrett Edwards <code@jrlabs.io>
+ *          
+ */
+
+/* INCLUDES ==================================================================*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <thread>
+
+#include "main.h"
+#include "main_async.hpp"
+
+/* MACROS ====================================================================*/
+
+#define QUEUE_CAPACITY 4
+#define CONSUMERS 64
+#define ITERATIONS 20000
+#define ROUNDS 10000
+#define RELAYS 200000
+
+/* STRUCTS ===================================================================*/
+
+/**
+ * Eager coroutine that frees its frame when it finishes, so a coroutine 
+ * resumed inline by a waker is gone by the time the waker returns
+ */
+struct task
+{
+	struct promise_type
+	{
+		task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { abort(); }
+	};
+};
+
+/* GLOBAL VARIABLES ==========================================================*/
+
+std::atomic<__u64> popped;
+std::atomic<__u64> sum;
+std::atomic<int> done;
+
+/* FUNCTIONS =================================================================*/
+
+task consumer(pq::queue &q, int n)
+{
+	for ( int i = 0 ; i < n ; i++ ) {
+		void *ptr = co_await q.pop();
+		if (ptr == NULL) {
+			printf("%s pop failed errno %d\n", __FUNCTION__, errno);
+			exit(-1);
+		}
+		sum += (__u64) ptr;
+		popped++;
+	}
+}
+
+task producer(pq::queue &q, __u64 first, __u64 n)
+{
+	for ( __u64 i = first ; i < first + n ; i++ ) {
+		if (co_await q.push((void*) i) != 0) {
+			printf("%s push failed errno %d\n", __FUNCTION__, errno);
+			exit(-1);
+		}
+	}
+}
+
+// A coroutine awaiting one entry, it finishes inside the waker
+task single(pq::queue &q)
+{
+	void *ptr = co_await q.pop();
+	sum += (__u64) ptr;
+	done++;
+}
+
+// Awaits one pop and records what it returned
+task probe(pq::queue &q, void **ptr, int *err)
+{
+	*ptr = co_await q.pop();
+	*err = errno;
+	done++;
+}
+
+// Moves an entry from one queue to the other, n times
+task relay(pq::queue &in, pq::queue &out, int n)
+{
+	for ( int i = 0 ; i < n ; i++ ) {
+		void *ptr = co_await in.pop();
+		if (co_await out.push(ptr) != 0) {
+			printf("%s push failed errno %d\n", __FUNCTION__, errno);
+			exit(-1);
+		}
+	}
+	done++;
+}
+
+/* Suspended pops resumed inline by pushes from another thread */
+void pops(int engine)
+{
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+	__u64 total, want;
+
+	pq_attr_init(&attr);
+	attr.engine = engine;
+	pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+	pq::queue q(pq);
+
+	// Each consumer suspends on the empty queue before the producer starts
+	popped = 0;
+	sum = 0;
+	total = (__u64) CONSUMERS * ITERATIONS;
+	for ( int i = 0 ; i < CONSUMERS ; i++ )
+		consumer(q, ITERATIONS);
+
+	std::thread thread([pq, total] {
+		for ( __u64 i = 1 ; i <= total ; i++ )
+			while (pq_push(pq, (void*) i) != 0)
+				std::this_thread::yield();
+	});
+	thread.join();
+
+	want = total * (total + 1) / 2;
+	if (popped != total || sum != want || pq_len(pq) != 0) {
+		printf("%s engine %d popped %llu sum %llu want %llu\n", __FUNCTION__, engine, 
+			(unsigned long long) popped.load(), (unsigned long long) sum.load(), 
+			(unsigned long long) want);
+		exit(-1);
+	}
+
+	// Race the registration of a waiter with the push that resumes it
+	sum = 0;
+	done = 0;
+	for ( int i = 1 ; i <= ROUNDS ; i++ ) {
+		std::thread racer([pq, i] { pq_push(pq, (void*) (__u64) i); });
+		single(q);
+		racer.join();
+		while (done != i)
+			std::this_thread::yield();
+	}
+	if (sum != (__u64) ROUNDS * (ROUNDS + 1) / 2 || pq_len(pq) != 0) {
+		printf("%s engine %d race sum %llu\n", __FUNCTION__, engine, 
+			(unsigned long long) sum.load());
+		exit(-1);
+	}
+
+	printf("%s engine %d pass\n", __FUNCTION__, engine);
+	pq_free(pq);
+}
+
+/* Suspended pushes resumed by pops from another thread */
+void pushes(int engine)
+{
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+	__u64 total, got;
+	void *ptr;
+
+	pq_attr_init(&attr);
+	attr.engine = engine;
+	pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+	pq::queue q(pq);
+
+	// The producers fill the queue and suspend, the thread drains it
+	total = (__u64) CONSUMERS * ITERATIONS;
+	for ( int i = 0 ; i < CONSUMERS ; i++ )
+		producer(q, 1 + (__u64) i * ITERATIONS, ITERATIONS);
+
+	got = 0;
+	std::thread thread([pq, total, &got] {
+		__u64 s = 0;
+		for ( __u64 i = 0 ; i < total ; i++ ) {
+			void *p;
+			while ((p = pq_pop(pq, 0)) == NULL)
+				std::this_thread::yield();
+			s += (__u64) p;
+		}
+		got = s;
+	});
+	thread.join();
+
+	ptr = pq_pop(pq, 0);
+	if (got != total * (total + 1) / 2 || ptr != NULL) {
+		printf("%s engine %d sum %llu left %p\n", __FUNCTION__, engine, 
+			(unsigned long long) got, ptr);
+		exit(-1);
+	}
+
+	printf("%s engine %d pass\n", __FUNCTION__, engine);
+	pq_free(pq);
+}
+
+/* A pop on a mutex queue whose lock is held blocks on the lock once */
+void busy()
+{
+	struct ptr_queue *pq;
+	std::atomic<int> locked;
+
+	pq = pq_init(QUEUE_CAPACITY, 0);
+	pq::queue q(pq);
+	pq_push(pq, (void*) 1);
+
+	sum = 0;
+	done = 0;
+	locked = 0;
+	std::thread holder([pq, &locked] {
+		pthread_mutex_lock(&pq->mtx);
+		locked = 1;
+		usleep(20000);
+		pthread_mutex_unlock(&pq->mtx);
+	});
+	while (locked == 0)
+		std::this_thread::yield();
+
+	// pq_pop(pq, 0) waits out the held lock, the awaiter gets the entry
+	single(q);
+	holder.join();
+	if (done != 1 || sum != 1 || pq_len(pq) != 0) {
+		printf("%s done %d sum %llu\n", __FUNCTION__, done.load(), 
+			(unsigned long long) sum.load());
+		exit(-1);
+	}
+
+	printf("%s pass\n", __FUNCTION__);
+	pq_free(pq);
+}
+
+/* NULL entries, failed pops and chains of coroutines waking each other */
+void errors()
+{
+	struct ptr_queue *pq;
+	struct pq_attr attr;
+	void *ptr;
+	int err;
+
+	// A queued NULL entry is returned with errno 0
+	pq = pq_init(QUEUE_CAPACITY, 0);
+	pq::queue q(pq);
+	done = 0;
+	probe(q, &ptr, &err);
+	pq_push(pq, NULL);
+	if (done != 1 || ptr != NULL || err != 0) {
+		printf("%s NULL entry done %d errno %d\n", __FUNCTION__, done.load(), err);
+		exit(-1);
+	}
+
+	/* Waiting coroutines pass a token on, each resumed from the push of the
+	 * one before. Resumes nesting in the waker would overflow the stack
+	 */
+	done = 0;
+	for ( int i = 0 ; i < RELAYS ; i++ )
+		relay(q, q, 1);
+	pq_push(pq, (void*) 1);
+	if (done != RELAYS || pq_len(pq) != 1) {
+		printf("%s relay done %d\n", __FUNCTION__, done.load());
+		exit(-1);
+	}
+	pq_free(pq);
+
+	// A pop that fails for another reason than empty completes with the error
+	pq_attr_init(&attr);
+	attr.msg_size = 16;
+	pq = pq_init_attr(QUEUE_CAPACITY, 0, &attr);
+	pq::queue m(pq);
+	done = 0;
+	probe(m, &ptr, &err);
+	if (done != 1 || ptr != NULL || err != EINVAL) {
+		printf("%s message queue done %d errno %d\n", __FUNCTION__, done.load(), err);
+		exit(-1);
+	}
+	pq_free(pq);
+
+	printf("%s pass\n", __FUNCTION__);
+}
+
+int main()
+{
+	for ( int engine = 0 ; engine < PQ_ENGINE_MAX ; engine++ )
+		pops(engine);
+
+	for ( int engine = 0 ; engine < PQ_ENGINE_CHUNKED ; engine++ )
+		pushes(engine);
+
+	busy();
+
+	errors();
+
+	return 0;
+}